@@ -0,0 +1,136 @@
+/* An allocation-free steady state for flat_queue, switched on through
+ * its Policy (see steady_queue_policy in flat_queue.h), for paths that
+ * must show they never reach malloc once they are warmed up.
+ * 1. allocation_guard is the hook a policy plugs in as its guard_type.
+ *    It does nothing until guard().freeze() is called, typically right
+ *    after a warm-up reserve(). From then on the queue compacts strictly
+ *    in place: when the tail reaches the end of the buffer with any room
+ *    in front of it, or pop() passes the growth policy's compaction
+ *    point, the elements slide down to the start of the buffer they are
+ *    in instead of moving to a new one, so a push never allocates while
+ *    size() < capacity(). A slide moves size() elements and makes room
+ *    for capacity() - size() pushes, so reserve() headroom above the
+ *    steady depth: a queue held at 90% of its capacity moves nine
+ *    elements per push. thaw() goes back to normal compactions.
+ *    no_guard is the default and compiles to nothing.
+ * 2. An allocation the queue cannot avoid while frozen (a push into a
+ *    full buffer, or one whose elements may throw when moved, or an
+ *    explicit reserve, shrink_to_fit or compress) is a violation: the
+ *    guard counts it, fills in an allocation_violation and calls its
+ *    handler before the allocation happens. The handler may throw to
+ *    refuse it; if it returns the allocation goes ahead, so production
+ *    code keeps running while the count says the promise was broken.
+ *    set_handler() installs one.
+ * 3. In debug builds (without NDEBUG, where <execinfo.h> exists) the
+ *    violation carries the stack at the point of the allocation, and
+ *    the default handler, log_allocation_violation, prints it to stderr.
+ *    In release builds it prints the queue and the size only.
+ * 4. flat_queue::try_push() and try_emplace() are the other half: they
+ *    never allocate under any policy, sliding the queue down if there is
+ *    room in front of it and returning false if the buffer is full, or
+ *    shared with a copy or snapshot (see queue_snapshot.h).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#if !defined(NDEBUG) && defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define DIZZY_HAVE_BACKTRACE 1
+#endif
+#endif
+
+namespace dizzy {
+
+struct allocation_violation {
+  static constexpr int max_frames = 32;
+
+  const void* queue;
+  std::size_t bytes;
+  void* frames[max_frames];
+  int depth;
+};
+
+using allocation_handler = void (*)(const allocation_violation&);
+
+void log_allocation_violation(const allocation_violation& violation);
+
+struct no_guard {
+  bool frozen() const { return false; }
+  void on_allocation(const void*, std::size_t) {}
+};
+
+class allocation_guard {
+public:
+  void freeze();
+  void thaw();
+  bool frozen() const;
+
+  std::uint64_t violations() const;
+  allocation_handler handler() const;
+  void set_handler(allocation_handler handler);
+
+  void on_allocation(const void* queue, std::size_t bytes);
+
+private:
+  bool frozen_ = false;
+  std::uint64_t violations_ = 0;
+  allocation_handler handler_ = &log_allocation_violation;
+};
+
+inline void log_allocation_violation(const allocation_violation& violation) {
+  std::fprintf(stderr,
+               "dizzy: queue %p allocated %zu bytes while frozen\n",
+               violation.queue, violation.bytes);
+#ifdef DIZZY_HAVE_BACKTRACE
+  backtrace_symbols_fd(violation.frames, violation.depth, 2);
+#endif
+}
+
+inline void allocation_guard::freeze() {
+  frozen_ = true;
+}
+
+inline void allocation_guard::thaw() {
+  frozen_ = false;
+}
+
+inline bool allocation_guard::frozen() const {
+  return frozen_;
+}
+
+inline std::uint64_t allocation_guard::violations() const {
+  return violations_;
+}
+
+inline allocation_handler allocation_guard::handler() const {
+  return handler_;
+}
+
+inline void allocation_guard::set_handler(allocation_handler handler) {
+  handler_ = handler;
+}
+
+inline void allocation_guard::on_allocation(const void* queue,
+                                            std::size_t bytes) {
+  if (!frozen_) {
+    return;
+  }
+  ++violations_;
+  allocation_violation violation;
+  violation.queue = queue;
+  violation.bytes = bytes;
+  violation.depth = 0;
+#ifdef DIZZY_HAVE_BACKTRACE
+  violation.depth =
+      backtrace(violation.frames, allocation_violation::max_frames);
+#endif
+  if (handler_) {
+    handler_(violation);
+  }
+}
+}
@@ -0,0 +1,261 @@
+/* Google Benchmark suite comparing flat_queue with the usual alternatives:
+ * std::queue over std::deque, std::queue over std::list, and a growable
+ * power-of-two ring buffer.
+ * 1. Every queue runs every workload with 4, 16, 64 and 256 byte
+ *    elements:
+ *    - steady: the queue sits at a fixed depth, one push per pop.
+ *    - burst: push a burst, then pop all of it.
+ *    - sawtooth: push two and pop one until the queue is deep, then
+ *      drain it, over and over; this is the shape that makes
+ *      flat_queue compact on both the push and the pop side.
+ *    - drain: fill the queue, then pop everything.
+ * 2. Each benchmark reports items_per_second for throughput. The "lat/"
+ *    variants time every single operation with a latency_timer and add
+ *    p50, p99, p99.9 and max counters in nanoseconds; those numbers
+ *    include the timer's own overhead, so compare them with each other
+ *    rather than with the throughput runs.
+ * 3. For machine-readable output use Google Benchmark's own flags:
+ *      ./flat_queue_bench --benchmark_out=run.json \
+ *                         --benchmark_out_format=json
+ *    and --benchmark_filter=... to pick a subset.
+ *
+ * Build from this directory with something like
+ *   g++ -std=c++17 -O2 -I.. flat_queue_bench.cpp -lbenchmark -lpthread \
+ *       -o flat_queue_bench
+ */
+
+#include "flat_queue.h"
+#include "latency.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+
+namespace {
+
+template <std::size_t N> struct payload {
+  unsigned char bytes[N];
+
+  payload() = default;
+  explicit payload(std::uint32_t seed) {
+    for (std::size_t i = 0; i < N; ++i) {
+      bytes[i] = static_cast<unsigned char>(seed + i);
+    }
+  }
+};
+
+// The ring buffer contender: a power-of-two circular buffer that doubles
+// (and unwraps) when full.
+template <typename T> class ring_queue {
+public:
+  using value_type = T;
+
+  bool empty() const { return head_ == tail_; }
+  std::size_t size() const { return tail_ - head_; }
+  T& front() { return buffer_[head_ & mask_]; }
+
+  void push(const T& val) {
+    if (size() == capacity_) {
+      grow();
+    }
+    buffer_[tail_++ & mask_] = val;
+  }
+  void pop() { ++head_; }
+
+private:
+  std::unique_ptr<T[]> buffer_;
+  std::size_t capacity_ = 0;
+  std::size_t mask_ = 0;
+  std::size_t head_ = 0;
+  std::size_t tail_ = 0;
+
+  void grow() {
+    std::size_t capacity = capacity_ ? capacity_ * 2 : 16;
+    std::unique_ptr<T[]> buffer(new T[capacity]);
+    std::size_t count = size();
+    for (std::size_t i = 0; i < count; ++i) {
+      buffer[i] = buffer_[(head_ + i) & mask_];
+    }
+    buffer_ = std::move(buffer);
+    capacity_ = capacity;
+    mask_ = capacity - 1;
+    head_ = 0;
+    tail_ = count;
+  }
+};
+
+template <typename T> using deque_queue = std::queue<T, std::deque<T>>;
+template <typename T> using list_queue = std::queue<T, std::list<T>>;
+
+// Drives a queue, either flat out or timing each operation into
+// histograms when Timed is set.
+template <typename Queue, bool Timed> class driver {
+public:
+  using value_type = typename Queue::value_type;
+
+  void push(std::uint32_t seed) {
+    if (Timed) {
+      auto started = timer_.start();
+      queue_.push(value_type(seed));
+      timer_.stop(dizzy::latency_op::push, started);
+    } else {
+      queue_.push(value_type(seed));
+    }
+  }
+
+  void pop() {
+    benchmark::DoNotOptimize(queue_.front());
+    if (Timed) {
+      auto started = timer_.start();
+      queue_.pop();
+      timer_.stop(dizzy::latency_op::pop, started);
+    } else {
+      queue_.pop();
+    }
+  }
+
+  std::size_t size() const { return queue_.size(); }
+
+  void report(benchmark::State& state) {
+    if (!Timed) {
+      return;
+    }
+    const double scale = dizzy::default_latency_clock::ns_per_tick();
+    auto add = [&](const char* prefix, const dizzy::latency_histogram& h) {
+      std::string name(prefix);
+      state.counters[name + "_p50_ns"] = h.percentile(50.0) * scale;
+      state.counters[name + "_p99_ns"] = h.percentile(99.0) * scale;
+      state.counters[name + "_p999_ns"] = h.percentile(99.9) * scale;
+      state.counters[name + "_max_ns"] = h.max() * scale;
+    };
+    add("push", histograms_.push);
+    add("pop", histograms_.pop);
+  }
+
+  driver() { timer_.set_sink(histograms_); }
+
+private:
+  Queue queue_;
+  dizzy::queue_latency histograms_;
+  dizzy::latency_timer<> timer_;
+};
+
+constexpr std::size_t depth = 4096;
+
+template <typename Queue, bool Timed> void steady(benchmark::State& state) {
+  driver<Queue, Timed> q;
+  std::uint32_t seed = 0;
+  for (std::size_t i = 0; i < depth; ++i) {
+    q.push(seed++);
+  }
+  for (auto _ : state) {
+    q.push(seed++);
+    q.pop();
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+  q.report(state);
+}
+
+template <typename Queue, bool Timed> void burst(benchmark::State& state) {
+  driver<Queue, Timed> q;
+  std::uint32_t seed = 0;
+  for (auto _ : state) {
+    for (std::size_t i = 0; i < depth; ++i) {
+      q.push(seed++);
+    }
+    for (std::size_t i = 0; i < depth; ++i) {
+      q.pop();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * depth * 2);
+  q.report(state);
+}
+
+template <typename Queue, bool Timed> void sawtooth(benchmark::State& state) {
+  driver<Queue, Timed> q;
+  std::uint32_t seed = 0;
+  std::size_t operations = 0;
+  for (auto _ : state) {
+    while (q.size() < depth) {
+      q.push(seed++);
+      q.push(seed++);
+      q.pop();
+      operations += 3;
+    }
+    while (q.size() != 0) {
+      q.pop();
+      ++operations;
+    }
+  }
+  state.SetItemsProcessed(operations);
+  q.report(state);
+}
+
+template <typename Queue, bool Timed> void drain(benchmark::State& state) {
+  driver<Queue, Timed> q;
+  std::uint32_t seed = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (std::size_t i = 0; i < depth * 4; ++i) {
+      q.push(seed++);
+    }
+    state.ResumeTiming();
+    while (q.size() != 0) {
+      q.pop();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * depth * 4);
+  q.report(state);
+}
+
+template <template <typename> class Queue, std::size_t N, bool Timed>
+void register_workloads(const std::string& queue_name) {
+  using queue = Queue<payload<N>>;
+  std::string suffix = "/" + queue_name + "/" + std::to_string(N) + "B";
+  std::string prefix = Timed ? "lat/" : "";
+  benchmark::RegisterBenchmark((prefix + "steady" + suffix).c_str(),
+                               steady<queue, Timed>);
+  benchmark::RegisterBenchmark((prefix + "burst" + suffix).c_str(),
+                               burst<queue, Timed>);
+  benchmark::RegisterBenchmark((prefix + "sawtooth" + suffix).c_str(),
+                               sawtooth<queue, Timed>);
+  benchmark::RegisterBenchmark((prefix + "drain" + suffix).c_str(),
+                               drain<queue, Timed>);
+}
+
+template <template <typename> class Queue>
+void register_queue(const std::string& queue_name) {
+  register_workloads<Queue, 4, false>(queue_name);
+  register_workloads<Queue, 16, false>(queue_name);
+  register_workloads<Queue, 64, false>(queue_name);
+  register_workloads<Queue, 256, false>(queue_name);
+  register_workloads<Queue, 4, true>(queue_name);
+  register_workloads<Queue, 16, true>(queue_name);
+  register_workloads<Queue, 64, true>(queue_name);
+  register_workloads<Queue, 256, true>(queue_name);
+}
+
+template <typename T> using flat = dizzy::flat_queue<T>;
+}
+
+int main(int argc, char** argv) {
+  register_queue<flat>("flat_queue");
+  register_queue<deque_queue>("std_deque");
+  register_queue<list_queue>("std_list");
+  register_queue<ring_queue>("ring");
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
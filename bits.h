@@ -0,0 +1,37 @@
+/* Small bit twiddling helpers shared by the integer keyed containers
+ * (radix_queue, timer_wheel).
+ */
+
+#pragma once
+
+#include <climits>
+#include <cstddef>
+
+namespace dizzy {
+
+namespace detail {
+
+// Number of bits needed to represent x, i.e. 0 for 0 and
+// floor(log2(x)) + 1 otherwise.
+template <typename Key> inline std::size_t bit_width(Key x) {
+#if defined(__GNUC__)
+  if (x == 0) {
+    return 0;
+  }
+  if (sizeof(Key) <= sizeof(unsigned int)) {
+    return sizeof(unsigned int) * CHAR_BIT -
+           __builtin_clz(static_cast<unsigned int>(x));
+  }
+  return sizeof(unsigned long long) * CHAR_BIT -
+         __builtin_clzll(static_cast<unsigned long long>(x));
+#else
+  std::size_t width = 0;
+  while (x != 0) {
+    x >>= 1;
+    ++width;
+  }
+  return width;
+#endif
+}
+}
+}
@@ -0,0 +1,349 @@
+/* A single producer, multiple consumer broadcast ring in the style of
+ * the LMAX Disruptor: every consumer sees every element, in order, at
+ * its own pace, reading it in place in the ring rather than from its
+ * own copy.
+ * 1. broadcast_ring<T>(capacity, consumers) preallocates capacity slots
+ *    (rounded up to a power of two) of default constructed T, which the
+ *    producer overwrites, and one cursor per consumer. Positions are 64
+ *    bit sequence numbers that never wrap in practice. The producer's
+ *    cursor and every consumer's cursor sit on their own cache line.
+ * 2. A slot is reused only once the slowest consumer's cursor has passed
+ *    it, so a stalled consumer stalls the producer (that is the point:
+ *    nothing is dropped). The producer caches the slowest cursor and
+ *    only rescans the consumers when it catches up with the cached one.
+ * 3. The producer either publishes one element at a time (publish,
+ *    try_publish) or claims a batch with claim(n), fills the one or two
+ *    spans it gets (two when the batch wraps around the end of the
+ *    ring), and makes them visible with commit(n).
+ * 4. Consumers are get_reader(i), for i below the consumer count, each
+ *    to be used from one thread. wait(min) blocks until at least min
+ *    elements are available and try_read() does not block; both return
+ *    all that is available as a ring_range, in place, and release(n)
+ *    hands the first n of them back to the producer. poll(f) does the
+ *    lot: it calls f(element, sequence) on everything available and
+ *    releases it.
+ * 5. The WaitStrategy parameter is how either side waits:
+ *    busy_spin_wait (lowest latency, burns a core), yield_wait (the
+ *    default, spins with sched_yield in between) or blocking_wait (a
+ *    mutex and condition variable, only touched while someone is
+ *    actually waiting).
+ */
+
+#pragma once
+
+#include "span.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace dizzy {
+
+struct busy_spin_wait {
+  template <typename Ready> void wait(Ready ready);
+  void notify() {}
+};
+
+struct yield_wait {
+  template <typename Ready> void wait(Ready ready);
+  void notify() {}
+};
+
+class blocking_wait {
+public:
+  template <typename Ready> void wait(Ready ready);
+  void notify();
+
+private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::atomic<int> waiters_{ 0 };
+};
+
+template <typename Ready> void busy_spin_wait::wait(Ready ready) {
+  while (!ready()) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#endif
+  }
+}
+
+template <typename Ready> void yield_wait::wait(Ready ready) {
+  while (!ready()) {
+    std::this_thread::yield();
+  }
+}
+
+template <typename Ready> void blocking_wait::wait(Ready ready) {
+  if (ready()) {
+    return;
+  }
+  waiters_.fetch_add(1);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, ready);
+  }
+  waiters_.fetch_sub(1);
+}
+
+// Pairs with the fence in wait(): either the waiter sees the new cursor
+// in ready(), or this sees the waiter and wakes it.
+inline void blocking_wait::notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters_.load(std::memory_order_relaxed) != 0) {
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    changed_.notify_all();
+  }
+}
+
+// Up to two runs of a ring, the second one non-empty only when the
+// range wraps around the end of the ring; seq is the sequence number of
+// first[0].
+template <typename T> struct ring_range {
+  span<T> first;
+  span<T> second;
+  std::uint64_t seq = 0;
+
+  std::size_t size() const { return first.size() + second.size(); }
+  bool empty() const { return size() == 0; }
+  T& operator[](std::size_t pos) const {
+    return pos < first.size() ? first[pos] : second[pos - first.size()];
+  }
+};
+
+template <typename T, typename WaitStrategy = yield_wait>
+class broadcast_ring {
+  struct alignas(64) cursor {
+    std::atomic<std::uint64_t> value{ 0 };
+  };
+
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using sequence_type = std::uint64_t;
+
+  class reader {
+  public:
+    size_type available() const;
+    sequence_type sequence() const;
+
+    ring_range<const T> wait(size_type min = 1);
+    ring_range<const T> try_read();
+    void release(size_type count);
+    template <typename F> size_type poll(F f);
+
+  private:
+    friend class broadcast_ring;
+    reader(broadcast_ring* ring, cursor* position);
+
+    broadcast_ring* ring_;
+    cursor* position_;
+  };
+
+  broadcast_ring(size_type capacity, size_type consumers);
+  broadcast_ring(const broadcast_ring&) = delete;
+  broadcast_ring& operator=(const broadcast_ring&) = delete;
+
+  size_type capacity() const;
+  size_type consumers() const;
+  reader get_reader(size_type consumer);
+
+  void publish(const value_type& val);
+  bool try_publish(const value_type& val);
+  ring_range<T> claim(size_type count);
+  void commit(size_type count);
+
+  WaitStrategy& wait_strategy();
+
+private:
+  std::unique_ptr<T[]> slots_;
+  size_type capacity_;
+  size_type mask_;
+  std::unique_ptr<cursor[]> readers_;
+  size_type consumers_;
+  cursor published_;
+  sequence_type slowest_ = 0;
+  WaitStrategy waiter_;
+
+  sequence_type scan_slowest() const;
+  bool has_room(size_type count);
+  template <typename U>
+  ring_range<U> range(U* slots, sequence_type seq, size_type count) const;
+};
+
+template <typename T, typename WaitStrategy>
+broadcast_ring<T, WaitStrategy>::broadcast_ring(size_type capacity,
+                                                size_type consumers)
+    : consumers_{ consumers } {
+  if (capacity == 0 || consumers == 0) {
+    throw std::invalid_argument(
+        "broadcast_ring needs a capacity and at least one consumer");
+  }
+  size_type slots = 1;
+  while (slots < capacity) {
+    slots *= 2;
+  }
+  slots_.reset(new T[slots]);
+  capacity_ = slots;
+  mask_ = slots - 1;
+  readers_.reset(new cursor[consumers]);
+}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::size_type
+broadcast_ring<T, WaitStrategy>::capacity() const {
+  return capacity_;
+}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::size_type
+broadcast_ring<T, WaitStrategy>::consumers() const {
+  return consumers_;
+}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::reader
+broadcast_ring<T, WaitStrategy>::get_reader(size_type consumer) {
+  if (consumer >= consumers_) {
+    throw std::out_of_range("broadcast_ring::get_reader");
+  }
+  return reader(this, &readers_[consumer]);
+}
+
+template <typename T, typename WaitStrategy>
+WaitStrategy& broadcast_ring<T, WaitStrategy>::wait_strategy() {
+  return waiter_;
+}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::sequence_type
+broadcast_ring<T, WaitStrategy>::scan_slowest() const {
+  sequence_type slowest = readers_[0].value.load(std::memory_order_acquire);
+  for (size_type i = 1; i < consumers_; ++i) {
+    slowest = std::min(slowest,
+                       readers_[i].value.load(std::memory_order_acquire));
+  }
+  return slowest;
+}
+
+template <typename T, typename WaitStrategy>
+bool broadcast_ring<T, WaitStrategy>::has_room(size_type count) {
+  sequence_type end =
+      published_.value.load(std::memory_order_relaxed) + count;
+  if (end - slowest_ <= capacity_) {
+    return true;
+  }
+  slowest_ = scan_slowest();
+  return end - slowest_ <= capacity_;
+}
+
+template <typename T, typename WaitStrategy>
+template <typename U>
+ring_range<U> broadcast_ring<T, WaitStrategy>::range(U* slots,
+                                                     sequence_type seq,
+                                                     size_type count) const {
+  size_type index = seq & mask_;
+  size_type split = std::min(count, capacity_ - index);
+  ring_range<U> result;
+  result.first = span<U>(slots + index, split);
+  result.second = span<U>(slots, count - split);
+  result.seq = seq;
+  return result;
+}
+
+template <typename T, typename WaitStrategy>
+void broadcast_ring<T, WaitStrategy>::publish(const value_type& val) {
+  claim(1)[0] = val;
+  commit(1);
+}
+
+template <typename T, typename WaitStrategy>
+bool broadcast_ring<T, WaitStrategy>::try_publish(const value_type& val) {
+  if (!has_room(1)) {
+    return false;
+  }
+  sequence_type seq = published_.value.load(std::memory_order_relaxed);
+  slots_[seq & mask_] = val;
+  commit(1);
+  return true;
+}
+
+// Waits for room for count elements, count at most capacity(), and
+// returns their slots.
+template <typename T, typename WaitStrategy>
+ring_range<T> broadcast_ring<T, WaitStrategy>::claim(size_type count) {
+  if (count > capacity_) {
+    throw std::length_error("broadcast_ring::claim");
+  }
+  waiter_.wait([&] { return has_room(count); });
+  return range(slots_.get(), published_.value.load(std::memory_order_relaxed),
+               count);
+}
+
+template <typename T, typename WaitStrategy>
+void broadcast_ring<T, WaitStrategy>::commit(size_type count) {
+  published_.value.fetch_add(count, std::memory_order_release);
+  waiter_.notify();
+}
+
+template <typename T, typename WaitStrategy>
+broadcast_ring<T, WaitStrategy>::reader::reader(broadcast_ring* ring,
+                                                cursor* position)
+    : ring_{ ring }, position_{ position } {}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::size_type
+broadcast_ring<T, WaitStrategy>::reader::available() const {
+  return ring_->published_.value.load(std::memory_order_acquire) -
+         position_->value.load(std::memory_order_relaxed);
+}
+
+template <typename T, typename WaitStrategy>
+typename broadcast_ring<T, WaitStrategy>::sequence_type
+broadcast_ring<T, WaitStrategy>::reader::sequence() const {
+  return position_->value.load(std::memory_order_relaxed);
+}
+
+template <typename T, typename WaitStrategy>
+ring_range<const T>
+broadcast_ring<T, WaitStrategy>::reader::wait(size_type min) {
+  ring_->waiter_.wait([&] { return available() >= min; });
+  return try_read();
+}
+
+template <typename T, typename WaitStrategy>
+ring_range<const T> broadcast_ring<T, WaitStrategy>::reader::try_read() {
+  const T* slots = ring_->slots_.get();
+  return ring_->range(slots, sequence(), available());
+}
+
+template <typename T, typename WaitStrategy>
+void broadcast_ring<T, WaitStrategy>::reader::release(size_type count) {
+  position_->value.fetch_add(count, std::memory_order_release);
+  ring_->waiter_.notify();
+}
+
+template <typename T, typename WaitStrategy>
+template <typename F>
+typename broadcast_ring<T, WaitStrategy>::size_type
+broadcast_ring<T, WaitStrategy>::reader::poll(F f) {
+  ring_range<const T> batch = try_read();
+  sequence_type seq = batch.seq;
+  for (const T& element : batch.first) {
+    f(element, seq++);
+  }
+  for (const T& element : batch.second) {
+    f(element, seq++);
+  }
+  if (!batch.empty()) {
+    release(batch.size());
+  }
+  return batch.size();
+}
+}
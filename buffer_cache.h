@@ -0,0 +1,249 @@
+/* Where flat_queue gets its buffers from, switched through its Policy
+ * (see cached_queue_policy in flat_queue.h).
+ * 1. heap_memory is the default: every buffer comes from operator new
+ *    and goes back to operator delete, with the aligned forms for
+ *    over-aligned element types.
+ * 2. cached_memory keeps a thread-local buffer_cache of buffers that
+ *    were recently released, so the buffer a compaction frees is there
+ *    for the next compaction (usually of much the same size) without a
+ *    trip to malloc, and without the allocator's locks when many
+ *    threads compact at once. A buffer freed on another thread than the
+ *    one that allocated it simply joins that thread's cache.
+ * 3. The cache sorts buffers into size classes, four per power of two
+ *    from 16 bytes up to 896KB, so a request is rounded up by at most a
+ *    quarter, and hands out the last buffer released into the class.
+ *    Larger and over-aligned buffers bypass it. The bytes it holds are
+ *    bounded, 4MB per thread by default, set_limit() changes that for
+ *    the calling thread; a release that would go over goes to the heap.
+ * 4. buffer_cache::local().stats() returns the calling thread's hits,
+ *    misses, releases kept and released to the heap, and the bytes
+ *    currently held; hit_rate() is hits over all allocations. trim()
+ *    hands everything held back to the heap.
+ * 5. The cache is destroyed at thread exit like any thread_local; a
+ *    buffer released after that (by a thread_local queue destroyed
+ *    later) goes straight to the heap.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace dizzy {
+
+struct buffer_cache_stats {
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  std::uint64_t releases_kept = 0;
+  std::uint64_t releases_freed = 0;
+  std::size_t cached_bytes = 0;
+
+  double hit_rate() const;
+};
+
+class buffer_cache {
+public:
+  static constexpr std::size_t class_count = 64;
+  static constexpr std::size_t default_limit = 4 << 20;
+
+  buffer_cache() = default;
+  buffer_cache(const buffer_cache&) = delete;
+  ~buffer_cache();
+
+  buffer_cache& operator=(const buffer_cache&) = delete;
+
+  static buffer_cache& local();
+  static bool destroyed();
+
+  void* allocate(std::size_t bytes);
+  void deallocate(void* block, std::size_t bytes) noexcept;
+
+  void set_limit(std::size_t bytes);
+  std::size_t limit() const;
+  buffer_cache_stats stats() const;
+  void trim() noexcept;
+
+  static std::size_t class_of(std::size_t bytes);
+  static std::size_t class_size(std::size_t size_class);
+  static std::size_t rounded_size(std::size_t bytes);
+
+private:
+  std::vector<void*> free_[class_count];
+  std::size_t limit_ = default_limit;
+  buffer_cache_stats stats_;
+
+  static bool& destroyed_flag();
+};
+
+struct heap_memory {
+  static void* allocate(std::size_t bytes, std::size_t alignment);
+  static void deallocate(void* block, std::size_t bytes,
+                         std::size_t alignment) noexcept;
+};
+
+struct cached_memory {
+  static void* allocate(std::size_t bytes, std::size_t alignment);
+  static void deallocate(void* block, std::size_t bytes,
+                         std::size_t alignment) noexcept;
+};
+
+inline double buffer_cache_stats::hit_rate() const {
+  std::uint64_t total = hits + misses;
+  return total != 0 ? hits / static_cast<double>(total) : 0.0;
+}
+
+inline buffer_cache::~buffer_cache() {
+  trim();
+  destroyed_flag() = true;
+}
+
+inline buffer_cache& buffer_cache::local() {
+  thread_local buffer_cache cache;
+  return cache;
+}
+
+// A plain bool, so still readable once the thread's cache is gone.
+inline bool& buffer_cache::destroyed_flag() {
+  thread_local bool flag = false;
+  return flag;
+}
+
+inline bool buffer_cache::destroyed() {
+  return destroyed_flag();
+}
+
+// Class c holds (4 + c % 4) << (c / 4 + 2) bytes: 16, 20, 24, 28, 32,
+// 40 and so on. Returns class_count for sizes past the largest class,
+// which it checks first: the loop below would shift past 64 bits for
+// sizes above 2^63.
+inline std::size_t buffer_cache::class_of(std::size_t bytes) {
+  if (bytes <= 16) {
+    return 0;
+  }
+  if (bytes > class_size(class_count - 1)) {
+    return class_count;
+  }
+  std::size_t power = 4;
+  while ((std::size_t{ 1 } << (power + 1)) < bytes) {
+    ++power;
+  }
+  std::size_t step = std::size_t{ 1 } << (power - 2);
+  std::size_t over = bytes - (std::size_t{ 1 } << power);
+  std::size_t size_class = 4 * (power - 4) + (over + step - 1) / step;
+  return size_class < class_count ? size_class : class_count;
+}
+
+inline std::size_t buffer_cache::class_size(std::size_t size_class) {
+  return (4 + size_class % 4) << (size_class / 4 + 2);
+}
+
+// What a buffer of the given size really takes, so that any buffer of
+// the class can later serve any request in it.
+inline std::size_t buffer_cache::rounded_size(std::size_t bytes) {
+  std::size_t size_class = class_of(bytes);
+  return size_class != class_count ? class_size(size_class) : bytes;
+}
+
+inline void* buffer_cache::allocate(std::size_t bytes) {
+  std::size_t size_class = class_of(bytes);
+  if (size_class == class_count) {
+    return ::operator new(bytes);
+  }
+  std::vector<void*>& blocks = free_[size_class];
+  if (!blocks.empty()) {
+    void* block = blocks.back();
+    blocks.pop_back();
+    stats_.cached_bytes -= class_size(size_class);
+    ++stats_.hits;
+    return block;
+  }
+  ++stats_.misses;
+  return ::operator new(class_size(size_class));
+}
+
+inline void buffer_cache::deallocate(void* block, std::size_t bytes) noexcept {
+  std::size_t size_class = class_of(bytes);
+  if (size_class != class_count &&
+      stats_.cached_bytes + class_size(size_class) <= limit_) {
+    try {
+      free_[size_class].push_back(block);
+      stats_.cached_bytes += class_size(size_class);
+      ++stats_.releases_kept;
+      return;
+    } catch (...) {
+    }
+  }
+  if (size_class != class_count) {
+    ++stats_.releases_freed;
+  }
+  ::operator delete(block);
+}
+
+inline void buffer_cache::set_limit(std::size_t bytes) {
+  limit_ = bytes;
+  for (std::size_t c = class_count; c-- > 0 && stats_.cached_bytes > limit_;) {
+    while (!free_[c].empty() && stats_.cached_bytes > limit_) {
+      ::operator delete(free_[c].back());
+      free_[c].pop_back();
+      stats_.cached_bytes -= class_size(c);
+    }
+  }
+}
+
+inline std::size_t buffer_cache::limit() const {
+  return limit_;
+}
+
+inline buffer_cache_stats buffer_cache::stats() const {
+  return stats_;
+}
+
+inline void buffer_cache::trim() noexcept {
+  for (std::size_t c = 0; c < class_count; ++c) {
+    for (void* block : free_[c]) {
+      ::operator delete(block);
+    }
+    free_[c].clear();
+  }
+  stats_.cached_bytes = 0;
+}
+
+inline void* heap_memory::allocate(std::size_t bytes, std::size_t alignment) {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    return ::operator new(bytes, std::align_val_t{ alignment });
+  }
+  return ::operator new(bytes);
+}
+
+inline void heap_memory::deallocate(void* block, std::size_t,
+                                    std::size_t alignment) noexcept {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    ::operator delete(block, std::align_val_t{ alignment });
+  } else {
+    ::operator delete(block);
+  }
+}
+
+inline void* cached_memory::allocate(std::size_t bytes,
+                                     std::size_t alignment) {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    return heap_memory::allocate(bytes, alignment);
+  }
+  if (buffer_cache::destroyed()) {
+    return ::operator new(buffer_cache::rounded_size(bytes));
+  }
+  return buffer_cache::local().allocate(bytes);
+}
+
+inline void cached_memory::deallocate(void* block, std::size_t bytes,
+                                      std::size_t alignment) noexcept {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ||
+      buffer_cache::destroyed()) {
+    heap_memory::deallocate(block, bytes, alignment);
+  } else {
+    buffer_cache::local().deallocate(block, bytes);
+  }
+}
+}
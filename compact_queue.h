@@ -0,0 +1,474 @@
+/* A flat_queue with narrow indices, for queues embedded by the thousand
+ * in other structures, where flat_queue's 32 bytes (a pointer and three
+ * size_t) are too many.
+ * 1. compact_queue<T, Index> keeps a pointer and the head and tail as
+ *    Index, uint32_t by default or uint16_t, and stores the capacity in
+ *    a small header in front of the first slot of the buffer, so the
+ *    queue itself is 16 bytes for either width (the uint16_t one could
+ *    have kept it inline, but would have been padded to 16 anyway). An
+ *    empty queue without a buffer reads the capacity as 0.
+ * 2. Growth is checked: the queue holds at most max_size() elements,
+ *    the largest value of Index, capacities are capped there, and a push
+ *    into a full queue at that size throws std::length_error rather than
+ *    wrapping the indices. reserve() past max_size() throws the same.
+ * 3. The third parameter is the growth type from growth.h, fixed_growth
+ *    by default, deciding as in flat_queue how much to grow and when to
+ *    compact on pop. It is an empty base for fixed_growth, so costs
+ *    nothing; adaptive_growth keeps its window inside the queue, which
+ *    makes it larger.
+ * 4. Otherwise the interface is flat_queue's core: push, emplace, pop
+ *    and the value returning pops, front, back, operator[], data(),
+ *    pointer iterators, reserve, shrink_to_fit, clear and swap. There
+ *    are no stats, timer or trace hooks, and no probes.
+ */
+
+#pragma once
+
+#include "growth.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace dizzy {
+
+template <typename T, typename Index = std::uint32_t,
+          typename Growth = fixed_growth>
+class compact_queue : private Growth {
+  static_assert(std::is_unsigned<Index>::value,
+                "compact_queue needs an unsigned index type");
+
+public:
+  using size_type = std::size_t;
+  using index_type = Index;
+  using value_type = T;
+  using pointer = T*;
+  using const_pointer = const T*;
+  using reference = T&;
+  using const_reference = const T&;
+  using iterator = pointer;
+  using const_iterator = const_pointer;
+  using growth_type = Growth;
+
+  compact_queue() = default;
+  compact_queue(const compact_queue& x);
+  compact_queue(compact_queue&& x) noexcept;
+  template <typename InputIt> compact_queue(InputIt first, InputIt last);
+  compact_queue(std::initializer_list<T> init);
+  ~compact_queue();
+
+  compact_queue& operator=(const compact_queue& other);
+  compact_queue& operator=(compact_queue&& other) noexcept;
+
+  bool empty() const;
+  size_type size() const;
+  size_type capacity() const;
+  static constexpr size_type max_size();
+
+  reference front();
+  const_reference front() const;
+  reference back();
+  const_reference back() const;
+  reference operator[](size_type pos);
+  const_reference operator[](size_type pos) const;
+
+  void push(const value_type& val);
+  void push(value_type&& val);
+  template <class... Args> void emplace(Args&&... args);
+
+  void pop();
+  value_type pop_front();
+  std::optional<value_type> try_pop();
+  bool pop_into(value_type& out);
+
+  void reserve(size_type new_size);
+  void shrink_to_fit();
+  void clear();
+
+  pointer data();
+  const_pointer data() const;
+  growth_type& growth();
+
+  void swap(compact_queue& x) noexcept;
+
+  iterator begin() noexcept;
+  const_iterator begin() const noexcept;
+  iterator end() noexcept;
+  const_iterator end() const noexcept;
+
+private:
+  struct header {
+    Index capacity;
+  };
+
+  static constexpr std::size_t alignment =
+      std::max(alignof(T), alignof(header));
+  static constexpr std::size_t header_size =
+      (sizeof(header) + alignment - 1) / alignment * alignment;
+
+  pointer buffer_ = nullptr;
+  Index head_ = 0;
+  Index tail_ = 0;
+
+  header* get_header() const;
+  void check_and_grow();
+  void reallocate(size_type new_capacity);
+  template <typename InputIt> void append(InputIt first, InputIt last);
+  void destroy_elements() noexcept;
+  void destroy_all() noexcept;
+};
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>::compact_queue(const compact_queue& x)
+    : Growth(x) {
+  append(x.begin(), x.end());
+}
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>::compact_queue(compact_queue&& x) noexcept
+    : Growth(std::move(x)),
+      buffer_{ x.buffer_ },
+      head_{ x.head_ },
+      tail_{ x.tail_ } {
+  x.buffer_ = nullptr;
+  x.head_ = x.tail_ = 0;
+}
+
+template <typename T, typename Index, typename Growth>
+template <typename InputIt>
+compact_queue<T, Index, Growth>::compact_queue(InputIt first, InputIt last) {
+  append(first, last);
+}
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>::compact_queue(std::initializer_list<T> init) {
+  append(init.begin(), init.end());
+}
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>::~compact_queue() {
+  destroy_all();
+}
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>& compact_queue<T, Index, Growth>::
+operator=(const compact_queue& other) {
+  compact_queue temp(other);
+  swap(temp);
+  return *this;
+}
+
+template <typename T, typename Index, typename Growth>
+compact_queue<T, Index, Growth>& compact_queue<T, Index, Growth>::
+operator=(compact_queue&& other) noexcept {
+  compact_queue temp(std::move(other));
+  swap(temp);
+  return *this;
+}
+
+template <typename T, typename Index, typename Growth>
+bool compact_queue<T, Index, Growth>::empty() const {
+  return head_ == tail_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::size_type
+compact_queue<T, Index, Growth>::size() const {
+  return tail_ - head_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::size_type
+compact_queue<T, Index, Growth>::capacity() const {
+  return buffer_ ? get_header()->capacity : 0;
+}
+
+template <typename T, typename Index, typename Growth>
+constexpr typename compact_queue<T, Index, Growth>::size_type
+compact_queue<T, Index, Growth>::max_size() {
+  return std::numeric_limits<Index>::max();
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::reference
+compact_queue<T, Index, Growth>::front() {
+  return buffer_[head_];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_reference
+compact_queue<T, Index, Growth>::front() const {
+  return buffer_[head_];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::reference
+compact_queue<T, Index, Growth>::back() {
+  return buffer_[tail_ - 1];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_reference
+compact_queue<T, Index, Growth>::back() const {
+  return buffer_[tail_ - 1];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::reference
+compact_queue<T, Index, Growth>::operator[](size_type pos) {
+  return buffer_[head_ + pos];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_reference
+compact_queue<T, Index, Growth>::operator[](size_type pos) const {
+  return buffer_[head_ + pos];
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::header*
+compact_queue<T, Index, Growth>::get_header() const {
+  return std::launder(reinterpret_cast<header*>(
+      reinterpret_cast<unsigned char*>(buffer_) - header_size));
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::check_and_grow() {
+  if (tail_ == capacity()) {
+    if (size() == max_size()) {
+      throw std::length_error("compact_queue is at max_size()");
+    }
+    reallocate(std::min(std::max(growth().target_capacity(size(), sizeof(T)),
+                                 size() + 1),
+                        max_size()));
+  }
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::push(const T& val) {
+  emplace(val);
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::push(T&& val) {
+  emplace(std::move(val));
+}
+
+template <typename T, typename Index, typename Growth>
+template <class... Args>
+void compact_queue<T, Index, Growth>::emplace(Args&&... args) {
+  check_and_grow();
+  ::new (static_cast<void*>(buffer_ + tail_)) T(std::forward<Args>(args)...);
+  ++tail_;
+  growth().on_push(size());
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::pop() {
+  buffer_[head_++].~T();
+  growth().on_pop(size());
+  if (growth().compact_on_pop(head_, tail_)) {
+    reallocate(std::min(
+        std::max(growth().target_capacity(size(), sizeof(T)), size()),
+        max_size()));
+  }
+}
+
+template <typename T, typename Index, typename Growth>
+T compact_queue<T, Index, Growth>::pop_front() {
+  T val(std::move(front()));
+  pop();
+  return val;
+}
+
+template <typename T, typename Index, typename Growth>
+std::optional<T> compact_queue<T, Index, Growth>::try_pop() {
+  std::optional<T> val;
+  if (!empty()) {
+    val.emplace(std::move(front()));
+    pop();
+  }
+  return val;
+}
+
+template <typename T, typename Index, typename Growth>
+bool compact_queue<T, Index, Growth>::pop_into(T& out) {
+  if (empty()) {
+    return false;
+  }
+  out = std::move(front());
+  pop();
+  return true;
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::reserve(size_type new_size) {
+  if (new_size > max_size()) {
+    throw std::length_error("compact_queue::reserve past max_size()");
+  }
+  if (empty()) {
+    head_ = tail_ = 0;
+    if (new_size > capacity()) {
+      reallocate(new_size);
+    }
+  } else {
+    reallocate(std::max(new_size, size()));
+  }
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::shrink_to_fit() {
+  reallocate(size());
+}
+
+// Moves the live range to the start of a new buffer of new_capacity
+// slots, which must be at least size() and at most max_size().
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::reallocate(size_type new_capacity) {
+  pointer new_buffer = nullptr;
+  if (new_capacity != 0) {
+    void* block = ::operator new(header_size + new_capacity * sizeof(T),
+                                 std::align_val_t{ alignment });
+    ::new (block) header{ static_cast<Index>(new_capacity) };
+    new_buffer = reinterpret_cast<pointer>(static_cast<unsigned char*>(block) +
+                                           header_size);
+  }
+  try {
+    std::uninitialized_move(begin(), end(), new_buffer);
+  } catch (...) {
+    if (new_buffer) {
+      ::operator delete(reinterpret_cast<unsigned char*>(new_buffer) -
+                            header_size,
+                        std::align_val_t{ alignment });
+    }
+    throw;
+  }
+  Index count = tail_ - head_;
+  destroy_all();
+  buffer_ = new_buffer;
+  head_ = 0;
+  tail_ = count;
+}
+
+template <typename T, typename Index, typename Growth>
+template <typename InputIt>
+void compact_queue<T, Index, Growth>::append(InputIt first, InputIt last) {
+  using category = typename std::iterator_traits<InputIt>::iterator_category;
+  if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+    size_type count = static_cast<size_type>(std::distance(first, last));
+    if (count > max_size() - size()) {
+      throw std::length_error("compact_queue is at max_size()");
+    }
+    if (count > capacity() - tail_) {
+      reallocate(size() + count);
+    }
+    std::uninitialized_copy(first, last, buffer_ + tail_);
+    tail_ += static_cast<Index>(count);
+  } else {
+    for (; first != last; ++first) {
+      emplace(*first);
+    }
+  }
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::destroy_elements() noexcept {
+  for (Index i = head_; i != tail_; ++i) {
+    buffer_[i].~T();
+  }
+  head_ = tail_ = 0;
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::destroy_all() noexcept {
+  destroy_elements();
+  if (buffer_) {
+    ::operator delete(reinterpret_cast<unsigned char*>(buffer_) - header_size,
+                      std::align_val_t{ alignment });
+  }
+  buffer_ = nullptr;
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::clear() {
+  destroy_elements();
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::pointer
+compact_queue<T, Index, Growth>::data() {
+  return buffer_ + head_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_pointer
+compact_queue<T, Index, Growth>::data() const {
+  return buffer_ + head_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::growth_type&
+compact_queue<T, Index, Growth>::growth() {
+  return *this;
+}
+
+template <typename T, typename Index, typename Growth>
+void compact_queue<T, Index, Growth>::swap(compact_queue& x) noexcept {
+  using std::swap;
+  swap(buffer_, x.buffer_);
+  swap(head_, x.head_);
+  swap(tail_, x.tail_);
+}
+
+template <typename T, typename Index, typename Growth>
+void swap(compact_queue<T, Index, Growth>& x,
+          compact_queue<T, Index, Growth>& y) noexcept {
+  x.swap(y);
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::iterator
+compact_queue<T, Index, Growth>::begin() noexcept {
+  return buffer_ + head_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_iterator
+compact_queue<T, Index, Growth>::begin() const noexcept {
+  return buffer_ + head_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::iterator
+compact_queue<T, Index, Growth>::end() noexcept {
+  return buffer_ + tail_;
+}
+
+template <typename T, typename Index, typename Growth>
+typename compact_queue<T, Index, Growth>::const_iterator
+compact_queue<T, Index, Growth>::end() const noexcept {
+  return buffer_ + tail_;
+}
+
+template <typename T, typename Index, typename Growth>
+inline bool operator==(const compact_queue<T, Index, Growth>& lhs,
+                       const compact_queue<T, Index, Growth>& rhs) {
+  return lhs.size() == rhs.size() &&
+         std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <typename T, typename Index, typename Growth>
+inline bool operator!=(const compact_queue<T, Index, Growth>& lhs,
+                       const compact_queue<T, Index, Growth>& rhs) {
+  return !(lhs == rhs);
+}
+}
@@ -0,0 +1,515 @@
+/* A double ended counterpart to flat_queue, meant as a drop-in for
+ * std::deque where the block indirection of std::deque costs too much.
+ * 1. The elements are always contiguous, data() points at front() and
+ *    data() + size() is one past back(). Iterators are plain pointers.
+ * 2. Unlike flat_queue this sits on a raw buffer rather than a vector,
+ *    so that there can be unconstructed headroom at both ends. When
+ *    either end runs out of room the live range is recentered in the
+ *    buffer, in place if at least half of the buffer is free and
+ *    otherwise into a new buffer growth_factor times the size. Elements
+ *    whose move may throw always go to a new buffer, so a throw leaves
+ *    the deque valid, still in its old buffer.
+ * 3. All of the std::deque modifiers that work at the ends are here:
+ *    push_front/emplace_front/pop_front and push_back/emplace_back/
+ *    pop_back, along with reserve(), shrink_to_fit(), clear() and
+ *    data() as in flat_queue. reserve(n) leaves room for the queue to
+ *    grow to n at either end, so it reserves that headroom twice.
+ *    Inserting or erasing in the middle is not supported.
+ * 4. As with std::deque (and unlike std::vector) nothing here keeps
+ *    iterators valid across a push, since any push may recenter.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace dizzy {
+
+template <typename T> class flat_deque {
+public:
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using value_type = T;
+  using pointer = T*;
+  using const_pointer = const T*;
+  using reference = T&;
+  using const_reference = const T&;
+
+  using iterator = pointer;
+  using const_iterator = const_pointer;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  static constexpr double growth_factor = 2.0;
+
+  flat_deque() = default;
+  flat_deque(const flat_deque& x);
+  flat_deque(flat_deque&& x) noexcept;
+  template <typename InputIt> flat_deque(InputIt first, InputIt last);
+  flat_deque(std::initializer_list<T> init);
+  ~flat_deque();
+
+  flat_deque& operator=(const flat_deque& other);
+  flat_deque& operator=(flat_deque&& other) noexcept;
+  flat_deque& operator=(std::initializer_list<T> init);
+
+  template <typename InputIt> void assign(InputIt first, InputIt last);
+  void assign(std::initializer_list<T> init);
+
+  bool empty() const;
+  size_type size() const;
+  size_type capacity() const;
+
+  reference front();
+  const_reference front() const;
+  reference back();
+  const_reference back() const;
+  reference operator[](size_type pos);
+  const_reference operator[](size_type pos) const;
+  reference at(size_type pos);
+  const_reference at(size_type pos) const;
+
+  void push_back(const value_type& val);
+  void push_back(value_type&& val);
+  template <class... Args> reference emplace_back(Args&&... args);
+  void push_front(const value_type& val);
+  void push_front(value_type&& val);
+  template <class... Args> reference emplace_front(Args&&... args);
+
+  void pop_front();
+  void pop_back();
+
+  void shrink_to_fit();
+  void reserve(size_type new_size);
+  void clear();
+
+  pointer data();
+  const_pointer data() const;
+
+  void swap(flat_deque& x) noexcept;
+
+  iterator begin() noexcept;
+  const_iterator begin() const noexcept;
+  iterator end() noexcept;
+  const_iterator end() const noexcept;
+  reverse_iterator rbegin() noexcept;
+  const_reverse_iterator rbegin() const noexcept;
+  reverse_iterator rend() noexcept;
+  const_reverse_iterator rend() const noexcept;
+  const_iterator cbegin() const noexcept;
+  const_iterator cend() const noexcept;
+  const_reverse_iterator crbegin() const noexcept;
+  const_reverse_iterator crend() const noexcept;
+
+private:
+  pointer buffer_ = nullptr;
+  size_type capacity_ = 0;
+  size_type head_ = 0;
+  size_type tail_ = 0;
+
+  void recenter(size_type new_capacity);
+  void make_room_back();
+  void make_room_front();
+  void destroy_all() noexcept;
+};
+
+template <typename T>
+flat_deque<T>::flat_deque(const flat_deque& x)
+    : flat_deque(x.begin(), x.end()) {}
+
+template <typename T>
+flat_deque<T>::flat_deque(flat_deque&& x) noexcept
+    : buffer_{ x.buffer_ },
+      capacity_{ x.capacity_ },
+      head_{ x.head_ },
+      tail_{ x.tail_ } {
+  x.buffer_ = nullptr;
+  x.capacity_ = x.head_ = x.tail_ = 0;
+}
+
+template <typename T>
+template <typename InputIt>
+flat_deque<T>::flat_deque(InputIt first, InputIt last) {
+  assign(first, last);
+}
+
+template <typename T>
+flat_deque<T>::flat_deque(std::initializer_list<T> init) {
+  assign(init);
+}
+
+template <typename T> flat_deque<T>::~flat_deque() { destroy_all(); }
+
+template <typename T>
+flat_deque<T>& flat_deque<T>::operator=(const flat_deque& other) {
+  flat_deque<T> temp(other);
+  swap(temp);
+  return *this;
+}
+
+template <typename T>
+flat_deque<T>& flat_deque<T>::operator=(flat_deque&& other) noexcept {
+  flat_deque<T> temp(std::move(other));
+  swap(temp);
+  return *this;
+}
+
+template <typename T>
+flat_deque<T>& flat_deque<T>::operator=(std::initializer_list<T> init) {
+  assign(init);
+  return *this;
+}
+
+template <typename T>
+template <typename InputIt>
+void flat_deque<T>::assign(InputIt first, InputIt last) {
+  clear();
+  for (; first != last; ++first) {
+    emplace_back(*first);
+  }
+}
+
+template <typename T>
+void flat_deque<T>::assign(std::initializer_list<T> init) {
+  clear();
+  reserve(init.size());
+  for (const T& val : init) {
+    emplace_back(val);
+  }
+}
+
+template <typename T> bool flat_deque<T>::empty() const {
+  return head_ == tail_;
+}
+
+template <typename T>
+typename flat_deque<T>::size_type flat_deque<T>::size() const {
+  return tail_ - head_;
+}
+
+template <typename T>
+typename flat_deque<T>::size_type flat_deque<T>::capacity() const {
+  return capacity_;
+}
+
+template <typename T> typename flat_deque<T>::reference flat_deque<T>::front() {
+  return buffer_[head_];
+}
+
+template <typename T>
+typename flat_deque<T>::const_reference flat_deque<T>::front() const {
+  return buffer_[head_];
+}
+
+template <typename T> typename flat_deque<T>::reference flat_deque<T>::back() {
+  return buffer_[tail_ - 1];
+}
+
+template <typename T>
+typename flat_deque<T>::const_reference flat_deque<T>::back() const {
+  return buffer_[tail_ - 1];
+}
+
+template <typename T>
+typename flat_deque<T>::reference flat_deque<T>::
+operator[](typename flat_deque<T>::size_type pos) {
+  return buffer_[head_ + pos];
+}
+
+template <typename T>
+typename flat_deque<T>::const_reference flat_deque<T>::
+operator[](typename flat_deque<T>::size_type pos) const {
+  return buffer_[head_ + pos];
+}
+
+template <typename T>
+typename flat_deque<T>::reference flat_deque<T>::at(size_type pos) {
+  if (pos >= size()) {
+    throw std::out_of_range("flat_deque::at");
+  }
+  return buffer_[head_ + pos];
+}
+
+template <typename T>
+typename flat_deque<T>::const_reference flat_deque<T>::at(size_type pos) const {
+  if (pos >= size()) {
+    throw std::out_of_range("flat_deque::at");
+  }
+  return buffer_[head_ + pos];
+}
+
+// Moves the live range into the middle of a buffer of new_capacity
+// slots, which is the current buffer when the capacity is unchanged and
+// moves cannot throw. A throw part way through an in-place move would
+// leave a gap in the live range, so other elements get a new buffer.
+template <typename T> void flat_deque<T>::recenter(size_type new_capacity) {
+  size_type count = size();
+  size_type new_head = (new_capacity - count) / 2;
+  if (new_capacity == capacity_ &&
+      std::is_nothrow_move_constructible<T>::value) {
+    if (new_head < head_) {
+      for (size_type i = 0; i < count; ++i) {
+        ::new (static_cast<void*>(buffer_ + new_head + i))
+            T(std::move(buffer_[head_ + i]));
+        buffer_[head_ + i].~T();
+      }
+    } else if (new_head > head_) {
+      for (size_type i = count; i-- > 0;) {
+        ::new (static_cast<void*>(buffer_ + new_head + i))
+            T(std::move(buffer_[head_ + i]));
+        buffer_[head_ + i].~T();
+      }
+    }
+    head_ = new_head;
+    tail_ = new_head + count;
+    return;
+  }
+
+  pointer new_buffer = std::allocator<T>().allocate(new_capacity);
+  try {
+    std::uninitialized_move(buffer_ + head_, buffer_ + tail_,
+                            new_buffer + new_head);
+  } catch (...) {
+    std::allocator<T>().deallocate(new_buffer, new_capacity);
+    throw;
+  }
+  destroy_all();
+  buffer_ = new_buffer;
+  capacity_ = new_capacity;
+  head_ = new_head;
+  tail_ = new_head + count;
+}
+
+template <typename T> void flat_deque<T>::make_room_back() {
+  if (tail_ != capacity_) {
+    return;
+  }
+  if (size() < capacity_ / 2) {
+    recenter(capacity_);
+  } else {
+    recenter(std::max<size_type>(ceil(size() * growth_factor), size() + 2));
+  }
+}
+
+template <typename T> void flat_deque<T>::make_room_front() {
+  if (head_ != 0) {
+    return;
+  }
+  if (size() < capacity_ / 2) {
+    recenter(capacity_);
+  } else {
+    recenter(std::max<size_type>(ceil(size() * growth_factor), size() + 2));
+  }
+}
+
+template <typename T> void flat_deque<T>::push_back(const T& val) {
+  emplace_back(val);
+}
+
+template <typename T> void flat_deque<T>::push_back(T&& val) {
+  emplace_back(std::move(val));
+}
+
+template <typename T>
+template <class... Args>
+typename flat_deque<T>::reference flat_deque<T>::emplace_back(Args&&... args) {
+  make_room_back();
+  ::new (static_cast<void*>(buffer_ + tail_)) T(std::forward<Args>(args)...);
+  return buffer_[tail_++];
+}
+
+template <typename T> void flat_deque<T>::push_front(const T& val) {
+  emplace_front(val);
+}
+
+template <typename T> void flat_deque<T>::push_front(T&& val) {
+  emplace_front(std::move(val));
+}
+
+template <typename T>
+template <class... Args>
+typename flat_deque<T>::reference flat_deque<T>::emplace_front(Args&&... args) {
+  make_room_front();
+  ::new (static_cast<void*>(buffer_ + head_ - 1))
+      T(std::forward<Args>(args)...);
+  return buffer_[--head_];
+}
+
+template <typename T> void flat_deque<T>::pop_front() {
+  buffer_[head_++].~T();
+  if (head_ == tail_) {
+    head_ = tail_ = capacity_ / 2;
+  }
+}
+
+template <typename T> void flat_deque<T>::pop_back() {
+  buffer_[--tail_].~T();
+  if (head_ == tail_) {
+    head_ = tail_ = capacity_ / 2;
+  }
+}
+
+template <typename T> void flat_deque<T>::shrink_to_fit() {
+  if (capacity_ != size()) {
+    recenter(size());
+  }
+}
+
+// Leaves room for new_size - size() pushes at whichever end they land,
+// so the headroom is reserved on both sides.
+template <typename T>
+void flat_deque<T>::reserve(typename flat_deque<T>::size_type new_size) {
+  if (new_size <= size()) {
+    return;
+  }
+  size_type extra = new_size - size();
+  if (head_ < extra || capacity_ - tail_ < extra) {
+    recenter(std::max(capacity_, size() + 2 * extra));
+  }
+}
+
+template <typename T> void flat_deque<T>::clear() {
+  for (size_type i = head_; i != tail_; ++i) {
+    buffer_[i].~T();
+  }
+  head_ = tail_ = capacity_ / 2;
+}
+
+template <typename T> void flat_deque<T>::destroy_all() noexcept {
+  for (size_type i = head_; i != tail_; ++i) {
+    buffer_[i].~T();
+  }
+  if (buffer_) {
+    std::allocator<T>().deallocate(buffer_, capacity_);
+  }
+  buffer_ = nullptr;
+  capacity_ = head_ = tail_ = 0;
+}
+
+template <typename T> typename flat_deque<T>::pointer flat_deque<T>::data() {
+  return buffer_ + head_;
+}
+
+template <typename T>
+typename flat_deque<T>::const_pointer flat_deque<T>::data() const {
+  return buffer_ + head_;
+}
+
+template <typename T> void flat_deque<T>::swap(flat_deque& x) noexcept {
+  using std::swap;
+  swap(buffer_, x.buffer_);
+  swap(capacity_, x.capacity_);
+  swap(head_, x.head_);
+  swap(tail_, x.tail_);
+}
+
+template <typename T> void swap(flat_deque<T>& x, flat_deque<T>& y) noexcept {
+  x.swap(y);
+}
+
+template <typename T>
+typename flat_deque<T>::iterator flat_deque<T>::begin() noexcept {
+  return buffer_ + head_;
+}
+
+template <typename T>
+typename flat_deque<T>::const_iterator flat_deque<T>::begin() const noexcept {
+  return buffer_ + head_;
+}
+
+template <typename T>
+typename flat_deque<T>::iterator flat_deque<T>::end() noexcept {
+  return buffer_ + tail_;
+}
+
+template <typename T>
+typename flat_deque<T>::const_iterator flat_deque<T>::end() const noexcept {
+  return buffer_ + tail_;
+}
+
+template <typename T>
+typename flat_deque<T>::reverse_iterator flat_deque<T>::rbegin() noexcept {
+  return reverse_iterator(end());
+}
+
+template <typename T>
+typename flat_deque<T>::const_reverse_iterator flat_deque<T>::rbegin() const
+    noexcept {
+  return const_reverse_iterator(end());
+}
+
+template <typename T>
+typename flat_deque<T>::reverse_iterator flat_deque<T>::rend() noexcept {
+  return reverse_iterator(begin());
+}
+
+template <typename T>
+typename flat_deque<T>::const_reverse_iterator flat_deque<T>::rend() const
+    noexcept {
+  return const_reverse_iterator(begin());
+}
+
+template <typename T>
+typename flat_deque<T>::const_iterator flat_deque<T>::cbegin() const noexcept {
+  return begin();
+}
+
+template <typename T>
+typename flat_deque<T>::const_iterator flat_deque<T>::cend() const noexcept {
+  return end();
+}
+
+template <typename T>
+typename flat_deque<T>::const_reverse_iterator flat_deque<T>::crbegin() const
+    noexcept {
+  return rbegin();
+}
+
+template <typename T>
+typename flat_deque<T>::const_reverse_iterator flat_deque<T>::crend() const
+    noexcept {
+  return rend();
+}
+
+template <typename T>
+inline bool operator==(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  return std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <typename T>
+inline bool operator!=(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  return !(lhs == rhs);
+}
+
+template <typename T>
+inline bool operator<(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(),
+                                      rhs.end());
+}
+
+template <typename T>
+inline bool operator<=(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  return !(rhs < lhs);
+}
+
+template <typename T>
+inline bool operator>(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  return rhs < lhs;
+}
+
+template <typename T>
+inline bool operator>=(const flat_deque<T>& lhs, const flat_deque<T>& rhs) {
+  return !(lhs < rhs);
+}
+}
@@ -1,36 +1,123 @@
-/* A vector based implementation of std::queue. It contains mostly
+/* A flat buffer based implementation of std::queue. It contains mostly
  * the same interface with a few (okay many) modications.
- * 1. Since this is specifically vector based, the option of a
- *    container base is not given.
+ * 1. The elements live in one raw, uninitialized buffer, with the
+ *    queue tracking its capacity and the head and tail positions within
+ *    it directly, so the option of a container base is not given.
+ *    Nothing is ever constructed ahead of being pushed: reserve() and
+ *    compactions only allocate and move, and the range and container
+ *    constructors copy straight into fresh storage. pop() destroys the
+ *    front element right away.
  * 2. I haven't implemented the constructors that take allocators.
  *       I will not be implementing these as I understand "Nobody overrides
  *       anything but the global one these days anyway"
  * 3. I have added some new member functions:
- *    - reserve(size_type): reserve space in the underlying vector
- *      to avoid reallocation during insertions. If given a size less
- *      than the current size, this does nothing, otherwise triggers
- *      a reallocation of the internal vector.
- *    - compress(double): reallocate the internal vector with
+ *    - reserve(size_type): reserve space in the underlying buffer
+ *      to avoid reallocation during insertions. If the queue is empty
+ *      this only allocates when asked for more than the capacity,
+ *      otherwise it compacts into a buffer of the given size (or of
+ *      size(), if that is larger).
+ *    - compress(double): reallocate the internal buffer with
  *      allocation size proportional to size() * the argument,
  *      which has a default value of 2.
  *    - shrink_to_fit(): equivilant to compress(1). Analogous
  *      to the equivilant vector public member function
+ *    - maintenance(budget): does the compaction work the growth policy
+ *      has put off, see deferred_queue_policy below and maintenance.h.
  *    - clear(): analogous to the equivilant vector public member function
+ *    - capacity(): the size of the buffer, including the slots in front
+ *      of the queue that have been popped but not yet compacted away.
  *    - data(): analogous to the equivilant vector public member function,
- *      returns a pointer to the location within the internal containing the
- *      first element in the queue.
+ *      returns a pointer to the location within the internal buffer
+ *      containing the first element in the queue.
  *    - assign(): analogous to the equivilant vector public member function
  *    - operator[]: analogous to the equivilant vector public member function,
  *      [0] will yield the next element in the queue, not the first element
- *      in the internal vector.
+ *      in the internal buffer.
  *    - The assignment operators.
  *    - initializer-list and range constructors
+ *    - find(), count() and contains(): linear searches over the
+ *      elements in the queue, vectorized for arithmetic types.
+ *    - prepare(n) and commit(k): prepare makes room for n more elements
+ *      and returns the n uninitialized slots after back() as a span, so
+ *      that a read(), a decoder or a SIMD transform can write straight
+ *      into the queue; commit then appends the first k of them (k <= n;
+ *      the queue keeps no record of n, to stay four words, so it only
+ *      asserts that k fits in the buffer) as if each had been pushed.
+ *      Anything else done to the queue in between invalidates the span.
+ *      Only for trivially copyable types, the ones for which writing the
+ *      bytes is enough to make an object.
+ *    - pop_front(), try_pop() and pop_into(T&): pops that hand back the
+ *      front element, moved out exactly once; try_pop() returns an
+ *      empty optional and pop_into() false on an empty queue, where
+ *      pop_front() is as undefined as front().
+ *    - try_push() and try_emplace(): pushes that never allocate. When
+ *      the tail reaches the end of the buffer they slide the queue down
+ *      to the start of it instead (for types that move without
+ *      throwing), and return false if the buffer is full, or if it is
+ *      shared with a copy or snapshot under cow_queue_policy.
+ *    - batch_guard: pops taken through a batch_guard(queue) do not
+ *      compact; the guard checks once, when it goes out of scope,
+ *      whether the queue should compact, so a consumer draining a
+ *      batch compacts at most once per batch instead of once per pop.
+ *      Pops made directly on the queue meanwhile behave as usual. That
+ *      compaction may allocate, and so throw; call finish() to have it
+ *      throw to the caller. A destructor cannot, so if it is left to the
+ *      destructor a failed compaction is dropped and the queue, still
+ *      valid in its old buffer, compacts on a later pop instead.
  * 4. I have added an iterator interface comparable with the one
  *    for std::vector, including all the const and reverse iterators.
  * 5. I use std::equal and std::lexicographical_compare for the
  *    implementations of the relational operators as due to the
  *    possibly different undefined spaces prior to the beginning
- *    of the queue, just comparing vectors would not work.
+ *    of the queue, just comparing buffers would not work. For
+ *    arithmetic types these go through the SSE4.2/AVX2 kernels in
+ *    simd.h instead, picked at runtime, which give the same answers.
+ * 6. The second template parameter is a Policy struct for the optional
+ *    behaviour. Derive from default_queue_policy and override what you
+ *    need:
+ *    - stats_type: no_stats by default. stats_queue_policy swaps in
+ *      queue_stats (see queue_stats.h), after which stats() returns
+ *      counts of pushes, pops, compactions and so on.
+ *    - timer_type: no_timer by default. latency_queue_policy swaps in
+ *      latency_timer (see latency.h), which times every push, pop and
+ *      compaction into the histograms of a queue_latency, by default
+ *      queue_latency::global(); timer().set_sink() picks another.
+ *    - trace_type: no_trace by default. trace_queue_policy swaps in
+ *      trace_recorder (see trace.h); once tracer().set_sink() points
+ *      it at a trace_writer every push, pop, reserve and clear is
+ *      logged, for replaying later with tools/dizzy_replay.cpp.
+ *    - growth_type: fixed_growth by default, which grows by 1.5 and
+ *      compacts on pop once half the buffer is popped.
+ *      adaptive_queue_policy swaps in adaptive_growth (see growth.h),
+ *      which picks both from the workload it sees, within a memory cap
+ *      set with growth().set_memory_cap(); growth().parameters() reads
+ *      back the current choice.
+ *    - memory_type: heap_memory by default, straight to operator new.
+ *      cached_queue_policy swaps in cached_memory (see buffer_cache.h),
+ *      which recycles released buffers through a bounded thread-local
+ *      cache, so growth and compaction mostly skip malloc;
+ *      buffer_cache::local().stats() reports its hit rate.
+ *    - guard_type: no_guard by default. steady_queue_policy swaps in
+ *      allocation_guard (see allocation_guard.h): after a warm-up
+ *      reserve(), guard().freeze() makes the queue compact only in
+ *      place, and reports any allocation it still has to make to a
+ *      handler, with a stack trace in debug builds.
+ *    - deferred_queue_policy swaps in deferred_growth (see growth.h),
+ *      under which pop() never compacts and push() only grows a full
+ *      buffer; maintenance(budget) compacts instead, and grows the
+ *      buffer ahead of the tail, copying trivially copyable elements
+ *      budget at a time so no single call takes long. Elements written
+ *      through front(), back(), operator[], data() or the iterators
+ *      while a copy is under way are copied again before the switch,
+ *      out of the same budgets, so a queue walked through its non-const
+ *      iterators between every pair of calls never gets there.
+ *    - cow_queue_policy swaps in shared_memory (see queue_snapshot.h):
+ *      copies of the queue share its buffer until one of them writes,
+ *      and snapshot() hands out a read-only queue_snapshot of the
+ *      elements for the price of a reference count. Only for trivially
+ *      copyable types.
+ * 7. push, pop, reserve and compaction carry USDT probes for bpftrace
+ *    or perf, which cost a nop when no tracer is attached (probes.h).
  */
 
 #pragma once
@@ -39,35 +126,120 @@
 #include <utility>
 #include <algorithm>
 #include <iterator>
+#include <cassert>
 #include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <type_traits>
+
+#include "allocation_guard.h"
+#include "buffer_cache.h"
+#include "growth.h"
+#include "latency.h"
+#include "probes.h"
+#include "queue_snapshot.h"
+#include "queue_stats.h"
+#include "simd.h"
+#include "span.h"
+#include "trace.h"
 
 namespace dizzy {
 
-template <typename T> class flat_queue {
+struct default_queue_policy {
+  using stats_type = no_stats;
+  using timer_type = no_timer;
+  using trace_type = no_trace;
+  using growth_type = fixed_growth;
+  using memory_type = heap_memory;
+  using guard_type = no_guard;
+};
+
+struct stats_queue_policy : default_queue_policy {
+  using stats_type = queue_stats;
+};
+
+struct latency_queue_policy : default_queue_policy {
+  using timer_type = latency_timer<>;
+};
+
+struct trace_queue_policy : default_queue_policy {
+  using trace_type = trace_recorder;
+};
+
+struct adaptive_queue_policy : default_queue_policy {
+  using growth_type = adaptive_growth;
+};
+
+struct cached_queue_policy : default_queue_policy {
+  using memory_type = cached_memory;
+};
+
+struct steady_queue_policy : default_queue_policy {
+  using guard_type = allocation_guard;
+};
+
+struct deferred_queue_policy : default_queue_policy {
+  using growth_type = deferred_growth;
+};
+
+struct cow_queue_policy : default_queue_policy {
+  using memory_type = shared_memory;
+};
+
+template <typename T, typename Policy> class batch_guard;
+
+template <typename T, typename Policy = default_queue_policy>
+class flat_queue : private Policy::stats_type,
+                   private Policy::timer_type,
+                   private Policy::trace_type,
+                   private Policy::growth_type,
+                   private Policy::guard_type {
+  static_assert(!detail::shares_buffers<typename Policy::memory_type>::value ||
+                    std::is_trivially_copyable<T>::value,
+                "a memory_type that shares buffers between queues needs a "
+                "trivially copyable type");
+
 public:
   using size_type = std::size_t;
   using container = std::vector<T>;
   using value_type = T;
-  using pointer = typename container::pointer;
-  using const_pointer = typename container::const_pointer;
-  using reference = typename container::reference;
-  using const_reference = typename container::const_reference;
-
-  using iterator = typename container::iterator;
-  using const_iterator = typename container::const_iterator;
-  using reverse_iterator = typename container::reverse_iterator;
-  using const_reverse_iterator = typename container::const_reverse_iterator;
+  using pointer = T*;
+  using const_pointer = const T*;
+  using reference = T&;
+  using const_reference = const T&;
+
+  using iterator = pointer;
+  using const_iterator = const_pointer;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+  using stats_type = typename Policy::stats_type;
+  using timer_type = typename Policy::timer_type;
+  using trace_type = typename Policy::trace_type;
+  using growth_type = typename Policy::growth_type;
+  using memory_type = typename Policy::memory_type;
+  using guard_type = typename Policy::guard_type;
+
+  // Whether copies share the buffer, so that handing out a way to
+  // write to it may first have to copy it.
+  static constexpr bool shares_buffers =
+      detail::shares_buffers<memory_type>::value;
+
+  static constexpr double growth_factor = 1.5;
 
   flat_queue() = default;
   explicit flat_queue(const container& data_in);
   explicit flat_queue(container&& data_in);
   flat_queue(const flat_queue& x);
-  flat_queue(flat_queue&& x) noexcept = default;
+  flat_queue(flat_queue&& x) noexcept;
   template <typename InputIt> flat_queue(InputIt first, InputIt last);
   flat_queue(std::initializer_list<T> init);
+  ~flat_queue();
 
   flat_queue& operator=(const flat_queue& other);
-  flat_queue& operator=(flat_queue&& other) = default;
+  flat_queue& operator=(flat_queue&& other) noexcept;
   flat_queue& operator=(std::initializer_list<T> init);
 
   template <typename InputIt> void assign(InputIt first, InputIt last);
@@ -75,6 +247,7 @@ public:
 
   bool empty() const;
   size_type size() const;
+  size_type capacity() const;
 
   reference front();
   const_reference front() const;
@@ -86,309 +259,1029 @@ public:
   void push(const value_type& val);
   void push(value_type&& val);
   template <class... Args> void emplace(Args&&... args);
+  bool try_push(const value_type& val);
+  bool try_push(value_type&& val);
+  template <class... Args> bool try_emplace(Args&&... args);
+  span<T> prepare(size_type count);
+  void commit(size_type count);
 
   void pop();
+  value_type pop_front();
+  std::optional<value_type> try_pop();
+  bool pop_into(value_type& out);
 
   void shrink_to_fit();
   void reserve(size_type new_size);
-  void compress_and_reserve(double mult_factor = 1.5);
+  void compress_and_reserve(double mult_factor = growth_factor);
+  bool maintenance(
+      size_type budget = std::numeric_limits<size_type>::max());
   void clear();
 
   pointer data();
   const_pointer data() const;
+  queue_snapshot<T> snapshot() const;
+
+  stats_type stats() const;
+  timer_type& timer();
+  trace_type& tracer();
+  growth_type& growth();
+  guard_type& guard();
 
   void swap(flat_queue& x) noexcept;
 
-  iterator begin() noexcept;
+  iterator find(const value_type& val);
+  const_iterator find(const value_type& val) const;
+  size_type count(const value_type& val) const;
+  bool contains(const value_type& val) const;
+
+  iterator begin() noexcept(!shares_buffers);
   const_iterator begin() const noexcept;
-  iterator end() noexcept;
+  iterator end() noexcept(!shares_buffers);
   const_iterator end() const noexcept;
-  reverse_iterator rbegin() noexcept;
+  reverse_iterator rbegin() noexcept(!shares_buffers);
   const_reverse_iterator rbegin() const noexcept;
-  reverse_iterator rend() noexcept;
+  reverse_iterator rend() noexcept(!shares_buffers);
   const_reverse_iterator rend() const noexcept;
   const_iterator cbegin() const noexcept;
   const_iterator cend() const noexcept;
   const_reverse_iterator crbegin() const noexcept;
   const_reverse_iterator crend() const noexcept;
 
-  template <typename U>
-  friend bool operator==(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
-  template <typename U>
-  friend bool operator!=(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
-  template <typename U>
-  friend bool operator<(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
-  template <typename U>
-  friend bool operator<=(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
-  template <typename U>
-  friend bool operator>(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
-  template <typename U>
-  friend bool operator>=(const flat_queue<U>& lhs, const flat_queue<U>& rhs);
+  template <typename U, typename P>
+  friend bool operator==(const flat_queue<U, P>& lhs,
+                         const flat_queue<U, P>& rhs);
+  template <typename U, typename P>
+  friend bool operator!=(const flat_queue<U, P>& lhs,
+                         const flat_queue<U, P>& rhs);
+  template <typename U, typename P>
+  friend bool operator<(const flat_queue<U, P>& lhs,
+                        const flat_queue<U, P>& rhs);
+  template <typename U, typename P>
+  friend bool operator<=(const flat_queue<U, P>& lhs,
+                         const flat_queue<U, P>& rhs);
+  template <typename U, typename P>
+  friend bool operator>(const flat_queue<U, P>& lhs,
+                        const flat_queue<U, P>& rhs);
+  template <typename U, typename P>
+  friend bool operator>=(const flat_queue<U, P>& lhs,
+                         const flat_queue<U, P>& rhs);
 
 private:
-  container data_;
-  size_type true_front = 0;
+  friend class batch_guard<T, Policy>;
+
+  pointer buffer_ = nullptr;
+  size_type capacity_ = 0;
+  size_type head_ = 0;
+  size_type tail_ = 0;
 
   void check_and_grow();
+  void pop_without_compaction();
+  void compact_after_pop();
+  void compact(double mult_factor, compaction_reason reason);
+  void compact_to(size_type new_capacity, compaction_reason reason);
+  bool can_compact_in_place() const;
+  void compact_in_place(compaction_reason reason);
+  bool continue_pending(size_type budget);
+  void cancel_pending() noexcept;
+  bool buffer_shared() const;
+  void unshare();
+  void will_write(size_type first, size_type last);
+  void reallocate(size_type new_capacity);
+  static pointer allocate_buffer(size_type capacity);
+  static void deallocate_buffer(pointer buffer, size_type capacity) noexcept;
+  template <typename InputIt> void append(InputIt first, InputIt last);
+  void destroy_elements() noexcept;
+  void destroy_all() noexcept;
+
+  stats_type& recorder();
+  const stats_type& recorder() const;
 };
 
-template <typename T>
-flat_queue<T>::flat_queue(const container& data_in)
-    : data_{ data_in } {}
+template <typename T, typename Policy>
+flat_queue<T, Policy>::flat_queue(const container& data_in) {
+  append(data_in.begin(), data_in.end());
+}
 
-template <typename T>
-flat_queue<T>::flat_queue(container&& data_in)
-    : data_{ std::move(data_in) } {}
+template <typename T, typename Policy>
+flat_queue<T, Policy>::flat_queue(container&& data_in) {
+  append(std::make_move_iterator(data_in.begin()),
+         std::make_move_iterator(data_in.end()));
+}
+
+template <typename T, typename Policy>
+flat_queue<T, Policy>::flat_queue(const flat_queue& x) {
+  if constexpr (shares_buffers) {
+    if (x.buffer_) {
+      memory_type::share(x.buffer_, alignof(T));
+      buffer_ = x.buffer_;
+      capacity_ = x.capacity_;
+      head_ = x.head_;
+      tail_ = x.tail_;
+    }
+  } else {
+    append(x.begin(), x.end());
+  }
+}
 
-template <typename T>
-flat_queue<T>::flat_queue(const flat_queue& x)
-    : data_(std::begin(x), std::end(x)) {}
+template <typename T, typename Policy>
+flat_queue<T, Policy>::flat_queue(flat_queue&& x) noexcept
+    : stats_type(std::move(x)),
+      timer_type(std::move(x)),
+      trace_type(std::move(x)),
+      growth_type(std::move(x)),
+      guard_type(std::move(x)),
+      buffer_{ x.buffer_ },
+      capacity_{ x.capacity_ },
+      head_{ x.head_ },
+      tail_{ x.tail_ } {
+  x.buffer_ = nullptr;
+  x.capacity_ = x.head_ = x.tail_ = 0;
+}
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename InputIt>
-flat_queue<T>::flat_queue(InputIt first, InputIt last)
-    : data_(first, last) {}
+flat_queue<T, Policy>::flat_queue(InputIt first, InputIt last) {
+  append(first, last);
+}
+
+template <typename T, typename Policy>
+flat_queue<T, Policy>::flat_queue(std::initializer_list<T> init) {
+  append(init.begin(), init.end());
+}
 
-template <typename T>
-flat_queue<T>::flat_queue(std::initializer_list<T> init)
-    : data_{ init } {}
+template <typename T, typename Policy> flat_queue<T, Policy>::~flat_queue() {
+  destroy_all();
+}
+
+template <typename T, typename Policy>
+flat_queue<T, Policy>& flat_queue<T, Policy>::
+operator=(const flat_queue& other) {
+  flat_queue<T, Policy> temp(other);
+  swap(temp);
+  return *this;
+}
 
-template <typename T>
-flat_queue<T>& flat_queue<T>::operator=(const flat_queue& other) {
-  flat_queue<T> temp(begin(other), end(other));
+template <typename T, typename Policy>
+flat_queue<T, Policy>& flat_queue<T, Policy>::
+operator=(flat_queue&& other) noexcept {
+  flat_queue<T, Policy> temp(std::move(other));
   swap(temp);
   return *this;
 }
 
-template <typename T>
-flat_queue<T>& flat_queue<T>::operator=(std::initializer_list<T> init) {
-  data_ = init;
-  true_front = 0;
+template <typename T, typename Policy>
+flat_queue<T, Policy>& flat_queue<T, Policy>::
+operator=(std::initializer_list<T> init) {
+  assign(init);
+  return *this;
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename InputIt>
-void flat_queue<T>::assign(InputIt first, InputIt last) {
-  data_.assign(first, last);
-  true_front = 0;
+void flat_queue<T, Policy>::assign(InputIt first, InputIt last) {
+  destroy_elements();
+  append(first, last);
 }
 
-template <typename T>
-void flat_queue<T>::assign(std::initializer_list<T> init) {
-  data_.assign(init);
-  true_front = 0;
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::assign(std::initializer_list<T> init) {
+  destroy_elements();
+  append(init.begin(), init.end());
 }
 
-template <typename T> bool flat_queue<T>::empty() const {
-  return data_.size() == true_front;
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::empty() const {
+  return head_ == tail_;
 }
 
-template <typename T>
-typename flat_queue<T>::size_type flat_queue<T>::size() const {
-  return data_.size() - true_front;
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::size_type flat_queue<T, Policy>::size() const {
+  return tail_ - head_;
 }
 
-template <typename T> typename flat_queue<T>::reference flat_queue<T>::front() {
-  return data_[true_front];
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::size_type
+flat_queue<T, Policy>::capacity() const {
+  return capacity_;
 }
 
-template <typename T>
-typename flat_queue<T>::const_reference flat_queue<T>::front() const {
-  return data_[true_front];
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::reference flat_queue<T, Policy>::front() {
+  will_write(head_, head_ + 1);
+  return buffer_[head_];
 }
 
-template <typename T> typename flat_queue<T>::reference flat_queue<T>::back() {
-  return data_.back();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reference
+flat_queue<T, Policy>::front() const {
+  return buffer_[head_];
 }
 
-template <typename T>
-typename flat_queue<T>::const_reference flat_queue<T>::back() const {
-  return data_.back();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::reference flat_queue<T, Policy>::back() {
+  will_write(tail_ - 1, tail_);
+  return buffer_[tail_ - 1];
 }
 
-template <typename T>
-typename flat_queue<T>::reference flat_queue<T>::
-operator[](typename flat_queue<T>::size_type pos) {
-  return data_[true_front + pos];
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reference
+flat_queue<T, Policy>::back() const {
+  return buffer_[tail_ - 1];
 }
 
-template <typename T>
-typename flat_queue<T>::const_reference flat_queue<T>::
-operator[](typename flat_queue<T>::size_type pos) const {
-  return data_[true_front + pos];
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::reference flat_queue<T, Policy>::
+operator[](typename flat_queue<T, Policy>::size_type pos) {
+  will_write(head_ + pos, head_ + pos + 1);
+  return buffer_[head_ + pos];
 }
 
-template <typename T> void flat_queue<T>::check_and_grow() {
-  if (data_.size() == data_.capacity()) {
-    compress_and_reserve();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reference flat_queue<T, Policy>::
+operator[](typename flat_queue<T, Policy>::size_type pos) const {
+  return buffer_[head_ + pos];
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::check_and_grow() {
+  unshare();
+  // A frozen queue slides down whenever there is any room in front, so
+  // it never allocates below its capacity. Each slide moves size()
+  // elements to make room for capacity() - size() pushes; the warm-up
+  // reserve() is what keeps that ratio cheap.
+  if (tail_ == capacity_ && guard().frozen() && can_compact_in_place()) {
+    compact_in_place(compaction_reason::growth);
+  } else if (tail_ == capacity_) {
+    compact_to(std::max(growth().target_capacity(size(), sizeof(T)),
+                        size() + 1),
+               compaction_reason::growth);
   }
 }
 
-template <typename T> void flat_queue<T>::push(const T& val) {
-  check_and_grow();
-  data_.push_back(val);
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::push(const T& val) {
+  emplace(val);
 }
 
-template <typename T> void flat_queue<T>::push(T&& val) {
-  check_and_grow();
-  data_.push_back(std::move(val));
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::push(T&& val) {
+  emplace(std::move(val));
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <class... Args>
-void flat_queue<T>::emplace(Args&&... args) {
+void flat_queue<T, Policy>::emplace(Args&&... args) {
+  auto started = timer().start();
   check_and_grow();
-  data_.emplace_back(std::forward<Args>(args)...);
+  ::new (static_cast<void*>(buffer_ + tail_)) T(std::forward<Args>(args)...);
+  ++tail_;
+  recorder().on_push(size(), capacity_);
+  tracer().on_push();
+  growth().on_push(size());
+  DIZZY_PROBE3(push, this, size(), capacity_);
+  timer().stop(latency_op::push, started);
+}
+
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::try_push(const T& val) {
+  return try_emplace(val);
 }
 
-template <typename T> void flat_queue<T>::pop() {
-  ++true_front;
-  if (true_front > data_.size() / 2) {
-    compress_and_reserve();
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::try_push(T&& val) {
+  return try_emplace(std::move(val));
+}
+
+// emplace() without the allocation: slides the queue down when it has
+// reached the end of the buffer, at the same cost as a frozen push (see
+// check_and_grow), or fails if it fills the buffer or would have to
+// copy a shared one first.
+template <typename T, typename Policy>
+template <class... Args>
+bool flat_queue<T, Policy>::try_emplace(Args&&... args) {
+  if (buffer_shared()) {
+    return false;
+  }
+  if (tail_ == capacity_) {
+    if (!can_compact_in_place()) {
+      return false;
+    }
+    compact_in_place(compaction_reason::growth);
+  }
+  emplace(std::forward<Args>(args)...);
+  return true;
+}
+
+template <typename T, typename Policy>
+span<T> flat_queue<T, Policy>::prepare(size_type count) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "prepare() hands out uninitialized slots, which needs a "
+                "trivially copyable type");
+  unshare();
+  if (count > capacity_ - tail_) {
+    compact_to(std::max(growth().target_capacity(size(), sizeof(T)),
+                        size() + count),
+               compaction_reason::growth);
+  }
+  return span<T>(buffer_ + tail_, count);
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::commit(size_type count) {
+  assert(count <= capacity_ - tail_);
+  for (size_type i = 0; i < count; ++i) {
+    ++tail_;
+    recorder().on_push(size(), capacity_);
+    tracer().on_push();
+    growth().on_push(size());
+  }
+  DIZZY_PROBE3(commit, this, count, size());
+}
+
+template <typename T, typename Policy> void flat_queue<T, Policy>::pop() {
+  auto started = timer().start();
+  pop_without_compaction();
+  compact_after_pop();
+  timer().stop(latency_op::pop, started);
+}
+
+template <typename T, typename Policy> T flat_queue<T, Policy>::pop_front() {
+  T val(std::move(buffer_[head_]));
+  pop();
+  return val;
+}
+
+template <typename T, typename Policy>
+std::optional<T> flat_queue<T, Policy>::try_pop() {
+  std::optional<T> val;
+  if (!empty()) {
+    val.emplace(std::move(buffer_[head_]));
+    pop();
+  }
+  return val;
+}
+
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::pop_into(T& out) {
+  if (empty()) {
+    return false;
+  }
+  out = std::move(buffer_[head_]);
+  pop();
+  return true;
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::pop_without_compaction() {
+  buffer_[head_++].~T();
+  recorder().on_pop();
+  tracer().on_pop();
+  growth().on_pop(size());
+  DIZZY_PROBE3(pop, this, size(), capacity_);
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::compact_after_pop() {
+  if (!growth().compact_on_pop(head_, tail_)) {
+    return;
+  }
+  if (guard().frozen() && can_compact_in_place()) {
+    compact_in_place(compaction_reason::pop);
+  } else {
+    compact_to(growth().target_capacity(size(), sizeof(T)),
+               compaction_reason::pop);
   }
 }
 
-template <typename T> void flat_queue<T>::shrink_to_fit() {
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::shrink_to_fit() {
   compress_and_reserve(1.0);
 }
 
-template <typename T>
-void flat_queue<T>::reserve(flat_queue<T>::size_type new_size) {
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::reserve(size_type new_size) {
+  DIZZY_PROBE4(reserve, this, new_size, size(), capacity_);
+  tracer().on_reserve(new_size);
   if (empty()) {
-    data_.reserve(new_size);
+    cancel_pending();
+    head_ = tail_ = 0;
+    if (new_size > capacity_) {
+      recorder().on_allocation();
+      reallocate(new_size);
+    }
   } else {
     compress_and_reserve(new_size / static_cast<double>(size()));
   }
 }
 
-template <typename T>
-void flat_queue<T>::compress_and_reserve(double mult_factor) {
-  container tempContainer;
-  tempContainer.reserve(ceil(size() * mult_factor));
-  std::move(begin(), end(), std::back_inserter(tempContainer));
-  std::swap(data_, tempContainer);
-  true_front = 0;
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::compress_and_reserve(double mult_factor) {
+  compact(mult_factor, compaction_reason::requested);
+}
+
+// Does the compaction work the growth policy has left for later, if
+// there is any, and returns true once none is left. Under a policy that
+// defers compaction, a trivially copyable queue is copied into its new
+// buffer budget elements per call, and switches to it, in one step, on
+// the call that catches up with the tail.
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::maintenance(size_type budget) {
+  if constexpr (detail::defers_compaction<growth_type>::value) {
+    if (growth().pending().buffer) {
+      return continue_pending(budget);
+    }
+    if (!growth().compaction_due(head_, tail_, capacity_)) {
+      return true;
+    }
+  } else if (!growth().compact_on_pop(head_, tail_)) {
+    return true;
+  }
+  if (empty()) {
+    head_ = tail_ = 0;
+    return true;
+  }
+  if (guard().frozen()) {
+    if (can_compact_in_place()) {
+      compact_in_place(compaction_reason::requested);
+    }
+    return true;
+  }
+  size_type target = growth().target_capacity(size(), sizeof(T));
+  if constexpr (detail::defers_compaction<growth_type>::value &&
+                std::is_trivially_copyable<T>::value) {
+    deferred_compaction& pending = growth().pending();
+    pending.buffer = allocate_buffer(std::max(target, size() + 1));
+    pending.capacity = std::max(target, size() + 1);
+    pending.base = pending.copied = head_;
+    return continue_pending(budget);
+  } else {
+    compact_to(target, compaction_reason::requested);
+    return true;
+  }
+}
+
+// Copies up to budget more elements into the pending buffer and adopts
+// it once they are all there. Gives up on it if the queue has outgrown
+// it meanwhile.
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::continue_pending(size_type budget) {
+  if constexpr (detail::defers_compaction<growth_type>::value) {
+    deferred_compaction& pending = growth().pending();
+    if (head_ < pending.base || tail_ - pending.base > pending.capacity) {
+      cancel_pending();
+      return false;
+    }
+    pointer target = static_cast<pointer>(pending.buffer);
+    size_type from = std::max(pending.copied, head_);
+    size_type count = std::min(budget, tail_ - from);
+    if (count != 0) {
+      std::memcpy(static_cast<void*>(target + (from - pending.base)),
+                  buffer_ + from, count * sizeof(T));
+    }
+    pending.copied = from + count;
+    budget -= count;
+    // Slots written to since they were copied go again, out of the same
+    // budget, so no one call copies more than budget elements.
+    bool clean = true;
+    for (deferred_compaction::range& dirty : pending.dirty) {
+      dirty.begin = std::max(dirty.begin, head_);
+      count = dirty.empty() ? 0 : std::min(budget, dirty.end - dirty.begin);
+      if (count != 0) {
+        std::memcpy(static_cast<void*>(target + (dirty.begin - pending.base)),
+                    buffer_ + dirty.begin, count * sizeof(T));
+        dirty.begin += count;
+        budget -= count;
+      }
+      if (dirty.empty()) {
+        dirty = deferred_compaction::range{};
+      } else {
+        clean = false;
+      }
+    }
+    if (pending.copied != tail_ || !clean) {
+      return false;
+    }
+    DIZZY_PROBE4(compaction_start, this,
+                 static_cast<int>(compaction_reason::requested), size(),
+                 capacity_);
+    recorder().on_allocation();
+    recorder().on_compaction(compaction_reason::requested,
+                             size() * sizeof(T), pending.capacity);
+    [[maybe_unused]] size_type old_capacity = capacity_;
+    if (buffer_) {
+      deallocate_buffer(buffer_, capacity_);
+    }
+    buffer_ = target;
+    capacity_ = pending.capacity;
+    head_ -= pending.base;
+    tail_ -= pending.base;
+    pending.buffer = nullptr;
+    pending.capacity = pending.base = pending.copied = 0;
+    pending.dirty[0] = pending.dirty[1] = deferred_compaction::range{};
+    DIZZY_PROBE5(compaction_end, this,
+                 static_cast<int>(compaction_reason::requested), size(),
+                 old_capacity, capacity_);
+  }
+  return true;
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::cancel_pending() noexcept {
+  if constexpr (detail::defers_compaction<growth_type>::value) {
+    deferred_compaction& pending = growth().pending();
+    if (pending.buffer) {
+      deallocate_buffer(static_cast<pointer>(pending.buffer),
+                        pending.capacity);
+      pending.buffer = nullptr;
+      pending.capacity = pending.base = pending.copied = 0;
+      pending.dirty[0] = pending.dirty[1] = deferred_compaction::range{};
+    }
+  }
+}
+
+// Called by every member that hands out a way to write to the slots
+// [first, last) of the buffer: a shared buffer is copied first, and a
+// pending compaction notes the ones it has copied already, to copy them
+// again before it switches over.
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::will_write(size_type first, size_type last) {
+  unshare();
+  if constexpr (detail::defers_compaction<growth_type>::value) {
+    deferred_compaction& pending = growth().pending();
+    last = std::min(last, pending.copied);
+    if (pending.buffer && first < last) {
+      pending.mark_dirty(first, last);
+    }
+  }
 }
 
-template <typename T> void flat_queue<T>::clear() {
-  data_.clear();
-  true_front = 0;
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::compact(double mult_factor,
+                                    compaction_reason reason) {
+  compact_to(ceil(size() * mult_factor), reason);
 }
 
-template <typename T> typename flat_queue<T>::pointer flat_queue<T>::data() {
-  return data_.data() + true_front;
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::compact_to(size_type new_capacity,
+                                       compaction_reason reason) {
+  auto started = timer().start();
+  DIZZY_PROBE4(compaction_start, this, static_cast<int>(reason), size(),
+               capacity_);
+  new_capacity = std::max(new_capacity, size());
+  if (new_capacity != 0) {
+    recorder().on_allocation();
+  }
+  recorder().on_compaction(reason, size() * sizeof(T), new_capacity);
+  [[maybe_unused]] size_type old_capacity = capacity_;
+  reallocate(new_capacity);
+  DIZZY_PROBE5(compaction_end, this, static_cast<int>(reason), size(),
+               old_capacity, capacity_);
+  timer().stop(latency_op::compaction, started);
 }
 
-template <typename T>
-typename flat_queue<T>::const_pointer flat_queue<T>::data() const {
-  return data_.data() + true_front;
+// Only for types that move without throwing, since a throw halfway
+// through would leave a hole in the queue.
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::can_compact_in_place() const {
+  return std::is_nothrow_move_constructible<T>::value && head_ != 0;
 }
 
-template <typename T> void flat_queue<T>::swap(flat_queue& x) noexcept {
+// Slides the live range down to the start of the buffer it is in. Each
+// element is moved into a slot that is either below head_ or was the
+// source of an earlier move, so always empty by the time it is written.
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::compact_in_place(compaction_reason reason) {
+  if (buffer_shared()) {
+    unshare();
+    return;
+  }
+  cancel_pending();
+  auto started = timer().start();
+  DIZZY_PROBE4(compaction_start, this, static_cast<int>(reason), size(),
+               capacity_);
+  recorder().on_compaction(reason, size() * sizeof(T), capacity_);
+  size_type count = size();
+  for (size_type i = 0; i < count; ++i) {
+    ::new (static_cast<void*>(buffer_ + i)) T(std::move(buffer_[head_ + i]));
+    buffer_[head_ + i].~T();
+  }
+  head_ = 0;
+  tail_ = count;
+  DIZZY_PROBE5(compaction_end, this, static_cast<int>(reason), size(),
+               capacity_, capacity_);
+  timer().stop(latency_op::compaction, started);
+}
+
+// Moves the live range to the start of a new buffer of new_capacity
+// slots, which must be at least size().
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::reallocate(size_type new_capacity) {
+  if (new_capacity != 0) {
+    guard().on_allocation(this, new_capacity * sizeof(T));
+  }
+  pointer new_buffer = new_capacity != 0 ? allocate_buffer(new_capacity)
+                                         : nullptr;
+  try {
+    std::uninitialized_move(buffer_ + head_, buffer_ + tail_, new_buffer);
+  } catch (...) {
+    if (new_buffer) {
+      deallocate_buffer(new_buffer, new_capacity);
+    }
+    throw;
+  }
+  size_type count = size();
+  destroy_all();
+  buffer_ = new_buffer;
+  capacity_ = new_capacity;
+  head_ = 0;
+  tail_ = count;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::pointer
+flat_queue<T, Policy>::allocate_buffer(size_type capacity) {
+  if (capacity > std::numeric_limits<size_type>::max() / sizeof(T)) {
+    throw std::bad_array_new_length();
+  }
+  return static_cast<pointer>(
+      memory_type::allocate(capacity * sizeof(T), alignof(T)));
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::deallocate_buffer(pointer buffer,
+                                              size_type capacity) noexcept {
+  memory_type::deallocate(buffer, capacity * sizeof(T), alignof(T));
+}
+
+// Adds [first, last) at the back without going through push, which is
+// what the constructors and assign() want. Forward ranges are allocated
+// for up front and copied straight into the buffer.
+template <typename T, typename Policy>
+template <typename InputIt>
+void flat_queue<T, Policy>::append(InputIt first, InputIt last) {
+  using category = typename std::iterator_traits<InputIt>::iterator_category;
+  unshare();
+  if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+    size_type count = static_cast<size_type>(std::distance(first, last));
+    if (count > capacity_ - tail_) {
+      recorder().on_allocation();
+      reallocate(size() + count);
+    }
+    std::uninitialized_copy(first, last, buffer_ + tail_);
+    tail_ += count;
+  } else {
+    for (; first != last; ++first) {
+      if (tail_ == capacity_) {
+        recorder().on_allocation();
+        reallocate(std::max<size_type>(ceil(size() * growth_factor),
+                                       size() + 1));
+      }
+      ::new (static_cast<void*>(buffer_ + tail_)) T(*first);
+      ++tail_;
+    }
+  }
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::destroy_elements() noexcept {
+  cancel_pending();
+  for (size_type i = head_; i != tail_; ++i) {
+    buffer_[i].~T();
+  }
+  head_ = tail_ = 0;
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::destroy_all() noexcept {
+  destroy_elements();
+  if (buffer_) {
+    deallocate_buffer(buffer_, capacity_);
+  }
+  buffer_ = nullptr;
+  capacity_ = 0;
+}
+
+template <typename T, typename Policy> void flat_queue<T, Policy>::clear() {
+  tracer().on_clear();
+  destroy_elements();
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::pointer flat_queue<T, Policy>::data() {
+  will_write(head_, tail_);
+  return buffer_ + head_;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_pointer
+flat_queue<T, Policy>::data() const {
+  return buffer_ + head_;
+}
+
+template <typename T, typename Policy>
+queue_snapshot<T> flat_queue<T, Policy>::snapshot() const {
+  static_assert(shares_buffers,
+                "snapshot() needs a Policy whose memory_type shares "
+                "buffers, such as cow_queue_policy");
+  if (!buffer_) {
+    return queue_snapshot<T>();
+  }
+  memory_type::share(buffer_, alignof(T));
+  return queue_snapshot<T>(buffer_, capacity_, head_, tail_);
+}
+
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::buffer_shared() const {
+  if constexpr (shares_buffers) {
+    return buffer_ && memory_type::shared(buffer_, alignof(T));
+  } else {
+    return false;
+  }
+}
+
+// Copies the elements into a buffer of the queue's own, with as much
+// room after them as there was, when anyone else holds the current one.
+template <typename T, typename Policy> void flat_queue<T, Policy>::unshare() {
+  if (buffer_shared()) {
+    recorder().on_allocation();
+    reallocate(std::max(capacity_ - head_, size() + 1));
+  }
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::stats_type
+flat_queue<T, Policy>::stats() const {
+  static_assert(!std::is_same<stats_type, no_stats>::value,
+                "stats() needs a Policy with a stats_type, such as "
+                "stats_queue_policy");
+  stats_type result = recorder();
+  if (capacity_ != 0) {
+    result.wasted_prefix_ratio = head_ / static_cast<double>(capacity_);
+  }
+  return result;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::timer_type& flat_queue<T, Policy>::timer() {
+  return *this;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::trace_type& flat_queue<T, Policy>::tracer() {
+  return *this;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::growth_type& flat_queue<T, Policy>::growth() {
+  return *this;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::guard_type& flat_queue<T, Policy>::guard() {
+  return *this;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::stats_type& flat_queue<T, Policy>::recorder() {
+  return *this;
+}
+
+template <typename T, typename Policy>
+const typename flat_queue<T, Policy>::stats_type&
+flat_queue<T, Policy>::recorder() const {
+  return *this;
+}
+
+template <typename T, typename Policy>
+void flat_queue<T, Policy>::swap(flat_queue& x) noexcept {
   using std::swap;
-  swap(data_, x.data_);
-  swap(true_front, x.true_front);
+  cancel_pending();
+  x.cancel_pending();
+  swap(buffer_, x.buffer_);
+  swap(capacity_, x.capacity_);
+  swap(head_, x.head_);
+  swap(tail_, x.tail_);
 }
 
-template <typename T> void swap(flat_queue<T>& x, flat_queue<T>& y) noexcept {
+template <typename T, typename Policy>
+void swap(flat_queue<T, Policy>& x, flat_queue<T, Policy>& y) noexcept {
   x.swap(y);
 }
 
-template <typename T>
-typename flat_queue<T>::iterator flat_queue<T>::begin() noexcept {
-  return std::begin(data_) + true_front;
+template <typename T, typename Policy = default_queue_policy>
+class batch_guard {
+public:
+  using queue_type = flat_queue<T, Policy>;
+  using value_type = T;
+
+  explicit batch_guard(queue_type& queue);
+  batch_guard(const batch_guard&) = delete;
+  ~batch_guard();
+
+  batch_guard& operator=(const batch_guard&) = delete;
+
+  void pop();
+  value_type pop_front();
+  std::optional<value_type> try_pop();
+  bool pop_into(value_type& out);
+
+  void finish();
+
+private:
+  queue_type& queue_;
+  bool popped_ = false;
+};
+
+template <typename T, typename Policy>
+batch_guard<T, Policy>::batch_guard(queue_type& queue) : queue_{ queue } {}
+
+// A compaction that fails leaves the queue valid in its old buffer, so
+// dropping the error here only puts the compaction off.
+template <typename T, typename Policy> batch_guard<T, Policy>::~batch_guard() {
+  try {
+    finish();
+  } catch (...) {
+  }
+}
+
+template <typename T, typename Policy> void batch_guard<T, Policy>::pop() {
+  auto started = queue_.timer().start();
+  queue_.pop_without_compaction();
+  popped_ = true;
+  queue_.timer().stop(latency_op::pop, started);
+}
+
+template <typename T, typename Policy> void batch_guard<T, Policy>::finish() {
+  if (popped_) {
+    popped_ = false;
+    queue_.compact_after_pop();
+  }
+}
+
+template <typename T, typename Policy> T batch_guard<T, Policy>::pop_front() {
+  T val(std::move(queue_.buffer_[queue_.head_]));
+  pop();
+  return val;
+}
+
+template <typename T, typename Policy>
+std::optional<T> batch_guard<T, Policy>::try_pop() {
+  std::optional<T> val;
+  if (!queue_.empty()) {
+    val.emplace(std::move(queue_.buffer_[queue_.head_]));
+    pop();
+  }
+  return val;
+}
+
+template <typename T, typename Policy>
+bool batch_guard<T, Policy>::pop_into(T& out) {
+  if (queue_.empty()) {
+    return false;
+  }
+  out = std::move(queue_.buffer_[queue_.head_]);
+  pop();
+  return true;
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::iterator
+flat_queue<T, Policy>::find(const T& val) {
+  return begin() + detail::simd_find(data(), size(), val);
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_iterator
+flat_queue<T, Policy>::find(const T& val) const {
+  return begin() + detail::simd_find(data(), size(), val);
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::size_type
+flat_queue<T, Policy>::count(const T& val) const {
+  return detail::simd_count(data(), size(), val);
+}
+
+template <typename T, typename Policy>
+bool flat_queue<T, Policy>::contains(const T& val) const {
+  return detail::simd_find(data(), size(), val) != size();
+}
+
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::iterator
+flat_queue<T, Policy>::begin() noexcept(!shares_buffers) {
+  will_write(head_, tail_);
+  return buffer_ + head_;
 }
 
-template <typename T>
-typename flat_queue<T>::const_iterator flat_queue<T>::begin() const noexcept {
-  return data_.cbegin() + true_front;
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_iterator
+flat_queue<T, Policy>::begin() const noexcept {
+  return buffer_ + head_;
 }
 
-template <typename T>
-typename flat_queue<T>::iterator flat_queue<T>::end() noexcept {
-  return std::end(data_);
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::iterator
+flat_queue<T, Policy>::end() noexcept(!shares_buffers) {
+  will_write(head_, tail_);
+  return buffer_ + tail_;
 }
 
-template <typename T>
-typename flat_queue<T>::const_iterator flat_queue<T>::end() const noexcept {
-  return data_.cend();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_iterator
+flat_queue<T, Policy>::end() const noexcept {
+  return buffer_ + tail_;
 }
 
-template <typename T>
-typename flat_queue<T>::reverse_iterator flat_queue<T>::rbegin() noexcept {
-  return data_.rbegin();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::reverse_iterator
+flat_queue<T, Policy>::rbegin() noexcept(!shares_buffers) {
+  return reverse_iterator(end());
 }
 
-template <typename T>
-typename flat_queue<T>::const_reverse_iterator flat_queue<T>::rbegin() const
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reverse_iterator
+flat_queue<T, Policy>::rbegin() const
     noexcept {
-  return data_.crbegin();
+  return const_reverse_iterator(end());
 }
 
-template <typename T>
-typename flat_queue<T>::reverse_iterator flat_queue<T>::rend() noexcept {
-  return data_.rend() - true_front;
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::reverse_iterator
+flat_queue<T, Policy>::rend() noexcept(!shares_buffers) {
+  return reverse_iterator(begin());
 }
 
-template <typename T>
-typename flat_queue<T>::const_reverse_iterator flat_queue<T>::rend() const
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reverse_iterator
+flat_queue<T, Policy>::rend() const
     noexcept {
-  return data_.crend() - true_front;
+  return const_reverse_iterator(begin());
 }
 
-template <typename T>
-typename flat_queue<T>::const_iterator flat_queue<T>::cbegin() const noexcept {
-  return data_.cbegin() + true_front;
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_iterator
+flat_queue<T, Policy>::cbegin() const noexcept {
+  return begin();
 }
 
-template <typename T>
-typename flat_queue<T>::const_iterator flat_queue<T>::cend() const noexcept {
-  return data_.cend();
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_iterator
+flat_queue<T, Policy>::cend() const noexcept {
+  return end();
 }
 
-template <typename T>
-typename flat_queue<T>::const_reverse_iterator flat_queue<T>::crbegin() const
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reverse_iterator
+flat_queue<T, Policy>::crbegin() const
     noexcept {
-  return data_.crbegin();
+  return rbegin();
 }
 
-template <typename T>
-typename flat_queue<T>::const_reverse_iterator flat_queue<T>::crend() const
+template <typename T, typename Policy>
+typename flat_queue<T, Policy>::const_reverse_iterator
+flat_queue<T, Policy>::crend() const
     noexcept {
-  return data_.crend() - true_front;
+  return rend();
 }
 
-template <typename T>
-inline bool operator==(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
+template <typename T, typename Policy>
+inline bool operator==(const flat_queue<T, Policy>& lhs,
+                       const flat_queue<T, Policy>& rhs) {
   if (lhs.size() != rhs.size()) {
     return false;
   }
-  return std::equal(std::begin(lhs), std::end(lhs), std::begin(rhs));
+  return detail::simd_equal(lhs.data(), rhs.data(), lhs.size());
 }
 
-template <typename T>
-inline bool operator!=(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
+template <typename T, typename Policy>
+inline bool operator!=(const flat_queue<T, Policy>& lhs,
+                       const flat_queue<T, Policy>& rhs) {
   return !(lhs == rhs);
 }
 
-template <typename T>
-inline bool operator<(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
-  return std::lexicographical_compare(
-      begin(lhs), end(lhs), begin(rhs), end(rhs));
+template <typename T, typename Policy>
+inline bool operator<(const flat_queue<T, Policy>& lhs,
+                      const flat_queue<T, Policy>& rhs) {
+  return detail::simd_lexicographical_less(lhs.data(), lhs.size(),
+                                           rhs.data(), rhs.size());
 }
 
-template <typename T>
-inline bool operator<=(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
+template <typename T, typename Policy>
+inline bool operator<=(const flat_queue<T, Policy>& lhs,
+                       const flat_queue<T, Policy>& rhs) {
   return !(rhs < lhs);
 }
 
-template <typename T>
-inline bool operator>(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
+template <typename T, typename Policy>
+inline bool operator>(const flat_queue<T, Policy>& lhs,
+                      const flat_queue<T, Policy>& rhs) {
   return rhs < lhs;
 }
 
-template <typename T>
-inline bool operator>=(const flat_queue<T>& lhs, const flat_queue<T>& rhs) {
+template <typename T, typename Policy>
+inline bool operator>=(const flat_queue<T, Policy>& lhs,
+                       const flat_queue<T, Policy>& rhs) {
   return !(lhs < rhs);
 }
 }
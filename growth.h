@@ -0,0 +1,335 @@
+/* Growth and compaction parameters for flat_queue, picked through its
+ * Policy (see adaptive_queue_policy in flat_queue.h).
+ * 1. A growth_type decides two things: the capacity to compact into,
+ *    target_capacity(size, element_size), whenever the buffer fills up
+ *    or pop() compacts, and whether pop() should compact at all,
+ *    compact_on_pop(front, used), where front is the number of popped
+ *    slots at the start of the buffer and used is front plus size().
+ *    on_push and on_pop let it watch the queue's size as it goes.
+ * 2. fixed_growth is the default and is what flat_queue has always done:
+ *    compact into 1.5 times the size, and compact on pop once more than
+ *    half of the used buffer has been popped.
+ * 3. adaptive_growth watches a sliding window of operations (two halves
+ *    of window/2 operations, the older half dropped as a new one fills)
+ *    for the peak size and the share of pushes and pops, and re-picks
+ *    its capacity factor and compaction trigger from that at every
+ *    compaction. It models, for each candidate pair, the bytes moved per
+ *    operation:
+ *    - a balanced flow compacts every min(t / (1 - t), f - 1) * peak
+ *      pushes, moving the peak each time,
+ *    - and net growth moves 1 / (f - 1) elements per net push,
+ *    and the footprint, max(f, 1 / (1 - t)) * peak * element_size, and
+ *    picks the pair moving the fewest bytes within the memory cap (or
+ *    the smallest footprint if none fit). Net shrinking counts against
+ *    a high trigger, since memory is only given back on a compaction.
+ *    With no cap set it allows twice the peak, the worst case footprint
+ *    of fixed_growth. parameters() reads back the current choice.
+ * 4. deferred_growth never compacts on pop, leaving the work to
+ *    flat_queue::maintenance() (see maintenance.h). compaction_due()
+ *    says when there is some: more than half of the used buffer popped,
+ *    as fixed_growth, or less than a quarter of size() left free after
+ *    the tail, so that maintenance grows the buffer before a push has
+ *    to. It grows by 1.5 like fixed_growth, and carries the compaction
+ *    maintenance() has under way as its pending() deferred_compaction.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace dizzy {
+
+struct growth_parameters {
+  double capacity_factor;
+  double compaction_trigger;
+};
+
+struct fixed_growth {
+  static constexpr double capacity_factor = 1.5;
+
+  void on_push(std::size_t) {}
+  void on_pop(std::size_t) {}
+  std::size_t target_capacity(std::size_t size, std::size_t);
+  bool compact_on_pop(std::size_t front, std::size_t used) const;
+  growth_parameters parameters() const;
+};
+
+// A buffer of capacity slots that maintenance() is filling with the
+// queue's elements, the one at position base of the old buffer going
+// to position 0, with everything below copied already there. The
+// dirty ranges hold slots of the old buffer that were copied but may
+// have been written through a reference since; they are copied again,
+// within the same budget, before the switch. Only one queue ever owns
+// the buffer: copies start out empty and moves leave the source empty.
+struct deferred_compaction {
+  struct range {
+    std::size_t begin = 0;
+    std::size_t end = 0;
+
+    bool empty() const { return begin >= end; }
+  };
+
+  void* buffer = nullptr;
+  std::size_t capacity = 0;
+  std::size_t base = 0;
+  std::size_t copied = 0;
+  range dirty[2];
+
+  deferred_compaction() = default;
+  deferred_compaction(const deferred_compaction&) {}
+  deferred_compaction(deferred_compaction&& x) noexcept;
+  deferred_compaction& operator=(const deferred_compaction&) = delete;
+
+  void mark_dirty(std::size_t first, std::size_t last);
+};
+
+class deferred_growth {
+public:
+  void on_push(std::size_t) {}
+  void on_pop(std::size_t) {}
+  std::size_t target_capacity(std::size_t size, std::size_t element_size);
+  bool compact_on_pop(std::size_t, std::size_t) const { return false; }
+  bool compaction_due(std::size_t front, std::size_t used,
+                      std::size_t capacity) const;
+  growth_parameters parameters() const;
+
+  deferred_compaction& pending();
+
+private:
+  deferred_compaction pending_;
+};
+
+namespace detail {
+template <typename Growth, typename = void>
+struct defers_compaction : std::false_type {};
+
+template <typename Growth>
+struct defers_compaction<
+    Growth, std::void_t<decltype(std::declval<Growth&>().pending())>>
+    : std::true_type {};
+}
+
+class adaptive_growth {
+public:
+  static constexpr std::size_t default_window = 4096;
+
+  void on_push(std::size_t size);
+  void on_pop(std::size_t size);
+  std::size_t target_capacity(std::size_t size, std::size_t element_size);
+  bool compact_on_pop(std::size_t front, std::size_t used) const;
+  growth_parameters parameters() const;
+
+  // 0, the default, means twice the window's peak footprint.
+  void set_memory_cap(std::size_t bytes);
+  std::size_t memory_cap() const;
+  void set_window(std::size_t operations);
+
+private:
+  static constexpr double factors[] = { 1.25, 1.5, 2.0, 3.0, 4.0 };
+  static constexpr double triggers[] = { 0.25, 0.5, 0.75 };
+
+  std::size_t memory_cap_ = 0;
+  std::size_t half_window_ = default_window / 2;
+  std::size_t operations_ = 0;
+  std::uint64_t pushes_[2] = {};
+  std::uint64_t pops_[2] = {};
+  std::size_t peak_[2] = {};
+  growth_parameters chosen_ = { fixed_growth::capacity_factor, 0.5 };
+
+  void observe(std::size_t size);
+  void choose(std::size_t element_size);
+};
+
+inline std::size_t fixed_growth::target_capacity(std::size_t size,
+                                                 std::size_t) {
+  return static_cast<std::size_t>(std::ceil(size * capacity_factor));
+}
+
+inline bool fixed_growth::compact_on_pop(std::size_t front,
+                                         std::size_t used) const {
+  return front > used / 2;
+}
+
+inline growth_parameters fixed_growth::parameters() const {
+  return { capacity_factor, 0.5 };
+}
+
+inline deferred_compaction::deferred_compaction(
+    deferred_compaction&& x) noexcept
+    : buffer{ x.buffer },
+      capacity{ x.capacity },
+      base{ x.base },
+      copied{ x.copied } {
+  dirty[0] = x.dirty[0];
+  dirty[1] = x.dirty[1];
+  x.buffer = nullptr;
+  x.capacity = x.base = x.copied = 0;
+  x.dirty[0] = x.dirty[1] = range{};
+}
+
+// Two ranges, so that a consumer writing at the front and a producer
+// writing at the back of a long queue do not add up to all of it. A
+// third range joins whichever of the two it grows least.
+inline void deferred_compaction::mark_dirty(std::size_t first,
+                                            std::size_t last) {
+  auto touches = [first, last](const range& r) {
+    return !r.empty() && r.begin <= last && first <= r.end;
+  };
+  auto grown = [first, last](const range& r) {
+    return std::max(r.end, last) - std::min(r.begin, first) -
+           (r.end - r.begin);
+  };
+  range& a = dirty[0];
+  range& b = dirty[1];
+  range* into = nullptr;
+  if (touches(a)) {
+    into = &a;
+  } else if (touches(b)) {
+    into = &b;
+  } else if (a.empty()) {
+    a = range{ first, last };
+    return;
+  } else if (b.empty()) {
+    b = range{ first, last };
+    return;
+  } else {
+    into = grown(a) <= grown(b) ? &a : &b;
+  }
+  into->begin = std::min(into->begin, first);
+  into->end = std::max(into->end, last);
+  if (!a.empty() && !b.empty() && a.begin <= b.end && b.begin <= a.end) {
+    a.begin = std::min(a.begin, b.begin);
+    a.end = std::max(a.end, b.end);
+    b = range{};
+  }
+}
+
+inline std::size_t deferred_growth::target_capacity(std::size_t size,
+                                                    std::size_t) {
+  return static_cast<std::size_t>(
+      std::ceil(size * fixed_growth::capacity_factor));
+}
+
+inline bool deferred_growth::compaction_due(std::size_t front,
+                                            std::size_t used,
+                                            std::size_t capacity) const {
+  return front > used / 2 || (capacity - used) * 4 < used - front;
+}
+
+inline growth_parameters deferred_growth::parameters() const {
+  return { fixed_growth::capacity_factor, 0.5 };
+}
+
+inline deferred_compaction& deferred_growth::pending() {
+  return pending_;
+}
+
+inline void adaptive_growth::observe(std::size_t size) {
+  if (++operations_ == half_window_) {
+    operations_ = 0;
+    pushes_[0] = pushes_[1];
+    pops_[0] = pops_[1];
+    peak_[0] = peak_[1];
+    pushes_[1] = pops_[1] = 0;
+    peak_[1] = size;
+  }
+  if (size > peak_[1]) {
+    peak_[1] = size;
+  }
+}
+
+inline void adaptive_growth::on_push(std::size_t size) {
+  ++pushes_[1];
+  observe(size);
+}
+
+inline void adaptive_growth::on_pop(std::size_t size) {
+  ++pops_[1];
+  observe(size);
+}
+
+inline std::size_t adaptive_growth::target_capacity(std::size_t size,
+                                                    std::size_t element_size) {
+  choose(element_size);
+  return static_cast<std::size_t>(std::ceil(size * chosen_.capacity_factor));
+}
+
+inline bool adaptive_growth::compact_on_pop(std::size_t front,
+                                            std::size_t used) const {
+  return front > used * chosen_.compaction_trigger;
+}
+
+inline growth_parameters adaptive_growth::parameters() const {
+  return chosen_;
+}
+
+inline void adaptive_growth::set_memory_cap(std::size_t bytes) {
+  memory_cap_ = bytes;
+}
+
+inline std::size_t adaptive_growth::memory_cap() const { return memory_cap_; }
+
+inline void adaptive_growth::set_window(std::size_t operations) {
+  half_window_ = operations / 2 > 0 ? operations / 2 : 1;
+  operations_ = 0;
+}
+
+inline void adaptive_growth::choose(std::size_t element_size) {
+  double pushes = static_cast<double>(pushes_[0] + pushes_[1]);
+  double pops = static_cast<double>(pops_[0] + pops_[1]);
+  double peak = static_cast<double>(peak_[0] > peak_[1] ? peak_[0] : peak_[1]);
+  if (pushes + pops == 0 || peak == 0) {
+    return;
+  }
+  double flow = (pushes < pops ? pushes : pops) / (pushes + pops);
+  double growth = (pushes - pops) / (pushes + pops);
+  double cap = memory_cap_ != 0 ? static_cast<double>(memory_cap_)
+                                : 2.0 * peak * element_size;
+
+  bool found = false;
+  growth_parameters best = chosen_;
+  double best_moved = 0;
+  double best_footprint = 0;
+  for (double f : factors) {
+    for (double t : triggers) {
+      double interval = t / (1 - t) < f - 1 ? t / (1 - t) : f - 1;
+      double moved = flow / interval;
+      if (growth > 0) {
+        moved += growth / (f - 1);
+      }
+      double footprint = (f > 1 / (1 - t) ? f : 1 / (1 - t)) * peak;
+      if (growth < 0) {
+        // Draining: whatever has been popped stays allocated until the
+        // next compaction, a higher trigger holds on to more of it.
+        footprint += -growth * t / (1 - t) * peak;
+      }
+      moved *= element_size;
+      footprint *= element_size;
+      bool fits = footprint <= cap;
+      bool better;
+      if (!found) {
+        better = true;
+      } else if (fits != (best_footprint <= cap)) {
+        better = fits;
+      } else if (fits) {
+        better = moved < best_moved ||
+                 (moved == best_moved && footprint < best_footprint);
+      } else {
+        better = footprint < best_footprint;
+      }
+      if (better) {
+        found = true;
+        best = { f, t };
+        best_moved = moved;
+        best_footprint = footprint;
+      }
+    }
+  }
+  chosen_ = best;
+}
+}
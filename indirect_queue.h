@@ -0,0 +1,501 @@
+/* A queue for elements too big, or too expensive to move, to shuffle
+ * around on every compaction. The elements live in a slab where they
+ * never move, and the queue proper is a flat_queue of their slot
+ * indices.
+ * 1. The slab allocates chunks of chunk_size slots as it needs them and
+ *    keeps freed slots on an intrusive free list, threaded through the
+ *    unused slots themselves, so a push after a pop reuses the freed
+ *    slot with no allocation. The slab only grows; its chunks are
+ *    released when the queue is destroyed.
+ * 2. Compactions of the index queue move 4 byte indices (or whatever
+ *    Index is) rather than whole elements, and an element's address
+ *    stays the same from push to pop.
+ * 3. The interface follows flat_queue where it can: push, emplace, pop,
+ *    pop_front, try_pop, pop_into, front, back, operator[], reserve,
+ *    shrink_to_fit, clear, swap and forward iterators, but there is no
+ *    data() since the elements are not contiguous. The Policy applies
+ *    to the index queue, so its stats, latencies, traces and growth
+ *    are those of the indices.
+ * 4. auto_queue<T> is indirect_queue<T> for elements bigger than
+ *    indirect_threshold bytes (four cache lines) and flat_queue<T>
+ *    otherwise.
+ */
+
+#pragma once
+
+#include "flat_queue.h"
+
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace dizzy {
+
+constexpr std::size_t indirect_threshold = 256;
+
+namespace detail {
+
+template <typename T, typename Index> class slab {
+public:
+  static constexpr std::size_t chunk_size = 64;
+  static constexpr Index npos = std::numeric_limits<Index>::max();
+
+  slab() = default;
+  slab(const slab&) = delete;
+  slab& operator=(const slab&) = delete;
+  slab(slab&& x) noexcept;
+
+  T& operator[](Index index);
+  const T& operator[](Index index) const;
+
+  template <class... Args> Index emplace(Args&&... args);
+  void erase(Index index);
+  std::size_t capacity() const;
+
+  void swap(slab& x) noexcept;
+
+private:
+  union slot {
+    slot() {}
+    ~slot() {}
+    Index next_free;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  std::vector<std::unique_ptr<slot[]>> chunks_;
+  Index free_ = npos;
+
+  slot& at(Index index);
+  const slot& at(Index index) const;
+};
+
+template <typename T, typename Index>
+slab<T, Index>::slab(slab&& x) noexcept
+    : chunks_{ std::move(x.chunks_) }, free_{ x.free_ } {
+  x.chunks_.clear();
+  x.free_ = npos;
+}
+
+template <typename T, typename Index>
+typename slab<T, Index>::slot& slab<T, Index>::at(Index index) {
+  return chunks_[index / chunk_size][index % chunk_size];
+}
+
+template <typename T, typename Index>
+const typename slab<T, Index>::slot& slab<T, Index>::at(Index index) const {
+  return chunks_[index / chunk_size][index % chunk_size];
+}
+
+template <typename T, typename Index>
+T& slab<T, Index>::operator[](Index index) {
+  return *std::launder(reinterpret_cast<T*>(at(index).storage));
+}
+
+template <typename T, typename Index>
+const T& slab<T, Index>::operator[](Index index) const {
+  return *std::launder(reinterpret_cast<const T*>(at(index).storage));
+}
+
+template <typename T, typename Index>
+template <class... Args>
+Index slab<T, Index>::emplace(Args&&... args) {
+  if (free_ == npos) {
+    std::size_t first = chunks_.size() * chunk_size;
+    if (first + chunk_size > npos) {
+      throw std::length_error("indirect_queue slab index overflow");
+    }
+    chunks_.emplace_back(new slot[chunk_size]);
+    slot* chunk = chunks_.back().get();
+    for (std::size_t i = 0; i < chunk_size; ++i) {
+      chunk[i].next_free =
+          i + 1 < chunk_size ? static_cast<Index>(first + i + 1) : npos;
+    }
+    free_ = static_cast<Index>(first);
+  }
+  Index index = free_;
+  slot& s = at(index);
+  Index next = s.next_free;
+  // A constructor that throws may have scribbled over next_free, which
+  // shares the slot's storage, so the free list link is put back.
+  try {
+    ::new (static_cast<void*>(s.storage)) T(std::forward<Args>(args)...);
+  } catch (...) {
+    s.next_free = next;
+    throw;
+  }
+  free_ = next;
+  return index;
+}
+
+template <typename T, typename Index> void slab<T, Index>::erase(Index index) {
+  (*this)[index].~T();
+  at(index).next_free = free_;
+  free_ = index;
+}
+
+template <typename T, typename Index>
+std::size_t slab<T, Index>::capacity() const {
+  return chunks_.size() * chunk_size;
+}
+
+template <typename T, typename Index>
+void slab<T, Index>::swap(slab& x) noexcept {
+  using std::swap;
+  swap(chunks_, x.chunks_);
+  swap(free_, x.free_);
+}
+}
+
+template <typename T, typename Policy = default_queue_policy,
+          typename Index = std::uint32_t>
+class indirect_queue {
+  static_assert(std::is_unsigned<Index>::value,
+                "indirect_queue needs an unsigned index type");
+
+  template <bool Const> class basic_iterator;
+
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using reference = T&;
+  using const_reference = const T&;
+  using index_queue = flat_queue<Index, Policy>;
+
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+
+  indirect_queue() = default;
+  indirect_queue(const indirect_queue& x);
+  indirect_queue(indirect_queue&& x) noexcept = default;
+  template <typename InputIt> indirect_queue(InputIt first, InputIt last);
+  indirect_queue(std::initializer_list<T> init);
+  ~indirect_queue();
+
+  indirect_queue& operator=(const indirect_queue& other);
+  indirect_queue& operator=(indirect_queue&& other) noexcept;
+
+  bool empty() const;
+  size_type size() const;
+  size_type slab_capacity() const;
+
+  reference front();
+  const_reference front() const;
+  reference back();
+  const_reference back() const;
+  reference operator[](size_type pos);
+  const_reference operator[](size_type pos) const;
+
+  void push(const value_type& val);
+  void push(value_type&& val);
+  template <class... Args> void emplace(Args&&... args);
+
+  void pop();
+  value_type pop_front();
+  std::optional<value_type> try_pop();
+  bool pop_into(value_type& out);
+
+  void shrink_to_fit();
+  void reserve(size_type new_size);
+  void clear();
+
+  index_queue& indices();
+  const index_queue& indices() const;
+
+  void swap(indirect_queue& x) noexcept;
+
+  iterator begin() noexcept;
+  const_iterator begin() const noexcept;
+  iterator end() noexcept;
+  const_iterator end() const noexcept;
+  const_iterator cbegin() const noexcept;
+  const_iterator cend() const noexcept;
+
+private:
+  index_queue indices_;
+  detail::slab<T, Index> slab_;
+};
+
+template <typename T, typename Policy, typename Index>
+template <bool Const>
+class indirect_queue<T, Policy, Index>::basic_iterator {
+  using owner = std::conditional_t<Const, const detail::slab<T, Index>,
+                                   detail::slab<T, Index>>;
+  using index_iterator = typename index_queue::const_iterator;
+
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = std::conditional_t<Const, const T*, T*>;
+  using reference = std::conditional_t<Const, const T&, T&>;
+
+  basic_iterator() = default;
+  basic_iterator(owner* slab, index_iterator position)
+      : slab_{ slab }, position_{ position } {}
+
+  reference operator*() const { return (*slab_)[*position_]; }
+  pointer operator->() const { return &(*slab_)[*position_]; }
+  basic_iterator& operator++() {
+    ++position_;
+    return *this;
+  }
+  basic_iterator operator++(int) {
+    basic_iterator old = *this;
+    ++position_;
+    return old;
+  }
+  bool operator==(const basic_iterator& x) const {
+    return position_ == x.position_;
+  }
+  bool operator!=(const basic_iterator& x) const {
+    return position_ != x.position_;
+  }
+
+private:
+  owner* slab_ = nullptr;
+  index_iterator position_ = nullptr;
+};
+
+template <typename T, typename Policy, typename Index>
+indirect_queue<T, Policy, Index>::indirect_queue(const indirect_queue& x)
+    : indirect_queue(x.begin(), x.end()) {}
+
+template <typename T, typename Policy, typename Index>
+template <typename InputIt>
+indirect_queue<T, Policy, Index>::indirect_queue(InputIt first,
+                                                 InputIt last) {
+  for (; first != last; ++first) {
+    emplace(*first);
+  }
+}
+
+template <typename T, typename Policy, typename Index>
+indirect_queue<T, Policy, Index>::indirect_queue(
+    std::initializer_list<T> init)
+    : indirect_queue(init.begin(), init.end()) {}
+
+template <typename T, typename Policy, typename Index>
+indirect_queue<T, Policy, Index>::~indirect_queue() {
+  clear();
+}
+
+template <typename T, typename Policy, typename Index>
+indirect_queue<T, Policy, Index>& indirect_queue<T, Policy, Index>::
+operator=(const indirect_queue& other) {
+  indirect_queue temp(other);
+  swap(temp);
+  return *this;
+}
+
+template <typename T, typename Policy, typename Index>
+indirect_queue<T, Policy, Index>& indirect_queue<T, Policy, Index>::
+operator=(indirect_queue&& other) noexcept {
+  indirect_queue temp(std::move(other));
+  swap(temp);
+  return *this;
+}
+
+template <typename T, typename Policy, typename Index>
+bool indirect_queue<T, Policy, Index>::empty() const {
+  return indices_.empty();
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::size_type
+indirect_queue<T, Policy, Index>::size() const {
+  return indices_.size();
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::size_type
+indirect_queue<T, Policy, Index>::slab_capacity() const {
+  return slab_.capacity();
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::reference
+indirect_queue<T, Policy, Index>::front() {
+  return slab_[indices_.front()];
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_reference
+indirect_queue<T, Policy, Index>::front() const {
+  return slab_[indices_.front()];
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::reference
+indirect_queue<T, Policy, Index>::back() {
+  return slab_[indices_.back()];
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_reference
+indirect_queue<T, Policy, Index>::back() const {
+  return slab_[indices_.back()];
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::reference
+indirect_queue<T, Policy, Index>::operator[](size_type pos) {
+  return slab_[indices_[pos]];
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_reference
+indirect_queue<T, Policy, Index>::operator[](size_type pos) const {
+  return slab_[indices_[pos]];
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::push(const T& val) {
+  emplace(val);
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::push(T&& val) {
+  emplace(std::move(val));
+}
+
+template <typename T, typename Policy, typename Index>
+template <class... Args>
+void indirect_queue<T, Policy, Index>::emplace(Args&&... args) {
+  Index index = slab_.emplace(std::forward<Args>(args)...);
+  try {
+    indices_.push(index);
+  } catch (...) {
+    slab_.erase(index);
+    throw;
+  }
+}
+
+// The index comes off the queue before its slot is freed, and the index
+// queue compacts last, so a compaction that throws leaves neither an
+// index to a freed slot nor a slot that nothing points to.
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::pop() {
+  batch_guard<Index, Policy> batch(indices_);
+  Index index = indices_.front();
+  batch.pop();
+  slab_.erase(index);
+  batch.finish();
+}
+
+template <typename T, typename Policy, typename Index>
+T indirect_queue<T, Policy, Index>::pop_front() {
+  T val(std::move(front()));
+  pop();
+  return val;
+}
+
+template <typename T, typename Policy, typename Index>
+std::optional<T> indirect_queue<T, Policy, Index>::try_pop() {
+  std::optional<T> val;
+  if (!empty()) {
+    val.emplace(std::move(front()));
+    pop();
+  }
+  return val;
+}
+
+template <typename T, typename Policy, typename Index>
+bool indirect_queue<T, Policy, Index>::pop_into(T& out) {
+  if (empty()) {
+    return false;
+  }
+  out = std::move(front());
+  pop();
+  return true;
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::shrink_to_fit() {
+  indices_.shrink_to_fit();
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::reserve(size_type new_size) {
+  indices_.reserve(new_size);
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::clear() {
+  for (Index index : indices_) {
+    slab_.erase(index);
+  }
+  indices_.clear();
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::index_queue&
+indirect_queue<T, Policy, Index>::indices() {
+  return indices_;
+}
+
+template <typename T, typename Policy, typename Index>
+const typename indirect_queue<T, Policy, Index>::index_queue&
+indirect_queue<T, Policy, Index>::indices() const {
+  return indices_;
+}
+
+template <typename T, typename Policy, typename Index>
+void indirect_queue<T, Policy, Index>::swap(indirect_queue& x) noexcept {
+  indices_.swap(x.indices_);
+  slab_.swap(x.slab_);
+}
+
+template <typename T, typename Policy, typename Index>
+void swap(indirect_queue<T, Policy, Index>& x,
+          indirect_queue<T, Policy, Index>& y) noexcept {
+  x.swap(y);
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::iterator
+indirect_queue<T, Policy, Index>::begin() noexcept {
+  return iterator(&slab_, indices_.cbegin());
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_iterator
+indirect_queue<T, Policy, Index>::begin() const noexcept {
+  return const_iterator(&slab_, indices_.cbegin());
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::iterator
+indirect_queue<T, Policy, Index>::end() noexcept {
+  return iterator(&slab_, indices_.cend());
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_iterator
+indirect_queue<T, Policy, Index>::end() const noexcept {
+  return const_iterator(&slab_, indices_.cend());
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_iterator
+indirect_queue<T, Policy, Index>::cbegin() const noexcept {
+  return begin();
+}
+
+template <typename T, typename Policy, typename Index>
+typename indirect_queue<T, Policy, Index>::const_iterator
+indirect_queue<T, Policy, Index>::cend() const noexcept {
+  return end();
+}
+
+template <typename T, typename Policy = default_queue_policy>
+using auto_queue =
+    std::conditional_t<(sizeof(T) > indirect_threshold),
+                       indirect_queue<T, Policy>, flat_queue<T, Policy>>;
+}
@@ -0,0 +1,267 @@
+/* Opt-in latency instrumentation for flat_queue (see latency_queue_policy
+ * in flat_queue.h).
+ * 1. latency_histogram is a lock-free log-linear histogram in the style
+ *    of HdrHistogram: values below 32 get a bucket each, and every power
+ *    of two above that is split into 32 linear buckets, so any recorded
+ *    value is reported to within about 3%. Recording is a couple of
+ *    shifts and a relaxed fetch_add, and any number of threads may
+ *    record into one histogram at once. percentile(p) and max() read it
+ *    back.
+ * 2. Values are raw clock ticks. tsc_clock reads the time stamp counter
+ *    (x86 with a GCC-compatible compiler only) and converts to
+ *    nanoseconds with a ratio calibrated once, on first use, against
+ *    steady_clock; monotonic_clock uses clock_gettime and is already in
+ *    nanoseconds. default_latency_clock is the former where it exists.
+ * 3. basic_queue_latency<Clock> holds one histogram each for push, pop
+ *    and compaction, and can write a summary (count, p50, p99, p99.9
+ *    and max in nanoseconds) as text or as JSON. queue_latency::global()
+ *    is where queues record unless pointed somewhere else.
+ * 4. latency_timer<Clock> is the hook a flat_queue policy plugs in as
+ *    its timer_type; no_timer is the default and compiles to nothing.
+ */
+
+#pragma once
+
+#include "bits.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIZZY_HAVE_TSC 1
+#include <x86intrin.h>
+#endif
+
+namespace dizzy {
+
+enum class latency_op { push, pop, compaction };
+
+class latency_histogram {
+public:
+  static constexpr unsigned sub_bucket_bits = 5;
+  static constexpr std::size_t sub_buckets = std::size_t{ 1 }
+                                             << sub_bucket_bits;
+  static constexpr std::size_t num_buckets =
+      (64 - sub_bucket_bits + 1) * sub_buckets;
+
+  void record(std::uint64_t value);
+  void reset();
+
+  std::uint64_t count() const;
+  std::uint64_t max() const;
+  std::uint64_t percentile(double p) const;
+
+private:
+  std::array<std::atomic<std::uint64_t>, num_buckets> buckets_{};
+  std::atomic<std::uint64_t> count_{ 0 };
+  std::atomic<std::uint64_t> max_{ 0 };
+
+  static std::size_t bucket_for(std::uint64_t value);
+  static std::uint64_t highest_in(std::size_t bucket);
+};
+
+inline std::size_t latency_histogram::bucket_for(std::uint64_t value) {
+  if (value < sub_buckets) {
+    return static_cast<std::size_t>(value);
+  }
+  std::size_t shift = detail::bit_width(value) - 1 - sub_bucket_bits;
+  return (shift + 1) * sub_buckets +
+         static_cast<std::size_t>(value >> shift) - sub_buckets;
+}
+
+inline std::uint64_t latency_histogram::highest_in(std::size_t bucket) {
+  if (bucket < sub_buckets) {
+    return bucket;
+  }
+  std::size_t shift = bucket / sub_buckets - 1;
+  std::uint64_t lowest = static_cast<std::uint64_t>(sub_buckets +
+                                                    bucket % sub_buckets)
+                         << shift;
+  return lowest + ((std::uint64_t{ 1 } << shift) - 1);
+}
+
+inline void latency_histogram::record(std::uint64_t value) {
+  buckets_[bucket_for(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  std::uint64_t seen = max_.load(std::memory_order_relaxed);
+  while (value > seen &&
+         !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+  }
+}
+
+inline void latency_histogram::reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+inline std::uint64_t latency_histogram::count() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+inline std::uint64_t latency_histogram::max() const {
+  return max_.load(std::memory_order_relaxed);
+}
+
+// The highest value equivalent to the one at percentile p (0 to 100),
+// never more than the largest value recorded.
+inline std::uint64_t latency_histogram::percentile(double p) const {
+  std::uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+  std::uint64_t target = static_cast<std::uint64_t>(p / 100.0 * total + 0.5);
+  if (target == 0) {
+    target = 1;
+  }
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < num_buckets; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      std::uint64_t highest = highest_in(i);
+      return highest < max() ? highest : max();
+    }
+  }
+  return max();
+}
+
+struct monotonic_clock {
+  static std::uint64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000u +
+           static_cast<std::uint64_t>(ts.tv_nsec);
+  }
+  static double ns_per_tick() { return 1.0; }
+};
+
+#if defined(DIZZY_HAVE_TSC)
+struct tsc_clock {
+  static std::uint64_t now() { return __rdtsc(); }
+  static double ns_per_tick() {
+    static const double ratio = [] {
+      auto start = std::chrono::steady_clock::now();
+      std::uint64_t first = __rdtsc();
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      std::uint64_t last = __rdtsc();
+      auto elapsed = std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - start);
+      return elapsed.count() / static_cast<double>(last - first);
+    }();
+    return ratio;
+  }
+};
+
+using default_latency_clock = tsc_clock;
+#else
+using default_latency_clock = monotonic_clock;
+#endif
+
+template <typename Clock> class basic_queue_latency {
+public:
+  latency_histogram push;
+  latency_histogram pop;
+  latency_histogram compaction;
+
+  static basic_queue_latency& global();
+
+  latency_histogram& histogram(latency_op op);
+  void reset();
+
+  void write_text(std::ostream& out) const;
+  void write_json(std::ostream& out) const;
+};
+
+using queue_latency = basic_queue_latency<default_latency_clock>;
+
+template <typename Clock>
+basic_queue_latency<Clock>& basic_queue_latency<Clock>::global() {
+  static basic_queue_latency instance;
+  return instance;
+}
+
+template <typename Clock>
+latency_histogram& basic_queue_latency<Clock>::histogram(latency_op op) {
+  switch (op) {
+  case latency_op::push:
+    return push;
+  case latency_op::pop:
+    return pop;
+  case latency_op::compaction:
+    break;
+  }
+  return compaction;
+}
+
+template <typename Clock> void basic_queue_latency<Clock>::reset() {
+  push.reset();
+  pop.reset();
+  compaction.reset();
+}
+
+template <typename Clock>
+void basic_queue_latency<Clock>::write_text(std::ostream& out) const {
+  const double scale = Clock::ns_per_tick();
+  auto row = [&](const char* name, const latency_histogram& h) {
+    out << name << ": count=" << h.count()
+        << " p50=" << h.percentile(50.0) * scale
+        << "ns p99=" << h.percentile(99.0) * scale
+        << "ns p99.9=" << h.percentile(99.9) * scale
+        << "ns max=" << h.max() * scale << "ns\n";
+  };
+  row("push", push);
+  row("pop", pop);
+  row("compaction", compaction);
+}
+
+template <typename Clock>
+void basic_queue_latency<Clock>::write_json(std::ostream& out) const {
+  const double scale = Clock::ns_per_tick();
+  auto object = [&](const char* name, const latency_histogram& h) {
+    out << '"' << name << "\":{\"count\":" << h.count()
+        << ",\"p50_ns\":" << h.percentile(50.0) * scale
+        << ",\"p99_ns\":" << h.percentile(99.0) * scale
+        << ",\"p999_ns\":" << h.percentile(99.9) * scale
+        << ",\"max_ns\":" << h.max() * scale << '}';
+  };
+  out << '{';
+  object("push", push);
+  out << ',';
+  object("pop", pop);
+  out << ',';
+  object("compaction", compaction);
+  out << "}\n";
+}
+
+struct no_timer {
+  using token = int;
+  token start() { return 0; }
+  void stop(latency_op, token) {}
+};
+
+template <typename Clock = default_latency_clock> class latency_timer {
+public:
+  using token = std::uint64_t;
+  using sink_type = basic_queue_latency<Clock>;
+
+  token start() { return Clock::now(); }
+  void stop(latency_op op, token started) {
+    sink_->histogram(op).record(Clock::now() - started);
+  }
+
+  sink_type& sink() const { return *sink_; }
+  void set_sink(sink_type& sink) { sink_ = &sink; }
+
+private:
+  sink_type* sink_ = &sink_type::global();
+};
+}
@@ -0,0 +1,179 @@
+/* Runs flat_queue::maintenance() off the request path, for queues whose
+ * policy defers compaction (see deferred_queue_policy in flat_queue.h).
+ * 1. A maintenance_scheduler keeps a list of queues added with add(q)
+ *    and taken off with remove(q). run(budget) gives each of them one
+ *    maintenance(budget) call and returns true if none has any work
+ *    left; run_until(deadline, budget) keeps going round until then or
+ *    until there is nothing left to do, for an event loop to call in
+ *    its idle time.
+ * 2. start(interval, budget) does the same from a background thread,
+ *    waking every interval until stop() or destruction. A queue is not
+ *    thread safe, so a queue maintained that way has to be added with
+ *    the mutex its owner holds while using it, add(q, mutex). The
+ *    background thread only ever try_locks it, skipping the queue when
+ *    its owner is busy, and holds it for one budgeted call, so the owner
+ *    waits at most that long. Queues added without a mutex are left to
+ *    run() and run_until() on the owner's thread, which lock the mutex
+ *    of those that have one, so are not to be called holding one.
+ * 3. The switch to a compacted buffer is part of the one maintenance()
+ *    call that finishes the copy, under the queue's mutex, so the owner
+ *    sees either the old buffer or the new one.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dizzy {
+
+class maintenance_scheduler {
+public:
+  using size_type = std::size_t;
+  using clock = std::chrono::steady_clock;
+
+  static constexpr size_type default_budget = 1024;
+
+  maintenance_scheduler() = default;
+  maintenance_scheduler(const maintenance_scheduler&) = delete;
+  ~maintenance_scheduler();
+
+  maintenance_scheduler& operator=(const maintenance_scheduler&) = delete;
+
+  template <typename Queue> void add(Queue& queue);
+  template <typename Queue> void add(Queue& queue, std::mutex& lock);
+  void remove(const void* queue);
+  size_type size() const;
+
+  bool run(size_type budget = default_budget);
+  bool run_until(clock::time_point deadline,
+                 size_type budget = default_budget);
+
+  void start(clock::duration interval, size_type budget = default_budget);
+  void stop();
+
+private:
+  struct entry {
+    const void* queue;
+    std::function<bool(size_type)> maintain;
+    std::mutex* lock;
+  };
+
+  mutable std::mutex mutex_;
+  std::vector<entry> entries_;
+  std::thread worker_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+
+  bool run_pass(size_type budget, bool background);
+};
+
+inline maintenance_scheduler::~maintenance_scheduler() {
+  stop();
+}
+
+template <typename Queue> void maintenance_scheduler::add(Queue& queue) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.push_back({ &queue,
+                       [&queue](size_type budget) {
+                         return queue.maintenance(budget);
+                       },
+                       nullptr });
+}
+
+template <typename Queue>
+void maintenance_scheduler::add(Queue& queue, std::mutex& lock) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.push_back({ &queue,
+                       [&queue](size_type budget) {
+                         return queue.maintenance(budget);
+                       },
+                       &lock });
+}
+
+inline void maintenance_scheduler::remove(const void* queue) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->queue == queue) {
+      entries_.erase(it);
+      return;
+    }
+  }
+}
+
+inline maintenance_scheduler::size_type maintenance_scheduler::size() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return entries_.size();
+}
+
+// One maintenance call for every queue; the background thread skips
+// queues without a mutex and queues whose owner holds theirs.
+inline bool maintenance_scheduler::run_pass(size_type budget,
+                                            bool background) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  bool idle = true;
+  for (entry& e : entries_) {
+    if (!e.lock) {
+      if (!background) {
+        idle = e.maintain(budget) && idle;
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> queue_lock(*e.lock, std::defer_lock);
+    if (!background) {
+      queue_lock.lock();
+    } else if (!queue_lock.try_lock()) {
+      idle = false;
+      continue;
+    }
+    idle = e.maintain(budget) && idle;
+  }
+  return idle;
+}
+
+inline bool maintenance_scheduler::run(size_type budget) {
+  return run_pass(budget, false);
+}
+
+inline bool maintenance_scheduler::run_until(clock::time_point deadline,
+                                             size_type budget) {
+  while (clock::now() < deadline) {
+    if (run_pass(budget, false)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void maintenance_scheduler::start(clock::duration interval,
+                                         size_type budget) {
+  stop();
+  stopping_ = false;
+  worker_ = std::thread([this, interval, budget] {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      lock.unlock();
+      run_pass(budget, true);
+      lock.lock();
+      wake_.wait_for(lock, interval, [this] { return stopping_; });
+    }
+  });
+}
+
+inline void maintenance_scheduler::stop() {
+  if (!worker_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  worker_.join();
+}
+}
@@ -0,0 +1,40 @@
+/* USDT (statically defined tracing) probes for the flat_queue hot paths.
+ * 1. When <sys/sdt.h> is available (systemtap-sdt-dev on Debian,
+ *    systemtap-sdt-devel on Fedora) each DIZZY_PROBE becomes a single
+ *    nop plus a note in the binary describing where its arguments live.
+ *    Nothing happens at runtime until a tracer attaches, e.g.
+ *      bpftrace -e 'usdt:./app:dizzy:compaction_end { @[arg3] = count(); }'
+ *      perf probe -x ./app sdt_dizzy:push
+ *    Without the header, or with DIZZY_NO_USDT defined, the macros
+ *    expand to nothing.
+ * 2. The probes, all under the provider "dizzy", with the queue's
+ *    address as the first argument:
+ *    - push(queue, size, capacity)
+ *    - pop(queue, size, capacity)
+ *    - compaction_start(queue, reason, size, old_capacity)
+ *    - compaction_end(queue, reason, size, old_capacity, new_capacity)
+ *    - reserve(queue, requested, size, capacity)
+ *    - commit(queue, count, size), for prepare()/commit() batches
+ *    reason is the compaction_reason as an int: 0 growth, 1 pop,
+ *    2 requested.
+ */
+
+#pragma once
+
+#if !defined(DIZZY_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define DIZZY_HAVE_USDT 1
+#include <sys/sdt.h>
+#endif
+#endif
+
+#if defined(DIZZY_HAVE_USDT)
+#define DIZZY_PROBE3(name, a, b, c) DTRACE_PROBE3(dizzy, name, a, b, c)
+#define DIZZY_PROBE4(name, a, b, c, d) DTRACE_PROBE4(dizzy, name, a, b, c, d)
+#define DIZZY_PROBE5(name, a, b, c, d, e)                                      \
+  DTRACE_PROBE5(dizzy, name, a, b, c, d, e)
+#else
+#define DIZZY_PROBE3(name, a, b, c)
+#define DIZZY_PROBE4(name, a, b, c, d)
+#define DIZZY_PROBE5(name, a, b, c, d, e)
+#endif
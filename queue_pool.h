@@ -0,0 +1,493 @@
+/* A pool of many small FIFO queues sharing one arena, for when there are
+ * millions of queues holding a handful of elements each and a
+ * flat_queue apiece (32 bytes plus a heap allocation) is too much.
+ * 1. The pool allocates chunks of ChunkSize element slots (4 by
+ *    default) in blocks of chunks_per_block, and each queue is a linked
+ *    list of chunks: it starts at the head chunk, every chunk but the
+ *    last is full, and the last one is filled up to (head_pos + size) %
+ *    ChunkSize. A queue's state in the pool is 16 bytes and an empty
+ *    queue holds no chunk at all. Freed chunks go on a free list shared
+ *    by every queue in the pool.
+ * 2. create() returns a queue id, destroy(id) clears the queue and
+ *    recycles its id. Queues are used either through the pool, with the
+ *    id as the first argument (push(id, val), pop(id), front(id) and so
+ *    on), or through a handle, get(id), which is just the pool and the
+ *    id (16 bytes) with the same operations as members. Handles do not
+ *    own their queue. Pools move and swap but do not copy; a pool moved
+ *    from is empty.
+ * 3. compact() rebuilds the arena: the elements of every queue are
+ *    moved, in id order, into consecutive chunks of fresh blocks, with
+ *    each queue starting at the start of a chunk, and the old blocks are
+ *    released. This hands back the memory of a pool that has shrunk,
+ *    and puts every queue's elements next to each other again after
+ *    churn has scattered them.
+ * 4. References to elements stay valid until the element is popped or
+ *    compact() is called, which needs T to be nothrow move
+ *    constructible. Like flat_queue, the pool is not thread safe.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace dizzy {
+
+template <typename T, std::size_t ChunkSize = 4> class queue_pool {
+  static_assert(ChunkSize > 0, "queue_pool chunks need at least one slot");
+
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using reference = T&;
+  using const_reference = const T&;
+  using id_type = std::uint32_t;
+
+  static constexpr size_type chunk_size = ChunkSize;
+  static constexpr size_type chunks_per_block = 1024;
+
+  class handle;
+
+  queue_pool() = default;
+  queue_pool(const queue_pool&) = delete;
+  queue_pool(queue_pool&& other) noexcept;
+  ~queue_pool();
+
+  queue_pool& operator=(const queue_pool&) = delete;
+  queue_pool& operator=(queue_pool&& other) noexcept;
+
+  void swap(queue_pool& x) noexcept;
+
+  id_type create();
+  void destroy(id_type id);
+  handle get(id_type id);
+
+  size_type queues() const;
+  size_type chunks_in_use() const;
+  size_type chunk_capacity() const;
+  size_type memory_bytes() const;
+
+  bool empty(id_type id) const;
+  size_type size(id_type id) const;
+  reference front(id_type id);
+  const_reference front(id_type id) const;
+  reference back(id_type id);
+  const_reference back(id_type id) const;
+
+  void push(id_type id, const value_type& val);
+  void push(id_type id, value_type&& val);
+  template <class... Args> void emplace(id_type id, Args&&... args);
+  void pop(id_type id);
+  void clear(id_type id);
+  template <typename F> void for_each(id_type id, F f);
+
+  void compact();
+
+private:
+  static constexpr std::uint32_t npos =
+      std::numeric_limits<std::uint32_t>::max();
+
+  struct chunk {
+    std::uint32_t next;
+    alignas(T) unsigned char storage[ChunkSize * sizeof(T)];
+
+    T* slot(size_type pos);
+  };
+
+  // A free id has head_pos == npos, and head_chunk links to the next
+  // free id.
+  struct queue_state {
+    std::uint32_t head_chunk;
+    std::uint32_t tail_chunk;
+    std::uint32_t size;
+    std::uint32_t head_pos;
+  };
+
+  std::vector<std::unique_ptr<chunk[]>> blocks_;
+  std::vector<queue_state> states_;
+  std::uint32_t free_chunk_ = npos;
+  std::uint32_t free_id_ = npos;
+  size_type chunks_in_use_ = 0;
+  size_type live_queues_ = 0;
+
+  chunk& at(std::uint32_t index);
+  const chunk& at(std::uint32_t index) const;
+  std::uint32_t allocate_chunk();
+  void free_chunk(std::uint32_t index);
+  queue_state& state(id_type id);
+  const queue_state& state(id_type id) const;
+};
+
+template <typename T, std::size_t ChunkSize>
+class queue_pool<T, ChunkSize>::handle {
+public:
+  handle() = default;
+  handle(queue_pool* pool, id_type id) : pool_{ pool }, id_{ id } {}
+
+  id_type id() const { return id_; }
+  queue_pool& pool() const { return *pool_; }
+
+  bool empty() const { return pool_->empty(id_); }
+  size_type size() const { return pool_->size(id_); }
+  reference front() const { return pool_->front(id_); }
+  reference back() const { return pool_->back(id_); }
+
+  void push(const value_type& val) const { pool_->push(id_, val); }
+  void push(value_type&& val) const { pool_->push(id_, std::move(val)); }
+  template <class... Args> void emplace(Args&&... args) const {
+    pool_->emplace(id_, std::forward<Args>(args)...);
+  }
+  void pop() const { pool_->pop(id_); }
+  void clear() const { pool_->clear(id_); }
+
+private:
+  queue_pool* pool_ = nullptr;
+  id_type id_ = 0;
+};
+
+template <typename T, std::size_t ChunkSize>
+T* queue_pool<T, ChunkSize>::chunk::slot(size_type pos) {
+  return std::launder(reinterpret_cast<T*>(storage) + pos);
+}
+
+// The free lists index into blocks_ and states_, so the source's heads
+// go back to npos along with its now empty vectors.
+template <typename T, std::size_t ChunkSize>
+queue_pool<T, ChunkSize>::queue_pool(queue_pool&& other) noexcept
+    : blocks_{ std::move(other.blocks_) },
+      states_{ std::move(other.states_) },
+      free_chunk_{ std::exchange(other.free_chunk_, npos) },
+      free_id_{ std::exchange(other.free_id_, npos) },
+      chunks_in_use_{ std::exchange(other.chunks_in_use_, 0) },
+      live_queues_{ std::exchange(other.live_queues_, 0) } {
+  other.blocks_.clear();
+  other.states_.clear();
+}
+
+template <typename T, std::size_t ChunkSize>
+queue_pool<T, ChunkSize>::~queue_pool() {
+  for (id_type id = 0; id < states_.size(); ++id) {
+    if (states_[id].head_pos != npos) {
+      clear(id);
+    }
+  }
+}
+
+template <typename T, std::size_t ChunkSize>
+queue_pool<T, ChunkSize>&
+queue_pool<T, ChunkSize>::operator=(queue_pool&& other) noexcept {
+  queue_pool temp(std::move(other));
+  swap(temp);
+  return *this;
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::swap(queue_pool& x) noexcept {
+  using std::swap;
+  swap(blocks_, x.blocks_);
+  swap(states_, x.states_);
+  swap(free_chunk_, x.free_chunk_);
+  swap(free_id_, x.free_id_);
+  swap(chunks_in_use_, x.chunks_in_use_);
+  swap(live_queues_, x.live_queues_);
+}
+
+template <typename T, std::size_t ChunkSize>
+void swap(queue_pool<T, ChunkSize>& x, queue_pool<T, ChunkSize>& y) noexcept {
+  x.swap(y);
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::chunk&
+queue_pool<T, ChunkSize>::at(std::uint32_t index) {
+  return blocks_[index / chunks_per_block][index % chunks_per_block];
+}
+
+template <typename T, std::size_t ChunkSize>
+const typename queue_pool<T, ChunkSize>::chunk&
+queue_pool<T, ChunkSize>::at(std::uint32_t index) const {
+  return blocks_[index / chunks_per_block][index % chunks_per_block];
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::queue_state&
+queue_pool<T, ChunkSize>::state(id_type id) {
+  return states_[id];
+}
+
+template <typename T, std::size_t ChunkSize>
+const typename queue_pool<T, ChunkSize>::queue_state&
+queue_pool<T, ChunkSize>::state(id_type id) const {
+  return states_[id];
+}
+
+template <typename T, std::size_t ChunkSize>
+std::uint32_t queue_pool<T, ChunkSize>::allocate_chunk() {
+  if (free_chunk_ == npos) {
+    size_type first = blocks_.size() * chunks_per_block;
+    if (first + chunks_per_block >= npos) {
+      throw std::length_error("queue_pool chunk index overflow");
+    }
+    blocks_.emplace_back(new chunk[chunks_per_block]);
+    chunk* block = blocks_.back().get();
+    for (size_type i = 0; i < chunks_per_block; ++i) {
+      block[i].next = i + 1 < chunks_per_block
+                          ? static_cast<std::uint32_t>(first + i + 1)
+                          : npos;
+    }
+    free_chunk_ = static_cast<std::uint32_t>(first);
+  }
+  std::uint32_t index = free_chunk_;
+  free_chunk_ = at(index).next;
+  at(index).next = npos;
+  ++chunks_in_use_;
+  return index;
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::free_chunk(std::uint32_t index) {
+  at(index).next = free_chunk_;
+  free_chunk_ = index;
+  --chunks_in_use_;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::id_type queue_pool<T, ChunkSize>::create() {
+  id_type id;
+  if (free_id_ != npos) {
+    id = free_id_;
+    free_id_ = states_[id].head_chunk;
+  } else {
+    if (states_.size() >= npos) {
+      throw std::length_error("queue_pool id overflow");
+    }
+    id = static_cast<id_type>(states_.size());
+    states_.emplace_back();
+  }
+  states_[id] = { npos, npos, 0, 0 };
+  ++live_queues_;
+  return id;
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::destroy(id_type id) {
+  clear(id);
+  states_[id] = { free_id_, npos, 0, npos };
+  free_id_ = id;
+  --live_queues_;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::handle
+queue_pool<T, ChunkSize>::get(id_type id) {
+  return handle(this, id);
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::size_type
+queue_pool<T, ChunkSize>::queues() const {
+  return live_queues_;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::size_type
+queue_pool<T, ChunkSize>::chunks_in_use() const {
+  return chunks_in_use_;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::size_type
+queue_pool<T, ChunkSize>::chunk_capacity() const {
+  return blocks_.size() * chunks_per_block;
+}
+
+// The arena plus the per-queue state, not counting the pool object.
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::size_type
+queue_pool<T, ChunkSize>::memory_bytes() const {
+  return chunk_capacity() * sizeof(chunk) +
+         states_.capacity() * sizeof(queue_state) +
+         blocks_.capacity() * sizeof(blocks_[0]);
+}
+
+template <typename T, std::size_t ChunkSize>
+bool queue_pool<T, ChunkSize>::empty(id_type id) const {
+  return state(id).size == 0;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::size_type
+queue_pool<T, ChunkSize>::size(id_type id) const {
+  return state(id).size;
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::reference
+queue_pool<T, ChunkSize>::front(id_type id) {
+  const queue_state& s = state(id);
+  return *at(s.head_chunk).slot(s.head_pos);
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::const_reference
+queue_pool<T, ChunkSize>::front(id_type id) const {
+  return const_cast<queue_pool*>(this)->front(id);
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::reference
+queue_pool<T, ChunkSize>::back(id_type id) {
+  const queue_state& s = state(id);
+  return *at(s.tail_chunk).slot((s.head_pos + s.size - 1) % ChunkSize);
+}
+
+template <typename T, std::size_t ChunkSize>
+typename queue_pool<T, ChunkSize>::const_reference
+queue_pool<T, ChunkSize>::back(id_type id) const {
+  return const_cast<queue_pool*>(this)->back(id);
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::push(id_type id, const T& val) {
+  emplace(id, val);
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::push(id_type id, T&& val) {
+  emplace(id, std::move(val));
+}
+
+template <typename T, std::size_t ChunkSize>
+template <class... Args>
+void queue_pool<T, ChunkSize>::emplace(id_type id, Args&&... args) {
+  queue_state& s = state(id);
+  size_type pos = (s.head_pos + s.size) % ChunkSize;
+  bool added = s.size == 0 || pos == 0;
+  std::uint32_t target = added ? allocate_chunk() : s.tail_chunk;
+  try {
+    ::new (static_cast<void*>(at(target).slot(pos)))
+        T(std::forward<Args>(args)...);
+  } catch (...) {
+    if (added) {
+      free_chunk(target);
+    }
+    throw;
+  }
+  if (added) {
+    if (s.size == 0) {
+      s.head_chunk = target;
+    } else {
+      at(s.tail_chunk).next = target;
+    }
+    s.tail_chunk = target;
+  }
+  ++s.size;
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::pop(id_type id) {
+  queue_state& s = state(id);
+  chunk& head = at(s.head_chunk);
+  head.slot(s.head_pos)->~T();
+  --s.size;
+  ++s.head_pos;
+  if (s.size == 0) {
+    free_chunk(s.head_chunk);
+    s.head_chunk = s.tail_chunk = npos;
+    s.head_pos = 0;
+  } else if (s.head_pos == ChunkSize) {
+    std::uint32_t next = head.next;
+    free_chunk(s.head_chunk);
+    s.head_chunk = next;
+    s.head_pos = 0;
+  }
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::clear(id_type id) {
+  while (state(id).size != 0) {
+    pop(id);
+  }
+}
+
+template <typename T, std::size_t ChunkSize>
+template <typename F>
+void queue_pool<T, ChunkSize>::for_each(id_type id, F f) {
+  const queue_state& s = state(id);
+  std::uint32_t c = s.head_chunk;
+  size_type pos = s.head_pos;
+  for (size_type i = 0; i < s.size; ++i) {
+    if (pos == ChunkSize) {
+      c = at(c).next;
+      pos = 0;
+    }
+    f(*at(c).slot(pos++));
+  }
+}
+
+template <typename T, std::size_t ChunkSize>
+void queue_pool<T, ChunkSize>::compact() {
+  static_assert(std::is_nothrow_move_constructible<T>::value,
+                "queue_pool::compact moves elements and cannot undo a "
+                "throwing move");
+  size_type needed = 0;
+  for (const queue_state& s : states_) {
+    if (s.head_pos != npos) {
+      needed += (s.size + ChunkSize - 1) / ChunkSize;
+    }
+  }
+  size_type block_count = (needed + chunks_per_block - 1) / chunks_per_block;
+  std::vector<std::unique_ptr<chunk[]>> blocks;
+  blocks.reserve(block_count);
+  for (size_type i = 0; i < block_count; ++i) {
+    blocks.emplace_back(new chunk[chunks_per_block]);
+  }
+  auto fresh = [&](size_type index) -> chunk& {
+    return blocks[index / chunks_per_block][index % chunks_per_block];
+  };
+
+  std::uint32_t next_chunk = 0;
+  for (queue_state& s : states_) {
+    if (s.head_pos == npos || s.size == 0) {
+      continue;
+    }
+    std::uint32_t first = next_chunk;
+    std::uint32_t c = s.head_chunk;
+    size_type pos = s.head_pos;
+    for (size_type i = 0; i < s.size; ++i) {
+      if (pos == ChunkSize) {
+        c = at(c).next;
+        pos = 0;
+      }
+      if (i % ChunkSize == 0) {
+        if (i != 0) {
+          fresh(next_chunk - 1).next = next_chunk;
+        }
+        fresh(next_chunk).next = npos;
+        ++next_chunk;
+      }
+      T* from = at(c).slot(pos++);
+      ::new (static_cast<void*>(
+          fresh(next_chunk - 1).slot(i % ChunkSize))) T(std::move(*from));
+      from->~T();
+    }
+    s.head_chunk = first;
+    s.tail_chunk = next_chunk - 1;
+    s.head_pos = 0;
+  }
+
+  free_chunk_ = npos;
+  for (size_type i = block_count * chunks_per_block; i-- > next_chunk;) {
+    fresh(i).next = free_chunk_;
+    free_chunk_ = static_cast<std::uint32_t>(i);
+  }
+  blocks_.swap(blocks);
+  chunks_in_use_ = next_chunk;
+}
+}
@@ -0,0 +1,258 @@
+/* Copy-on-write buffers for flat_queue, switched on through its Policy
+ * (see cow_queue_policy in flat_queue.h), so that copies and read-only
+ * snapshots of a queue cost a reference count rather than a copy of
+ * its elements.
+ * 1. shared_memory is a memory_type whose buffers carry an atomic
+ *    reference count in a small header in front of them. deallocate()
+ *    drops a reference and frees the buffer with the last one, share()
+ *    adds one and shared() says whether anyone else holds one.
+ * 2. Under it, copying a flat_queue shares its buffer, and
+ *    queue.snapshot() returns a queue_snapshot: a read-only view of the
+ *    elements in the queue at the time, with size(), operator[],
+ *    front(), back(), data() and iterators, holding its own reference.
+ *    Both are O(1).
+ * 3. A queue whose buffer is shared copies its elements into a buffer
+ *    of its own before it writes to one: on push, emplace, prepare and
+ *    assign, before an in-place compaction, and when any non-const
+ *    accessor (front, back, operator[], data, begin, end, find) hands
+ *    out a way to write. Pops only move the queue's own head, and
+ *    compactions move to a new buffer anyway, so neither copies. A
+ *    queue nobody shares with pays an atomic load on those calls.
+ * 4. Sharing is only for trivially copyable element types, for which
+ *    destroying an element is a no-op and a move is a copy, so a pop or
+ *    compaction on one side can never be seen from the other.
+ * 5. The reference count is atomic, so a snapshot can be handed to
+ *    another thread, read there and dropped there while the queue
+ *    carries on in its own. The queue and each snapshot are each still
+ *    for one thread at a time.
+ */
+
+#pragma once
+
+#include "buffer_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dizzy {
+
+struct shared_memory {
+  static void* allocate(std::size_t bytes, std::size_t alignment);
+  static void deallocate(void* block, std::size_t bytes,
+                         std::size_t alignment) noexcept;
+  static void share(void* block, std::size_t alignment) noexcept;
+  static bool shared(const void* block, std::size_t alignment) noexcept;
+
+private:
+  using counter = std::atomic<std::size_t>;
+
+  static std::size_t block_alignment(std::size_t alignment);
+  static std::size_t header_size(std::size_t alignment);
+  static counter& count(const void* block, std::size_t alignment);
+};
+
+namespace detail {
+template <typename Memory, typename = void>
+struct shares_buffers : std::false_type {};
+
+template <typename Memory>
+struct shares_buffers<Memory, std::void_t<decltype(Memory::share(
+                                  std::declval<void*>(), std::size_t{}))>>
+    : std::true_type {};
+}
+
+template <typename T> class queue_snapshot {
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using const_reference = const T&;
+  using const_pointer = const T*;
+  using const_iterator = const T*;
+
+  queue_snapshot() = default;
+  queue_snapshot(const queue_snapshot& x);
+  queue_snapshot(queue_snapshot&& x) noexcept;
+  ~queue_snapshot();
+
+  queue_snapshot& operator=(const queue_snapshot& other);
+  queue_snapshot& operator=(queue_snapshot&& other) noexcept;
+
+  bool empty() const;
+  size_type size() const;
+  const_reference front() const;
+  const_reference back() const;
+  const_reference operator[](size_type pos) const;
+  const_pointer data() const;
+  const_iterator begin() const noexcept;
+  const_iterator end() const noexcept;
+
+  void swap(queue_snapshot& x) noexcept;
+
+private:
+  template <typename U, typename Policy> friend class flat_queue;
+
+  // Takes over a reference the caller has already added.
+  queue_snapshot(T* buffer, size_type capacity, size_type head,
+                 size_type tail);
+
+  T* buffer_ = nullptr;
+  size_type capacity_ = 0;
+  size_type head_ = 0;
+  size_type tail_ = 0;
+};
+
+inline std::size_t shared_memory::block_alignment(std::size_t alignment) {
+  return std::max(alignment, alignof(counter));
+}
+
+inline std::size_t shared_memory::header_size(std::size_t alignment) {
+  std::size_t align = block_alignment(alignment);
+  return (sizeof(counter) + align - 1) / align * align;
+}
+
+inline shared_memory::counter& shared_memory::count(const void* block,
+                                                    std::size_t alignment) {
+  const unsigned char* header =
+      static_cast<const unsigned char*>(block) - header_size(alignment);
+  return *std::launder(
+      reinterpret_cast<counter*>(const_cast<unsigned char*>(header)));
+}
+
+inline void* shared_memory::allocate(std::size_t bytes,
+                                     std::size_t alignment) {
+  void* block = heap_memory::allocate(header_size(alignment) + bytes,
+                                      block_alignment(alignment));
+  ::new (block) counter(1);
+  return static_cast<unsigned char*>(block) + header_size(alignment);
+}
+
+inline void shared_memory::deallocate(void* block, std::size_t bytes,
+                                      std::size_t alignment) noexcept {
+  counter& references = count(block, alignment);
+  if (references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  references.~counter();
+  heap_memory::deallocate(static_cast<unsigned char*>(block) -
+                              header_size(alignment),
+                          header_size(alignment) + bytes,
+                          block_alignment(alignment));
+}
+
+inline void shared_memory::share(void* block, std::size_t alignment) noexcept {
+  count(block, alignment).fetch_add(1, std::memory_order_relaxed);
+}
+
+// Acquire, so that once the other holders have let go, everything they
+// read happened before the caller writes.
+inline bool shared_memory::shared(const void* block,
+                                  std::size_t alignment) noexcept {
+  return count(block, alignment).load(std::memory_order_acquire) > 1;
+}
+
+template <typename T>
+queue_snapshot<T>::queue_snapshot(T* buffer, size_type capacity,
+                                  size_type head, size_type tail)
+    : buffer_{ buffer }, capacity_{ capacity }, head_{ head }, tail_{ tail } {}
+
+template <typename T>
+queue_snapshot<T>::queue_snapshot(const queue_snapshot& x)
+    : buffer_{ x.buffer_ },
+      capacity_{ x.capacity_ },
+      head_{ x.head_ },
+      tail_{ x.tail_ } {
+  if (buffer_) {
+    shared_memory::share(buffer_, alignof(T));
+  }
+}
+
+template <typename T>
+queue_snapshot<T>::queue_snapshot(queue_snapshot&& x) noexcept
+    : buffer_{ x.buffer_ },
+      capacity_{ x.capacity_ },
+      head_{ x.head_ },
+      tail_{ x.tail_ } {
+  x.buffer_ = nullptr;
+  x.capacity_ = x.head_ = x.tail_ = 0;
+}
+
+template <typename T> queue_snapshot<T>::~queue_snapshot() {
+  if (buffer_) {
+    shared_memory::deallocate(buffer_, capacity_ * sizeof(T), alignof(T));
+  }
+}
+
+template <typename T>
+queue_snapshot<T>& queue_snapshot<T>::operator=(const queue_snapshot& other) {
+  queue_snapshot temp(other);
+  swap(temp);
+  return *this;
+}
+
+template <typename T>
+queue_snapshot<T>& queue_snapshot<T>::
+operator=(queue_snapshot&& other) noexcept {
+  queue_snapshot temp(std::move(other));
+  swap(temp);
+  return *this;
+}
+
+template <typename T> bool queue_snapshot<T>::empty() const {
+  return head_ == tail_;
+}
+
+template <typename T>
+typename queue_snapshot<T>::size_type queue_snapshot<T>::size() const {
+  return tail_ - head_;
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_reference queue_snapshot<T>::front() const {
+  return buffer_[head_];
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_reference queue_snapshot<T>::back() const {
+  return buffer_[tail_ - 1];
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_reference queue_snapshot<T>::
+operator[](size_type pos) const {
+  return buffer_[head_ + pos];
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_pointer queue_snapshot<T>::data() const {
+  return buffer_ + head_;
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_iterator
+queue_snapshot<T>::begin() const noexcept {
+  return buffer_ + head_;
+}
+
+template <typename T>
+typename queue_snapshot<T>::const_iterator
+queue_snapshot<T>::end() const noexcept {
+  return buffer_ + tail_;
+}
+
+template <typename T> void queue_snapshot<T>::swap(queue_snapshot& x) noexcept {
+  using std::swap;
+  swap(buffer_, x.buffer_);
+  swap(capacity_, x.capacity_);
+  swap(head_, x.head_);
+  swap(tail_, x.tail_);
+}
+
+template <typename T>
+void swap(queue_snapshot<T>& x, queue_snapshot<T>& y) noexcept {
+  x.swap(y);
+}
+}
@@ -0,0 +1,84 @@
+/* Operation statistics for flat_queue, switched on through its Policy
+ * (see stats_queue_policy in flat_queue.h).
+ * 1. no_stats is the default. All of its hooks are empty inline
+ *    functions and the queue holds it as an empty base, so a queue that
+ *    does not ask for statistics pays nothing for them.
+ * 2. queue_stats counts pushes, pops, compactions split by what
+ *    triggered them (a full buffer in check_and_grow, pop() passing the
+ *    halfway mark, or an explicit reserve/shrink/compress call), the
+ *    bytes those compactions moved, buffer allocations, and the peak
+ *    size and capacity seen. flat_queue::stats() returns a copy of the
+ *    counters with wasted_prefix_ratio, the fraction of the buffer in
+ *    front of the queue's first element, filled in at the time of the
+ *    call.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dizzy {
+
+enum class compaction_reason { growth, pop, requested };
+
+struct no_stats {
+  void on_push(std::size_t, std::size_t) {}
+  void on_pop() {}
+  void on_compaction(compaction_reason, std::size_t, std::size_t) {}
+  void on_allocation() {}
+};
+
+struct queue_stats {
+  std::uint64_t pushes = 0;
+  std::uint64_t pops = 0;
+  std::uint64_t growth_compactions = 0;
+  std::uint64_t pop_compactions = 0;
+  std::uint64_t requested_compactions = 0;
+  std::uint64_t bytes_moved = 0;
+  std::uint64_t allocations = 0;
+  std::size_t peak_size = 0;
+  std::size_t peak_capacity = 0;
+  double wasted_prefix_ratio = 0.0;
+
+  void on_push(std::size_t size, std::size_t capacity);
+  void on_pop();
+  void on_compaction(compaction_reason reason, std::size_t bytes,
+                     std::size_t capacity);
+  void on_allocation();
+};
+
+inline void queue_stats::on_push(std::size_t size, std::size_t capacity) {
+  ++pushes;
+  if (size > peak_size) {
+    peak_size = size;
+  }
+  if (capacity > peak_capacity) {
+    peak_capacity = capacity;
+  }
+}
+
+inline void queue_stats::on_pop() { ++pops; }
+
+inline void queue_stats::on_compaction(compaction_reason reason,
+                                       std::size_t bytes,
+                                       std::size_t capacity) {
+  switch (reason) {
+  case compaction_reason::growth:
+    ++growth_compactions;
+    break;
+  case compaction_reason::pop:
+    ++pop_compactions;
+    break;
+  case compaction_reason::requested:
+    ++requested_compactions;
+    break;
+  }
+  bytes_moved += bytes;
+  if (capacity > peak_capacity) {
+    peak_capacity = capacity;
+  }
+}
+
+inline void queue_stats::on_allocation() { ++allocations; }
+}
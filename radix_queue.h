@@ -0,0 +1,214 @@
+/* A monotone priority queue for unsigned integer keys (a radix heap),
+ * built out of flat_queue buckets.
+ * 1. Keys must never be pushed below the key most recently popped.
+ *    That is the usual shape of an event simulator's clock and it is
+ *    what lets us beat a comparison heap: push and pop are O(1)
+ *    amortized instead of O(log n).
+ * 2. Elements live in bucket i when the highest bit in which their key
+ *    differs from the last popped key is bit i - 1 (bucket 0 holds the
+ *    keys equal to it). When bucket 0 runs dry the lowest non-empty
+ *    bucket is drained through data() and redistributed into the buckets
+ *    below it, so every element moves at most once per bit of Key.
+ * 3. top() is not const, as looking at the top may need to redistribute
+ *    a bucket.
+ * 4. Besides push() and emplace() there is insert() for bulk insertion
+ *    of (key, value) pairs from a range or an initializer-list.
+ */
+
+#pragma once
+
+#include "bits.h"
+#include "flat_queue.h"
+
+#include <array>
+#include <cassert>
+#include <initializer_list>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace dizzy {
+
+template <typename Key, typename Value> class radix_queue {
+  static_assert(std::is_unsigned<Key>::value,
+                "radix_queue keys must be an unsigned integer type");
+
+public:
+  using size_type = std::size_t;
+  using key_type = Key;
+  using mapped_type = Value;
+  using value_type = std::pair<Key, Value>;
+  using reference = value_type&;
+  using const_reference = const value_type&;
+
+  radix_queue() = default;
+  template <typename InputIt> radix_queue(InputIt first, InputIt last);
+  radix_queue(std::initializer_list<value_type> init);
+
+  bool empty() const;
+  size_type size() const;
+
+  reference top();
+  key_type top_key();
+  key_type last_key() const;
+
+  void push(key_type key, const mapped_type& val);
+  void push(key_type key, mapped_type&& val);
+  template <class... Args> void emplace(key_type key, Args&&... args);
+  template <typename InputIt> void insert(InputIt first, InputIt last);
+  void insert(std::initializer_list<value_type> init);
+
+  void pop();
+
+  void clear();
+  void swap(radix_queue& x) noexcept;
+
+private:
+  static constexpr size_type num_buckets =
+      std::numeric_limits<Key>::digits + 1;
+
+  std::array<flat_queue<value_type>, num_buckets> buckets_;
+  size_type size_ = 0;
+  key_type last_ = 0;
+
+  size_type bucket_for(key_type key) const;
+  void refill();
+};
+
+template <typename Key, typename Value>
+template <typename InputIt>
+radix_queue<Key, Value>::radix_queue(InputIt first, InputIt last) {
+  insert(first, last);
+}
+
+template <typename Key, typename Value>
+radix_queue<Key, Value>::radix_queue(std::initializer_list<value_type> init) {
+  insert(init);
+}
+
+template <typename Key, typename Value>
+bool radix_queue<Key, Value>::empty() const {
+  return size_ == 0;
+}
+
+template <typename Key, typename Value>
+typename radix_queue<Key, Value>::size_type
+radix_queue<Key, Value>::size() const {
+  return size_;
+}
+
+template <typename Key, typename Value>
+typename radix_queue<Key, Value>::reference radix_queue<Key, Value>::top() {
+  refill();
+  return buckets_[0].front();
+}
+
+template <typename Key, typename Value>
+typename radix_queue<Key, Value>::key_type radix_queue<Key, Value>::top_key() {
+  refill();
+  return last_;
+}
+
+template <typename Key, typename Value>
+typename radix_queue<Key, Value>::key_type
+radix_queue<Key, Value>::last_key() const {
+  return last_;
+}
+
+template <typename Key, typename Value>
+typename radix_queue<Key, Value>::size_type
+radix_queue<Key, Value>::bucket_for(key_type key) const {
+  return detail::bit_width(static_cast<key_type>(key ^ last_));
+}
+
+template <typename Key, typename Value>
+void radix_queue<Key, Value>::push(key_type key, const mapped_type& val) {
+  emplace(key, val);
+}
+
+template <typename Key, typename Value>
+void radix_queue<Key, Value>::push(key_type key, mapped_type&& val) {
+  emplace(key, std::move(val));
+}
+
+template <typename Key, typename Value>
+template <class... Args>
+void radix_queue<Key, Value>::emplace(key_type key, Args&&... args) {
+  assert(key >= last_ && "radix_queue keys must not decrease");
+  buckets_[bucket_for(key)].emplace(
+      std::piecewise_construct, std::forward_as_tuple(key),
+      std::forward_as_tuple(std::forward<Args>(args)...));
+  ++size_;
+}
+
+template <typename Key, typename Value>
+template <typename InputIt>
+void radix_queue<Key, Value>::insert(InputIt first, InputIt last) {
+  for (; first != last; ++first) {
+    emplace(first->first, first->second);
+  }
+}
+
+template <typename Key, typename Value>
+void radix_queue<Key, Value>::insert(std::initializer_list<value_type> init) {
+  insert(init.begin(), init.end());
+}
+
+template <typename Key, typename Value> void radix_queue<Key, Value>::pop() {
+  refill();
+  buckets_[0].pop();
+  --size_;
+}
+
+template <typename Key, typename Value> void radix_queue<Key, Value>::refill() {
+  if (!buckets_[0].empty()) {
+    return;
+  }
+  size_type i = 1;
+  while (buckets_[i].empty()) {
+    ++i;
+  }
+
+  flat_queue<value_type>& source = buckets_[i];
+  value_type* first = source.data();
+  value_type* last = first + source.size();
+  key_type new_last = first->first;
+  for (value_type* it = first + 1; it != last; ++it) {
+    if (it->first < new_last) {
+      new_last = it->first;
+    }
+  }
+  last_ = new_last;
+
+  // Every key in bucket i now differs from last_ in a lower bit than i,
+  // so nothing is pushed back into the bucket we are draining.
+  for (value_type* it = first; it != last; ++it) {
+    buckets_[bucket_for(it->first)].push(std::move(*it));
+  }
+  source.clear();
+}
+
+template <typename Key, typename Value> void radix_queue<Key, Value>::clear() {
+  for (auto& bucket : buckets_) {
+    bucket.clear();
+  }
+  size_ = 0;
+  last_ = 0;
+}
+
+template <typename Key, typename Value>
+void radix_queue<Key, Value>::swap(radix_queue& x) noexcept {
+  using std::swap;
+  for (size_type i = 0; i < num_buckets; ++i) {
+    buckets_[i].swap(x.buckets_[i]);
+  }
+  swap(size_, x.size_);
+  swap(last_, x.last_);
+}
+
+template <typename Key, typename Value>
+void swap(radix_queue<Key, Value>& x, radix_queue<Key, Value>& y) noexcept {
+  x.swap(y);
+}
+}
@@ -0,0 +1,234 @@
+/* A flat_queue whose elements keep a stable 64 bit sequence number, so
+ * that they can be referred to by ID across pops and compactions.
+ * 1. Every element pushed gets the next sequence number, starting from
+ *    0 or from the first_seq given to the constructor (to carry on after
+ *    a restart), and push/emplace return it. Numbers are never reused,
+ *    clear() skips over the ones it drops.
+ * 2. Since elements leave in the order they arrived, the sequence
+ *    number of the front is simply the number popped so far, and the
+ *    element with sequence number s is at position s - front_seq(). So
+ *    at_seq(s) is O(1) with no map on the side, and costs the queue one
+ *    extra counter.
+ * 3. at_seq() throws std::out_of_range for a number that has already
+ *    been popped or not yet been pushed, find_seq() returns nullptr
+ *    instead. pop_until_seq(s) pops everything numbered below s, so an
+ *    acknowledgement for s is pop_until_seq(s + 1), and returns how many
+ *    were popped.
+ * 4. queue() gives read access to the underlying flat_queue, for
+ *    iteration, data() and the like.
+ */
+
+#pragma once
+
+#include "flat_queue.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace dizzy {
+
+template <typename T, typename Policy = default_queue_policy>
+class sequenced_queue {
+public:
+  using queue_type = flat_queue<T, Policy>;
+  using size_type = typename queue_type::size_type;
+  using value_type = T;
+  using reference = typename queue_type::reference;
+  using const_reference = typename queue_type::const_reference;
+  using sequence_type = std::uint64_t;
+
+  sequenced_queue() = default;
+  explicit sequenced_queue(sequence_type first_seq);
+
+  bool empty() const;
+  size_type size() const;
+
+  reference front();
+  const_reference front() const;
+  reference back();
+  const_reference back() const;
+
+  sequence_type front_seq() const;
+  sequence_type back_seq() const;
+  sequence_type next_seq() const;
+
+  reference at_seq(sequence_type seq);
+  const_reference at_seq(sequence_type seq) const;
+  T* find_seq(sequence_type seq);
+  const T* find_seq(sequence_type seq) const;
+
+  sequence_type push(const value_type& val);
+  sequence_type push(value_type&& val);
+  template <class... Args> sequence_type emplace(Args&&... args);
+
+  void pop();
+  size_type pop_until_seq(sequence_type seq);
+  void clear();
+
+  const queue_type& queue() const;
+
+  void swap(sequenced_queue& x) noexcept;
+
+private:
+  queue_type queue_;
+  sequence_type front_seq_ = 0;
+
+  bool holds(sequence_type seq) const;
+};
+
+template <typename T, typename Policy>
+sequenced_queue<T, Policy>::sequenced_queue(sequence_type first_seq)
+    : front_seq_{ first_seq } {}
+
+template <typename T, typename Policy>
+bool sequenced_queue<T, Policy>::empty() const {
+  return queue_.empty();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::size_type
+sequenced_queue<T, Policy>::size() const {
+  return queue_.size();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::reference
+sequenced_queue<T, Policy>::front() {
+  return queue_.front();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::const_reference
+sequenced_queue<T, Policy>::front() const {
+  return queue_.front();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::reference
+sequenced_queue<T, Policy>::back() {
+  return queue_.back();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::const_reference
+sequenced_queue<T, Policy>::back() const {
+  return queue_.back();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::front_seq() const {
+  return front_seq_;
+}
+
+// Like back(), only meaningful when the queue is not empty.
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::back_seq() const {
+  return front_seq_ + queue_.size() - 1;
+}
+
+// The number the next push will get.
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::next_seq() const {
+  return front_seq_ + queue_.size();
+}
+
+template <typename T, typename Policy>
+bool sequenced_queue<T, Policy>::holds(sequence_type seq) const {
+  return seq >= front_seq_ && seq - front_seq_ < queue_.size();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::reference
+sequenced_queue<T, Policy>::at_seq(sequence_type seq) {
+  if (!holds(seq)) {
+    throw std::out_of_range("sequenced_queue::at_seq");
+  }
+  return queue_[seq - front_seq_];
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::const_reference
+sequenced_queue<T, Policy>::at_seq(sequence_type seq) const {
+  if (!holds(seq)) {
+    throw std::out_of_range("sequenced_queue::at_seq");
+  }
+  return queue_[seq - front_seq_];
+}
+
+template <typename T, typename Policy>
+T* sequenced_queue<T, Policy>::find_seq(sequence_type seq) {
+  return holds(seq) ? &queue_[seq - front_seq_] : nullptr;
+}
+
+template <typename T, typename Policy>
+const T* sequenced_queue<T, Policy>::find_seq(sequence_type seq) const {
+  return holds(seq) ? &queue_[seq - front_seq_] : nullptr;
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::push(const value_type& val) {
+  queue_.push(val);
+  return back_seq();
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::push(value_type&& val) {
+  queue_.push(std::move(val));
+  return back_seq();
+}
+
+template <typename T, typename Policy>
+template <class... Args>
+typename sequenced_queue<T, Policy>::sequence_type
+sequenced_queue<T, Policy>::emplace(Args&&... args) {
+  queue_.emplace(std::forward<Args>(args)...);
+  return back_seq();
+}
+
+template <typename T, typename Policy> void sequenced_queue<T, Policy>::pop() {
+  queue_.pop();
+  ++front_seq_;
+}
+
+template <typename T, typename Policy>
+typename sequenced_queue<T, Policy>::size_type
+sequenced_queue<T, Policy>::pop_until_seq(sequence_type seq) {
+  size_type popped = 0;
+  while (!queue_.empty() && front_seq_ < seq) {
+    pop();
+    ++popped;
+  }
+  return popped;
+}
+
+template <typename T, typename Policy>
+void sequenced_queue<T, Policy>::clear() {
+  front_seq_ += queue_.size();
+  queue_.clear();
+}
+
+template <typename T, typename Policy>
+const typename sequenced_queue<T, Policy>::queue_type&
+sequenced_queue<T, Policy>::queue() const {
+  return queue_;
+}
+
+template <typename T, typename Policy>
+void sequenced_queue<T, Policy>::swap(sequenced_queue& x) noexcept {
+  using std::swap;
+  queue_.swap(x.queue_);
+  swap(front_seq_, x.front_seq_);
+}
+
+template <typename T, typename Policy>
+void swap(sequenced_queue<T, Policy>& x,
+          sequenced_queue<T, Policy>& y) noexcept {
+  x.swap(y);
+}
+}
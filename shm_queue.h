@@ -0,0 +1,455 @@
+/* A ring buffer of trivially copyable records in a named POSIX shared
+ * memory segment, for handing batches between processes on one host
+ * without going through a socket.
+ * 1. One process calls shm_queue<T>::create(name, capacity, role) and
+ *    the others shm_queue<T>::open(name, role). The segment holds a
+ *    header (layout checks plus head, tail and heartbeat counters, each
+ *    on its own cache line) followed by capacity slots, with capacity
+ *    rounded up to a power of two. Positions are 64 bit counters that
+ *    never wrap in practice, so full and empty need no extra flag.
+ * 2. The Mode parameter picks single producer (shm_mode::spsc, the
+ *    default) or multiple producers (shm_mode::mpsc). There is always a
+ *    single consumer. With several producers each one claims a run of
+ *    slots with a compare-and-swap, copies into it, and then waits for
+ *    the producers that claimed before it to publish, so the consumer
+ *    only ever sees a contiguous published prefix.
+ * 3. push_range(first, n) and pop_n(out, n) move as many records as fit
+ *    (or are available) with at most two memcpys each and return how
+ *    many they moved; they never block on the peer. push() and pop()
+ *    are the single record versions.
+ * 4. Each side bumps its heartbeat counter in every push/pop and in
+ *    heartbeat(), which an idle side should call periodically.
+ *    peer_alive() reports false once the other side's counter has not
+ *    moved for longer than the peer timeout, which is how a crashed
+ *    peer is noticed. A producer that dies between claiming and
+ *    publishing will stall the other producers in mpsc mode, the
+ *    heartbeat is the way to find out.
+ * 5. The segment outlives the processes, unlink(name) removes it.
+ *    create() never takes over an existing segment, which may have a
+ *    live peer on it: it fails with EEXIST, and the caller can open()
+ *    it or unlink() it and try again.
+ *    Failures of the system calls throw std::system_error, as does a
+ *    capacity whose segment would not fit in an off_t. On older
+ *    glibc this needs -lrt.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dizzy {
+
+enum class shm_mode : std::uint32_t { spsc = 1, mpsc = 2 };
+enum class shm_role { producer, consumer };
+
+namespace detail {
+
+struct alignas(64) shm_counter {
+  std::atomic<std::uint64_t> value;
+};
+
+struct shm_queue_header {
+  static constexpr std::uint64_t ready_magic = 0x64697a7a7973686dull;
+  static constexpr std::uint32_t current_version = 1;
+
+  std::atomic<std::uint64_t> magic;
+  std::uint32_t version;
+  std::uint32_t mode;
+  std::uint64_t element_size;
+  std::uint64_t capacity;
+  std::uint64_t data_offset;
+  shm_counter head;
+  shm_counter tail;
+  shm_counter claim;
+  shm_counter producer_heartbeat;
+  shm_counter consumer_heartbeat;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "shm_queue needs lock-free 64 bit atomics to share them "
+              "between processes");
+}
+
+template <typename T, shm_mode Mode = shm_mode::spsc> class shm_queue {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "shm_queue records must be trivially copyable");
+
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using clock = std::chrono::steady_clock;
+
+  static shm_queue create(const std::string& name, size_type capacity,
+                          shm_role role);
+  static shm_queue open(const std::string& name, shm_role role);
+  static void unlink(const std::string& name);
+
+  shm_queue(const shm_queue&) = delete;
+  shm_queue(shm_queue&& x) noexcept;
+  ~shm_queue();
+
+  shm_queue& operator=(const shm_queue&) = delete;
+  shm_queue& operator=(shm_queue&& other) noexcept;
+
+  size_type capacity() const;
+  size_type size() const;
+  bool empty() const;
+
+  size_type push_range(const value_type* first, size_type count);
+  bool push(const value_type& val);
+  size_type pop_n(value_type* out, size_type count);
+  bool pop(value_type& out);
+
+  void heartbeat();
+  bool peer_alive();
+  void set_peer_timeout(clock::duration timeout);
+
+private:
+  detail::shm_queue_header* header_ = nullptr;
+  value_type* slots_ = nullptr;
+  size_type mapping_size_ = 0;
+  shm_role role_ = shm_role::consumer;
+  std::uint64_t peer_seen_ = 0;
+  clock::time_point peer_seen_at_{};
+  clock::duration peer_timeout_ = std::chrono::seconds(1);
+
+  shm_queue(void* mapping, size_type mapping_size, shm_role role);
+
+  static size_type data_offset();
+  std::atomic<std::uint64_t>& own_heartbeat();
+  std::atomic<std::uint64_t>& peer_heartbeat();
+  void copy_in(std::uint64_t position, const value_type* first,
+               size_type count);
+  void copy_out(std::uint64_t position, value_type* out, size_type count);
+};
+
+namespace detail {
+
+[[noreturn]] inline void throw_shm_error(const std::string& what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline std::string shm_path(const std::string& name) {
+  return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+}
+
+template <typename T, shm_mode Mode>
+shm_queue<T, Mode>::shm_queue(void* mapping, size_type mapping_size,
+                              shm_role role)
+    : header_{ static_cast<detail::shm_queue_header*>(mapping) },
+      slots_{ reinterpret_cast<value_type*>(static_cast<char*>(mapping) +
+                                            data_offset()) },
+      mapping_size_{ mapping_size },
+      role_{ role } {
+  peer_seen_ = peer_heartbeat().load(std::memory_order_relaxed);
+  peer_seen_at_ = clock::now();
+}
+
+template <typename T, shm_mode Mode>
+typename shm_queue<T, Mode>::size_type shm_queue<T, Mode>::data_offset() {
+  size_type align = alignof(T) > 64 ? alignof(T) : 64;
+  return (sizeof(detail::shm_queue_header) + align - 1) / align * align;
+}
+
+template <typename T, shm_mode Mode>
+shm_queue<T, Mode> shm_queue<T, Mode>::create(const std::string& name,
+                                              size_type capacity,
+                                              shm_role role) {
+  // Past 2^63 no power of two is big enough and the loop never ends, and
+  // the segment length has to fit in an off_t for ftruncate.
+  size_type max_slots =
+      (static_cast<size_type>(std::numeric_limits<off_t>::max()) -
+       data_offset()) /
+      sizeof(T);
+  if (capacity > (size_type{ 1 } << 63)) {
+    errno = EINVAL;
+    detail::throw_shm_error("shm_queue capacity too large");
+  }
+  size_type slots = 1;
+  while (slots < capacity) {
+    slots <<= 1;
+  }
+  if (slots > max_slots) {
+    errno = EINVAL;
+    detail::throw_shm_error("shm_queue capacity too large");
+  }
+  size_type length = data_offset() + slots * sizeof(T);
+
+  std::string path = detail::shm_path(name);
+  int fd = ::shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    detail::throw_shm_error("shm_open " + path);
+  }
+  if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+    int error = errno;
+    ::close(fd);
+    ::shm_unlink(path.c_str());
+    errno = error;
+    detail::throw_shm_error("ftruncate " + path);
+  }
+  void* mapping =
+      ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  int error = errno;
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    ::shm_unlink(path.c_str());
+    errno = error;
+    detail::throw_shm_error("mmap " + path);
+  }
+
+  auto* header = ::new (mapping) detail::shm_queue_header{};
+  header->version = detail::shm_queue_header::current_version;
+  header->mode = static_cast<std::uint32_t>(Mode);
+  header->element_size = sizeof(T);
+  header->capacity = slots;
+  header->data_offset = data_offset();
+  header->magic.store(detail::shm_queue_header::ready_magic,
+                      std::memory_order_release);
+  return shm_queue(mapping, length, role);
+}
+
+template <typename T, shm_mode Mode>
+shm_queue<T, Mode> shm_queue<T, Mode>::open(const std::string& name,
+                                            shm_role role) {
+  std::string path = detail::shm_path(name);
+  int fd = ::shm_open(path.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    detail::throw_shm_error("shm_open " + path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    detail::throw_shm_error("fstat " + path);
+  }
+  size_type length = static_cast<size_type>(st.st_size);
+  if (length < sizeof(detail::shm_queue_header)) {
+    ::close(fd);
+    errno = EAGAIN;
+    detail::throw_shm_error(path + " is not initialized yet");
+  }
+  void* mapping =
+      ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    detail::throw_shm_error("mmap " + path);
+  }
+
+  auto* header = static_cast<detail::shm_queue_header*>(mapping);
+  int error = 0;
+  if (header->magic.load(std::memory_order_acquire) !=
+      detail::shm_queue_header::ready_magic) {
+    error = EAGAIN;
+  } else if (header->version != detail::shm_queue_header::current_version ||
+             header->mode != static_cast<std::uint32_t>(Mode) ||
+             header->element_size != sizeof(T) ||
+             header->data_offset != data_offset() ||
+             header->capacity == 0 ||
+             (header->capacity & (header->capacity - 1)) != 0 ||
+             length < data_offset() ||
+             header->capacity > (length - data_offset()) / sizeof(T)) {
+    error = EINVAL;
+  }
+  if (error != 0) {
+    ::munmap(mapping, length);
+    errno = error;
+    detail::throw_shm_error(path + " does not hold a matching shm_queue");
+  }
+  return shm_queue(mapping, length, role);
+}
+
+template <typename T, shm_mode Mode>
+void shm_queue<T, Mode>::unlink(const std::string& name) {
+  std::string path = detail::shm_path(name);
+  if (::shm_unlink(path.c_str()) != 0 && errno != ENOENT) {
+    detail::throw_shm_error("shm_unlink " + path);
+  }
+}
+
+template <typename T, shm_mode Mode>
+shm_queue<T, Mode>::shm_queue(shm_queue&& x) noexcept
+    : header_{ x.header_ },
+      slots_{ x.slots_ },
+      mapping_size_{ x.mapping_size_ },
+      role_{ x.role_ },
+      peer_seen_{ x.peer_seen_ },
+      peer_seen_at_{ x.peer_seen_at_ },
+      peer_timeout_{ x.peer_timeout_ } {
+  x.header_ = nullptr;
+  x.slots_ = nullptr;
+  x.mapping_size_ = 0;
+}
+
+template <typename T, shm_mode Mode> shm_queue<T, Mode>::~shm_queue() {
+  if (header_) {
+    ::munmap(header_, mapping_size_);
+  }
+}
+
+template <typename T, shm_mode Mode>
+shm_queue<T, Mode>& shm_queue<T, Mode>::operator=(shm_queue&& other) noexcept {
+  if (this != &other) {
+    if (header_) {
+      ::munmap(header_, mapping_size_);
+    }
+    header_ = std::exchange(other.header_, nullptr);
+    slots_ = std::exchange(other.slots_, nullptr);
+    mapping_size_ = std::exchange(other.mapping_size_, 0);
+    role_ = other.role_;
+    peer_seen_ = other.peer_seen_;
+    peer_seen_at_ = other.peer_seen_at_;
+    peer_timeout_ = other.peer_timeout_;
+  }
+  return *this;
+}
+
+template <typename T, shm_mode Mode>
+typename shm_queue<T, Mode>::size_type shm_queue<T, Mode>::capacity() const {
+  return header_->capacity;
+}
+
+template <typename T, shm_mode Mode>
+typename shm_queue<T, Mode>::size_type shm_queue<T, Mode>::size() const {
+  std::uint64_t head = header_->head.value.load(std::memory_order_acquire);
+  std::uint64_t tail = header_->tail.value.load(std::memory_order_acquire);
+  return tail - head;
+}
+
+template <typename T, shm_mode Mode> bool shm_queue<T, Mode>::empty() const {
+  return size() == 0;
+}
+
+template <typename T, shm_mode Mode>
+void shm_queue<T, Mode>::copy_in(std::uint64_t position,
+                                 const value_type* first, size_type count) {
+  size_type mask = header_->capacity - 1;
+  size_type index = position & mask;
+  size_type split = std::min(count, header_->capacity - index);
+  std::memcpy(slots_ + index, first, split * sizeof(T));
+  std::memcpy(slots_, first + split, (count - split) * sizeof(T));
+}
+
+template <typename T, shm_mode Mode>
+void shm_queue<T, Mode>::copy_out(std::uint64_t position, value_type* out,
+                                  size_type count) {
+  size_type mask = header_->capacity - 1;
+  size_type index = position & mask;
+  size_type split = std::min(count, header_->capacity - index);
+  std::memcpy(out, slots_ + index, split * sizeof(T));
+  std::memcpy(out + split, slots_, (count - split) * sizeof(T));
+}
+
+template <typename T, shm_mode Mode>
+typename shm_queue<T, Mode>::size_type
+shm_queue<T, Mode>::push_range(const value_type* first, size_type count) {
+  auto& tail = header_->tail.value;
+  std::uint64_t start;
+  size_type pushed;
+  if (Mode == shm_mode::spsc) {
+    start = tail.load(std::memory_order_relaxed);
+    std::uint64_t head = header_->head.value.load(std::memory_order_acquire);
+    pushed = std::min<size_type>(count, header_->capacity - (start - head));
+  } else {
+    auto& claim = header_->claim.value;
+    start = claim.load(std::memory_order_relaxed);
+    do {
+      std::uint64_t head = header_->head.value.load(std::memory_order_acquire);
+      pushed = std::min<size_type>(count, header_->capacity - (start - head));
+      if (pushed == 0) {
+        break;
+      }
+    } while (!claim.compare_exchange_weak(start, start + pushed,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_relaxed));
+  }
+  own_heartbeat().fetch_add(1, std::memory_order_relaxed);
+  if (pushed == 0) {
+    return 0;
+  }
+
+  copy_in(start, first, pushed);
+  if (Mode == shm_mode::mpsc) {
+    // Publish in claim order, after everyone who claimed before us.
+    while (tail.load(std::memory_order_acquire) != start) {
+      std::this_thread::yield();
+    }
+  }
+  tail.store(start + pushed, std::memory_order_release);
+  return pushed;
+}
+
+template <typename T, shm_mode Mode>
+bool shm_queue<T, Mode>::push(const value_type& val) {
+  return push_range(&val, 1) == 1;
+}
+
+template <typename T, shm_mode Mode>
+typename shm_queue<T, Mode>::size_type
+shm_queue<T, Mode>::pop_n(value_type* out, size_type count) {
+  auto& head = header_->head.value;
+  std::uint64_t start = head.load(std::memory_order_relaxed);
+  std::uint64_t tail = header_->tail.value.load(std::memory_order_acquire);
+  size_type popped = std::min<size_type>(count, tail - start);
+  own_heartbeat().fetch_add(1, std::memory_order_relaxed);
+  if (popped == 0) {
+    return 0;
+  }
+  copy_out(start, out, popped);
+  head.store(start + popped, std::memory_order_release);
+  return popped;
+}
+
+template <typename T, shm_mode Mode>
+bool shm_queue<T, Mode>::pop(value_type& out) {
+  return pop_n(&out, 1) == 1;
+}
+
+template <typename T, shm_mode Mode>
+std::atomic<std::uint64_t>& shm_queue<T, Mode>::own_heartbeat() {
+  return role_ == shm_role::producer ? header_->producer_heartbeat.value
+                                     : header_->consumer_heartbeat.value;
+}
+
+template <typename T, shm_mode Mode>
+std::atomic<std::uint64_t>& shm_queue<T, Mode>::peer_heartbeat() {
+  return role_ == shm_role::producer ? header_->consumer_heartbeat.value
+                                     : header_->producer_heartbeat.value;
+}
+
+template <typename T, shm_mode Mode> void shm_queue<T, Mode>::heartbeat() {
+  own_heartbeat().fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T, shm_mode Mode> bool shm_queue<T, Mode>::peer_alive() {
+  std::uint64_t seen = peer_heartbeat().load(std::memory_order_relaxed);
+  clock::time_point now = clock::now();
+  if (seen != peer_seen_) {
+    peer_seen_ = seen;
+    peer_seen_at_ = now;
+    return true;
+  }
+  return now - peer_seen_at_ <= peer_timeout_;
+}
+
+template <typename T, shm_mode Mode>
+void shm_queue<T, Mode>::set_peer_timeout(clock::duration timeout) {
+  peer_timeout_ = timeout;
+}
+}
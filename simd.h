@@ -0,0 +1,334 @@
+/* Vectorized search and comparison kernels over contiguous ranges of
+ * arithmetic values, used by flat_queue's relational operators and its
+ * find(), count() and contains().
+ * 1. There are AVX2 and SSE4.2 versions of each kernel, compiled with
+ *    per-function target attributes so that nothing else needs to be
+ *    built with -mavx2. Which one runs is decided once at runtime from
+ *    cpuid, falling back to plain loops everywhere else (non-x86, non
+ *    GCC-compatible compilers, or when DIZZY_NO_SIMD is defined).
+ * 2. Only arithmetic types of size 1, 2, 4 or 8 take the vector paths.
+ *    Integers compare lane by lane with cmpeq; float and double use an
+ *    ordered compare so that NaN != NaN and 0.0 == -0.0, exactly as ==
+ *    does, which keeps the results identical to the scalar algorithms.
+ * 3. mismatch() is the building block for both equality and the
+ *    lexicographical compare: the latter skips to the first element
+ *    that is not ==, and then falls back to < on that element.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if !defined(DIZZY_NO_SIMD) && defined(__GNUC__) &&                           \
+    (defined(__x86_64__) || defined(__i386__))
+#define DIZZY_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace dizzy {
+namespace detail {
+
+template <typename T>
+struct simd_vectorizable
+    : std::integral_constant<bool, std::is_arithmetic<T>::value &&
+                                       !std::is_same<T, long double>::value &&
+                                       (sizeof(T) == 1 || sizeof(T) == 2 ||
+                                        sizeof(T) == 4 || sizeof(T) == 8)> {};
+
+#if defined(DIZZY_SIMD_X86)
+
+enum class simd_level { scalar, sse42, avx2 };
+
+inline simd_level detect_simd_level() {
+  static const simd_level level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return simd_level::avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      return simd_level::sse42;
+    }
+    return simd_level::scalar;
+  }();
+  return level;
+}
+
+// Each eq_mask returns a movemask of the lanes that compare equal, with
+// mask_bits<T> bits per element: one for the floating point compares and
+// sizeof(T) for the integer ones, which go through movemask_epi8.
+template <typename T> constexpr unsigned mask_bits() {
+  return std::is_floating_point<T>::value ? 1 : sizeof(T);
+}
+
+namespace avx2 {
+
+constexpr std::size_t width = 32;
+
+template <typename T>
+__attribute__((target("avx2"))) inline unsigned eq_mask(const T* a,
+                                                         const T* b) {
+  if constexpr (std::is_same<T, float>::value) {
+    return _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(a), _mm256_loadu_ps(b), _CMP_EQ_OQ));
+  } else if constexpr (std::is_same<T, double>::value) {
+    return _mm256_movemask_pd(
+        _mm256_cmp_pd(_mm256_loadu_pd(a), _mm256_loadu_pd(b), _CMP_EQ_OQ));
+  } else {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+    __m256i eq;
+    if constexpr (sizeof(T) == 1) {
+      eq = _mm256_cmpeq_epi8(x, y);
+    } else if constexpr (sizeof(T) == 2) {
+      eq = _mm256_cmpeq_epi16(x, y);
+    } else if constexpr (sizeof(T) == 4) {
+      eq = _mm256_cmpeq_epi32(x, y);
+    } else {
+      eq = _mm256_cmpeq_epi64(x, y);
+    }
+    return static_cast<unsigned>(_mm256_movemask_epi8(eq));
+  }
+}
+
+template <typename T>
+__attribute__((target("avx2"))) std::size_t mismatch(const T* a, const T* b,
+                                                     std::size_t n) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  constexpr unsigned all = (lanes * mask_bits<T>() == 32)
+                               ? ~0u
+                               : (1u << (lanes * mask_bits<T>())) - 1;
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    unsigned m = eq_mask(a + i, b + i);
+    if (m != all) {
+      return i + __builtin_ctz(~m) / mask_bits<T>();
+    }
+  }
+  for (; i < n; ++i) {
+    if (!(a[i] == b[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+template <typename T>
+__attribute__((target("avx2"))) std::size_t find(const T* p, std::size_t n,
+                                                 T val) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  alignas(32) T splat[lanes];
+  std::fill(splat, splat + lanes, val);
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    unsigned m = eq_mask(p + i, splat);
+    if (m != 0) {
+      return i + __builtin_ctz(m) / mask_bits<T>();
+    }
+  }
+  for (; i < n; ++i) {
+    if (p[i] == val) {
+      return i;
+    }
+  }
+  return n;
+}
+
+template <typename T>
+__attribute__((target("avx2"))) std::size_t count(const T* p, std::size_t n,
+                                                  T val) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  alignas(32) T splat[lanes];
+  std::fill(splat, splat + lanes, val);
+  std::size_t total = 0;
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    total += __builtin_popcount(eq_mask(p + i, splat)) / mask_bits<T>();
+  }
+  for (; i < n; ++i) {
+    total += p[i] == val;
+  }
+  return total;
+}
+}
+
+namespace sse42 {
+
+constexpr std::size_t width = 16;
+
+template <typename T>
+__attribute__((target("sse4.2"))) inline unsigned eq_mask(const T* a,
+                                                           const T* b) {
+  if constexpr (std::is_same<T, float>::value) {
+    return _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)));
+  } else if constexpr (std::is_same<T, double>::value) {
+    return _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a), _mm_loadu_pd(b)));
+  } else {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+    __m128i eq;
+    if constexpr (sizeof(T) == 1) {
+      eq = _mm_cmpeq_epi8(x, y);
+    } else if constexpr (sizeof(T) == 2) {
+      eq = _mm_cmpeq_epi16(x, y);
+    } else if constexpr (sizeof(T) == 4) {
+      eq = _mm_cmpeq_epi32(x, y);
+    } else {
+      eq = _mm_cmpeq_epi64(x, y);
+    }
+    return static_cast<unsigned>(_mm_movemask_epi8(eq));
+  }
+}
+
+template <typename T>
+__attribute__((target("sse4.2"))) std::size_t mismatch(const T* a, const T* b,
+                                                       std::size_t n) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  constexpr unsigned all = (1u << (lanes * mask_bits<T>())) - 1;
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    unsigned m = eq_mask(a + i, b + i);
+    if (m != all) {
+      return i + __builtin_ctz(~m) / mask_bits<T>();
+    }
+  }
+  for (; i < n; ++i) {
+    if (!(a[i] == b[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+template <typename T>
+__attribute__((target("sse4.2"))) std::size_t find(const T* p, std::size_t n,
+                                                   T val) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  alignas(16) T splat[lanes];
+  std::fill(splat, splat + lanes, val);
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    unsigned m = eq_mask(p + i, splat);
+    if (m != 0) {
+      return i + __builtin_ctz(m) / mask_bits<T>();
+    }
+  }
+  for (; i < n; ++i) {
+    if (p[i] == val) {
+      return i;
+    }
+  }
+  return n;
+}
+
+template <typename T>
+__attribute__((target("sse4.2"))) std::size_t count(const T* p,
+                                                    std::size_t n, T val) {
+  constexpr std::size_t lanes = width / sizeof(T);
+  alignas(16) T splat[lanes];
+  std::fill(splat, splat + lanes, val);
+  std::size_t total = 0;
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    total += __builtin_popcount(eq_mask(p + i, splat)) / mask_bits<T>();
+  }
+  for (; i < n; ++i) {
+    total += p[i] == val;
+  }
+  return total;
+}
+}
+
+#endif
+
+// Index of the first position where a and b are not ==, or n.
+template <typename T>
+std::size_t simd_mismatch(const T* a, const T* b, std::size_t n) {
+#if defined(DIZZY_SIMD_X86)
+  if constexpr (simd_vectorizable<T>::value) {
+    switch (detect_simd_level()) {
+    case simd_level::avx2:
+      return avx2::mismatch(a, b, n);
+    case simd_level::sse42:
+      return sse42::mismatch(a, b, n);
+    case simd_level::scalar:
+      break;
+    }
+  }
+#endif
+  return std::mismatch(a, a + n, b).first - a;
+}
+
+// Index of the first element == val, or n.
+template <typename T>
+std::size_t simd_find(const T* p, std::size_t n, const T& val) {
+#if defined(DIZZY_SIMD_X86)
+  if constexpr (simd_vectorizable<T>::value) {
+    switch (detect_simd_level()) {
+    case simd_level::avx2:
+      return avx2::find(p, n, val);
+    case simd_level::sse42:
+      return sse42::find(p, n, val);
+    case simd_level::scalar:
+      break;
+    }
+  }
+#endif
+  return std::find(p, p + n, val) - p;
+}
+
+template <typename T>
+std::size_t simd_count(const T* p, std::size_t n, const T& val) {
+#if defined(DIZZY_SIMD_X86)
+  if constexpr (simd_vectorizable<T>::value) {
+    switch (detect_simd_level()) {
+    case simd_level::avx2:
+      return avx2::count(p, n, val);
+    case simd_level::sse42:
+      return sse42::count(p, n, val);
+    case simd_level::scalar:
+      break;
+    }
+  }
+#endif
+  return std::count(p, p + n, val);
+}
+
+template <typename T>
+bool simd_equal(const T* a, const T* b, std::size_t n) {
+  if constexpr (simd_vectorizable<T>::value) {
+    return simd_mismatch(a, b, n) == n;
+  } else {
+    return std::equal(a, a + n, b);
+  }
+}
+
+template <typename T>
+bool simd_lexicographical_less(const T* a, std::size_t na, const T* b,
+                               std::size_t nb) {
+  if constexpr (simd_vectorizable<T>::value) {
+    std::size_t n = std::min(na, nb);
+    std::size_t i = 0;
+    while (true) {
+      i += simd_mismatch(a + i, b + i, n - i);
+      if (i == n) {
+        return na < nb;
+      }
+      if (a[i] < b[i]) {
+        return true;
+      }
+      if (b[i] < a[i]) {
+        return false;
+      }
+      // Neither is less, only possible with a NaN, so keep going just as
+      // std::lexicographical_compare would.
+      ++i;
+    }
+  } else {
+    return std::lexicographical_compare(a, a + na, b, b + nb);
+  }
+}
+}
+}
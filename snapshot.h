@@ -0,0 +1,400 @@
+/* Binary snapshots of a flat_queue of trivially copyable elements.
+ * 1. save(queue, out) writes a snapshot_header followed by the live
+ *    range, data() to data() + size(), as raw bytes. The header records
+ *    a format version, the byte order, sizeof and alignof the element,
+ *    the element count and a checksum of the element bytes, and the data
+ *    starts at an offset aligned for the element type (at least 64).
+ * 2. load<T>(in) reads a snapshot back into a fresh flat_queue with one
+ *    bulk read into the slots handed out by prepare(), there is no
+ *    per-element work beyond the optional checksum. The count in the
+ *    header is checked against the bytes left in a stream that can
+ *    seek; one that cannot is read a megabyte at a time, so a damaged
+ *    count fails as a truncated snapshot rather than a huge allocation.
+ * 3. map_snapshot<T>(path) maps the file read-only and hands back a
+ *    snapshot_view over it, which has the read side of the flat_queue
+ *    interface (size, front, back, operator[], data, iterators) and
+ *    unmaps the file when destroyed. Nothing is read until it is
+ *    touched, so even a very large queue is available immediately;
+ *    for the same reason the checksum is only verified when asked for.
+ *    This part needs POSIX mmap.
+ * 4. Anything that does not check out (bad magic, another version, byte
+ *    order or element layout, a truncated file or a wrong checksum)
+ *    throws a snapshot_error.
+ */
+
+#pragma once
+
+#include "flat_queue.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DIZZY_SNAPSHOT_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dizzy {
+
+class snapshot_error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+struct snapshot_header {
+  static constexpr char magic_bytes[8] = { 'd', 'i', 'z', 'z',
+                                            'y', 'f', 'q', 0 };
+  static constexpr std::uint32_t current_version = 1;
+  static constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t element_size;
+  std::uint32_t element_alignment;
+  std::uint64_t count;
+  std::uint64_t checksum;
+  std::uint64_t data_offset;
+};
+
+namespace detail {
+
+// A word at a time multiply-rotate hash; much faster than a byte at a
+// time hash over a multi-GB queue, and all we need is to catch damage.
+inline std::uint64_t snapshot_checksum(const void* bytes, std::size_t length) {
+  const unsigned char* p = static_cast<const unsigned char*>(bytes);
+  const std::uint64_t prime = 0x9E3779B97F4A7C15ull;
+  std::uint64_t h = length * prime;
+  std::size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, p + i, 8);
+    h ^= word * prime;
+    h = ((h << 31) | (h >> 33)) * 0xC2B2AE3D27D4EB4Full;
+  }
+  if (i != length) {
+    std::uint64_t tail = 0;
+    std::memcpy(&tail, p + i, length - i);
+    h ^= tail * prime;
+  }
+  h ^= h >> 29;
+  return h;
+}
+
+template <typename T> constexpr std::uint64_t snapshot_data_offset() {
+  constexpr std::uint64_t align = alignof(T) > 64 ? alignof(T) : 64;
+  return (sizeof(snapshot_header) + align - 1) / align * align;
+}
+
+// The bytes from the current position to the end of the stream, or the
+// largest count for a stream that cannot seek (a pipe, a socket).
+inline std::uint64_t snapshot_bytes_left(std::istream& in) {
+  std::istream::pos_type here = in.tellg();
+  if (here == std::istream::pos_type(-1)) {
+    in.clear();
+    return ~std::uint64_t{ 0 };
+  }
+  std::istream::pos_type end = in.seekg(0, std::ios::end).tellg();
+  in.clear();
+  in.seekg(here);
+  if (end == std::istream::pos_type(-1) || !in) {
+    in.clear();
+    in.seekg(here);
+    return ~std::uint64_t{ 0 };
+  }
+  return static_cast<std::uint64_t>(end - here);
+}
+
+template <typename T>
+void check_snapshot_header(const snapshot_header& header,
+                           std::uint64_t available) {
+  if (std::memcmp(header.magic, snapshot_header::magic_bytes,
+                  sizeof(header.magic)) != 0) {
+    throw snapshot_error("not a flat_queue snapshot");
+  }
+  if (header.version != snapshot_header::current_version) {
+    throw snapshot_error("unsupported flat_queue snapshot version");
+  }
+  if (header.byte_order != snapshot_header::byte_order_mark) {
+    throw snapshot_error("flat_queue snapshot has another byte order");
+  }
+  if (header.element_size != sizeof(T) ||
+      header.element_alignment != alignof(T)) {
+    throw snapshot_error("flat_queue snapshot element layout differs");
+  }
+  if (header.data_offset % alignof(T) != 0 ||
+      header.data_offset < sizeof(snapshot_header) ||
+      header.data_offset > available ||
+      header.count > (available - header.data_offset) / sizeof(T)) {
+    throw snapshot_error("flat_queue snapshot is truncated");
+  }
+}
+}
+
+template <typename T, typename Policy>
+void save(const flat_queue<T, Policy>& queue, std::ostream& out) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "flat_queue snapshots need a trivially copyable type");
+  snapshot_header header{};
+  std::memcpy(header.magic, snapshot_header::magic_bytes,
+              sizeof(header.magic));
+  header.version = snapshot_header::current_version;
+  header.byte_order = snapshot_header::byte_order_mark;
+  header.element_size = sizeof(T);
+  header.element_alignment = alignof(T);
+  header.count = queue.size();
+  header.checksum =
+      detail::snapshot_checksum(queue.data(), queue.size() * sizeof(T));
+  header.data_offset = detail::snapshot_data_offset<T>();
+
+  const char padding[detail::snapshot_data_offset<T>()] = {};
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(padding, header.data_offset - sizeof(header));
+  out.write(reinterpret_cast<const char*>(queue.data()),
+            queue.size() * sizeof(T));
+  if (!out) {
+    throw snapshot_error("failed writing flat_queue snapshot");
+  }
+}
+
+template <typename T, typename Policy>
+void save(const flat_queue<T, Policy>& queue, const std::string& path) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw snapshot_error("cannot open " + path);
+  }
+  save(queue, out);
+}
+
+template <typename T, typename Policy = default_queue_policy>
+flat_queue<T, Policy> load(std::istream& in, bool verify = true) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "flat_queue snapshots need a trivially copyable type");
+  snapshot_header header;
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    throw snapshot_error("flat_queue snapshot is truncated");
+  }
+  std::uint64_t left = detail::snapshot_bytes_left(in);
+  std::uint64_t available = left > ~std::uint64_t{ 0 } - sizeof(header)
+                                ? ~std::uint64_t{ 0 }
+                                : left + sizeof(header);
+  detail::check_snapshot_header<T>(header, available);
+  std::uint64_t padding = header.data_offset - sizeof(header);
+  if (padding > static_cast<std::uint64_t>(
+                    std::numeric_limits<std::streamsize>::max()) ||
+      !in.ignore(static_cast<std::streamsize>(padding)) ||
+      static_cast<std::uint64_t>(in.gcount()) != padding) {
+    throw snapshot_error("flat_queue snapshot is truncated");
+  }
+
+  // Trusted only once it has been checked against the stream's length,
+  // and otherwise read chunk by chunk until the stream runs out.
+  constexpr std::uint64_t chunk_bytes = 1 << 20;
+  std::uint64_t chunk = available != ~std::uint64_t{ 0 }
+                            ? header.count
+                            : std::max<std::uint64_t>(chunk_bytes / sizeof(T),
+                                                      1);
+  flat_queue<T, Policy> queue;
+  for (std::uint64_t remaining = header.count; remaining != 0;) {
+    span<T> slots = queue.prepare(
+        static_cast<std::size_t>(std::min(remaining, chunk)));
+    if (!in.read(reinterpret_cast<char*>(slots.data()), slots.size_bytes())) {
+      throw snapshot_error("flat_queue snapshot is truncated");
+    }
+    queue.commit(slots.size());
+    remaining -= slots.size();
+  }
+  if (verify && detail::snapshot_checksum(queue.data(),
+                                          queue.size() * sizeof(T)) !=
+                    header.checksum) {
+    throw snapshot_error("flat_queue snapshot checksum mismatch");
+  }
+  return queue;
+}
+
+template <typename T, typename Policy = default_queue_policy>
+flat_queue<T, Policy> load(const std::string& path, bool verify = true) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw snapshot_error("cannot open " + path);
+  }
+  return load<T, Policy>(in, verify);
+}
+
+#if defined(DIZZY_SNAPSHOT_MMAP)
+
+template <typename T> class snapshot_view;
+
+template <typename T>
+snapshot_view<T> map_snapshot(const std::string& path, bool verify = false);
+
+template <typename T> class snapshot_view {
+public:
+  using size_type = std::size_t;
+  using value_type = T;
+  using const_pointer = const T*;
+  using const_reference = const T&;
+  using const_iterator = const T*;
+
+  snapshot_view() = default;
+  snapshot_view(const snapshot_view&) = delete;
+  snapshot_view(snapshot_view&& x) noexcept;
+  ~snapshot_view();
+
+  snapshot_view& operator=(const snapshot_view&) = delete;
+  snapshot_view& operator=(snapshot_view&& other) noexcept;
+
+  bool empty() const;
+  size_type size() const;
+
+  const_reference front() const;
+  const_reference back() const;
+  const_reference operator[](size_type pos) const;
+  const_pointer data() const;
+
+  const_iterator begin() const noexcept;
+  const_iterator end() const noexcept;
+
+  bool verify() const;
+  flat_queue<T> to_queue() const;
+
+private:
+  template <typename U>
+  friend snapshot_view<U> map_snapshot(const std::string& path, bool verify);
+
+  void* mapping_ = nullptr;
+  size_type mapping_size_ = 0;
+  const T* data_ = nullptr;
+  size_type size_ = 0;
+  std::uint64_t checksum_ = 0;
+};
+
+template <typename T>
+snapshot_view<T>::snapshot_view(snapshot_view&& x) noexcept
+    : mapping_{ x.mapping_ },
+      mapping_size_{ x.mapping_size_ },
+      data_{ x.data_ },
+      size_{ x.size_ },
+      checksum_{ x.checksum_ } {
+  x.mapping_ = nullptr;
+  x.mapping_size_ = x.size_ = 0;
+  x.data_ = nullptr;
+}
+
+template <typename T> snapshot_view<T>::~snapshot_view() {
+  if (mapping_) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+template <typename T>
+snapshot_view<T>& snapshot_view<T>::operator=(snapshot_view&& other) noexcept {
+  snapshot_view temp(std::move(other));
+  std::swap(mapping_, temp.mapping_);
+  std::swap(mapping_size_, temp.mapping_size_);
+  std::swap(data_, temp.data_);
+  std::swap(size_, temp.size_);
+  std::swap(checksum_, temp.checksum_);
+  return *this;
+}
+
+template <typename T> bool snapshot_view<T>::empty() const {
+  return size_ == 0;
+}
+
+template <typename T>
+typename snapshot_view<T>::size_type snapshot_view<T>::size() const {
+  return size_;
+}
+
+template <typename T>
+typename snapshot_view<T>::const_reference snapshot_view<T>::front() const {
+  return data_[0];
+}
+
+template <typename T>
+typename snapshot_view<T>::const_reference snapshot_view<T>::back() const {
+  return data_[size_ - 1];
+}
+
+template <typename T>
+typename snapshot_view<T>::const_reference snapshot_view<T>::
+operator[](size_type pos) const {
+  return data_[pos];
+}
+
+template <typename T>
+typename snapshot_view<T>::const_pointer snapshot_view<T>::data() const {
+  return data_;
+}
+
+template <typename T>
+typename snapshot_view<T>::const_iterator snapshot_view<T>::begin() const
+    noexcept {
+  return data_;
+}
+
+template <typename T>
+typename snapshot_view<T>::const_iterator snapshot_view<T>::end() const
+    noexcept {
+  return data_ + size_;
+}
+
+template <typename T> bool snapshot_view<T>::verify() const {
+  return detail::snapshot_checksum(data_, size_ * sizeof(T)) == checksum_;
+}
+
+template <typename T> flat_queue<T> snapshot_view<T>::to_queue() const {
+  return flat_queue<T>(begin(), end());
+}
+
+template <typename T>
+snapshot_view<T> map_snapshot(const std::string& path, bool verify) {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "flat_queue snapshots need a trivially copyable type");
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw snapshot_error("cannot open " + path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      static_cast<std::uint64_t>(st.st_size) < sizeof(snapshot_header)) {
+    ::close(fd);
+    throw snapshot_error("flat_queue snapshot is truncated");
+  }
+  std::size_t length = static_cast<std::size_t>(st.st_size);
+  void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    throw snapshot_error("cannot map " + path);
+  }
+
+  snapshot_view<T> view;
+  view.mapping_ = mapping;
+  view.mapping_size_ = length;
+  snapshot_header header;
+  std::memcpy(&header, mapping, sizeof(header));
+  detail::check_snapshot_header<T>(header, length);
+  view.data_ = reinterpret_cast<const T*>(static_cast<const char*>(mapping) +
+                                          header.data_offset);
+  view.size_ = header.count;
+  view.checksum_ = header.checksum;
+  if (verify && !view.verify()) {
+    throw snapshot_error("flat_queue snapshot checksum mismatch");
+  }
+  return view;
+}
+
+#endif
+}
@@ -0,0 +1,264 @@
+/* A structure-of-arrays flavor of flat_queue for records made of several
+ * fields, e.g. soa_queue<timestamp, id, value>.
+ * 1. Each field gets its own vector (a column), and all of the columns
+ *    share one head offset, the analogue of flat_queue's true_front, and
+ *    one tail, so element i of the queue is element head + i of every
+ *    column.
+ * 2. column<I>() returns a span over the live part of field I, starting
+ *    at the head. A consumer that only looks at one field scans one
+ *    dense array instead of striding over whole records, which keeps the
+ *    cache lines full and lets the compiler vectorize the loop.
+ * 3. push(ts...) appends one record, pop() drops the front record and
+ *    pop(n) drops the first n at once. Growth and compaction follow
+ *    flat_queue: a full queue is compacted and grown by 1.5, and popping
+ *    past half of the columns compacts them.
+ * 4. front() and operator[] return a tuple of references into the
+ *    columns rather than a record.
+ * 5. There is no iterator interface, use the columns.
+ */
+
+#pragma once
+
+#include "span.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace dizzy {
+
+template <typename... Ts> class soa_queue {
+  static_assert(sizeof...(Ts) > 0, "soa_queue needs at least one field");
+  static_assert(!std::disjunction<std::is_same<Ts, bool>...>::value,
+                "soa_queue columns are vectors, and vector<bool> has no "
+                "contiguous storage");
+
+public:
+  using size_type = std::size_t;
+  using value_type = std::tuple<Ts...>;
+  using reference = std::tuple<Ts&...>;
+  using const_reference = std::tuple<const Ts&...>;
+
+  template <size_type I>
+  using field_type = typename std::tuple_element<I, value_type>::type;
+
+  static constexpr size_type num_columns = sizeof...(Ts);
+
+  soa_queue() = default;
+
+  bool empty() const;
+  size_type size() const;
+
+  reference front();
+  const_reference front() const;
+  reference back();
+  const_reference back() const;
+  reference operator[](size_type pos);
+  const_reference operator[](size_type pos) const;
+
+  template <size_type I> span<field_type<I>> column();
+  template <size_type I> span<const field_type<I>> column() const;
+
+  template <typename... Us> void push(Us&&... vals);
+
+  void pop();
+  void pop(size_type count);
+
+  void shrink_to_fit();
+  void reserve(size_type new_size);
+  void compress_and_reserve(double mult_factor = 1.5);
+  void clear();
+
+  void swap(soa_queue& x) noexcept;
+
+private:
+  using indices = std::index_sequence_for<Ts...>;
+
+  std::tuple<std::vector<Ts>...> columns_;
+  size_type true_front = 0;
+
+  size_type tail() const;
+  void check_and_grow();
+
+  template <size_type... Is>
+  reference get(size_type pos, std::index_sequence<Is...>);
+  template <size_type... Is>
+  const_reference get(size_type pos, std::index_sequence<Is...>) const;
+  template <typename... Us, size_type... Is>
+  void push_columns(std::index_sequence<Is...>, Us&&... vals);
+  template <size_type... Is>
+  void compress_columns(size_type new_capacity, std::index_sequence<Is...>);
+};
+
+template <typename... Ts>
+typename soa_queue<Ts...>::size_type soa_queue<Ts...>::tail() const {
+  return std::get<0>(columns_).size();
+}
+
+template <typename... Ts> bool soa_queue<Ts...>::empty() const {
+  return tail() == true_front;
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::size_type soa_queue<Ts...>::size() const {
+  return tail() - true_front;
+}
+
+template <typename... Ts>
+template <std::size_t... Is>
+typename soa_queue<Ts...>::reference
+soa_queue<Ts...>::get(size_type pos, std::index_sequence<Is...>) {
+  return reference(std::get<Is>(columns_)[pos]...);
+}
+
+template <typename... Ts>
+template <std::size_t... Is>
+typename soa_queue<Ts...>::const_reference
+soa_queue<Ts...>::get(size_type pos, std::index_sequence<Is...>) const {
+  return const_reference(std::get<Is>(columns_)[pos]...);
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::reference soa_queue<Ts...>::front() {
+  return get(true_front, indices{});
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::const_reference soa_queue<Ts...>::front() const {
+  return get(true_front, indices{});
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::reference soa_queue<Ts...>::back() {
+  return get(tail() - 1, indices{});
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::const_reference soa_queue<Ts...>::back() const {
+  return get(tail() - 1, indices{});
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::reference soa_queue<Ts...>::
+operator[](size_type pos) {
+  return get(true_front + pos, indices{});
+}
+
+template <typename... Ts>
+typename soa_queue<Ts...>::const_reference soa_queue<Ts...>::
+operator[](size_type pos) const {
+  return get(true_front + pos, indices{});
+}
+
+template <typename... Ts>
+template <std::size_t I>
+auto soa_queue<Ts...>::column() -> span<field_type<I>> {
+  return { std::get<I>(columns_).data() + true_front, size() };
+}
+
+template <typename... Ts>
+template <std::size_t I>
+auto soa_queue<Ts...>::column() const -> span<const field_type<I>> {
+  return { std::get<I>(columns_).data() + true_front, size() };
+}
+
+template <typename... Ts> void soa_queue<Ts...>::check_and_grow() {
+  if (tail() == std::get<0>(columns_).capacity()) {
+    compress_and_reserve();
+  }
+}
+
+template <typename... Ts>
+template <typename... Us, std::size_t... Is>
+void soa_queue<Ts...>::push_columns(std::index_sequence<Is...>,
+                                    Us&&... vals) {
+  // A throw from one column takes back the values already pushed onto
+  // the columns before it, so the columns keep the same length.
+  size_type old_tail = tail();
+  try {
+    (std::get<Is>(columns_).push_back(std::forward<Us>(vals)), ...);
+  } catch (...) {
+    ((std::get<Is>(columns_).size() > old_tail
+          ? std::get<Is>(columns_).pop_back()
+          : void()),
+     ...);
+    throw;
+  }
+}
+
+template <typename... Ts>
+template <typename... Us>
+void soa_queue<Ts...>::push(Us&&... vals) {
+  static_assert(sizeof...(Us) == sizeof...(Ts),
+                "soa_queue::push takes one value per column");
+  check_and_grow();
+  push_columns(indices{}, std::forward<Us>(vals)...);
+}
+
+template <typename... Ts> void soa_queue<Ts...>::pop() { pop(1); }
+
+template <typename... Ts> void soa_queue<Ts...>::pop(size_type count) {
+  assert(count <= size());
+  true_front += count;
+  if (true_front > tail() / 2) {
+    compress_and_reserve();
+  }
+}
+
+template <typename... Ts> void soa_queue<Ts...>::shrink_to_fit() {
+  compress_and_reserve(1.0);
+}
+
+template <typename... Ts> void soa_queue<Ts...>::reserve(size_type new_size) {
+  if (empty()) {
+    if (new_size > std::get<0>(columns_).capacity()) {
+      compress_columns(new_size, indices{});
+    } else {
+      clear();
+    }
+  } else {
+    compress_and_reserve(new_size / static_cast<double>(size()));
+  }
+}
+
+template <typename... Ts>
+template <std::size_t... Is>
+void soa_queue<Ts...>::compress_columns(size_type new_capacity,
+                                        std::index_sequence<Is...>) {
+  auto compress = [this, new_capacity](auto& column) {
+    std::remove_reference_t<decltype(column)> temp;
+    temp.reserve(new_capacity);
+    std::move(column.begin() + true_front, column.end(),
+              std::back_inserter(temp));
+    column.swap(temp);
+  };
+  (compress(std::get<Is>(columns_)), ...);
+  true_front = 0;
+}
+
+template <typename... Ts>
+void soa_queue<Ts...>::compress_and_reserve(double mult_factor) {
+  compress_columns(ceil(size() * mult_factor), indices{});
+}
+
+template <typename... Ts> void soa_queue<Ts...>::clear() {
+  std::apply([](auto&... column) { (column.clear(), ...); }, columns_);
+  true_front = 0;
+}
+
+template <typename... Ts> void soa_queue<Ts...>::swap(soa_queue& x) noexcept {
+  using std::swap;
+  swap(columns_, x.columns_);
+  swap(true_front, x.true_front);
+}
+
+template <typename... Ts>
+void swap(soa_queue<Ts...>& x, soa_queue<Ts...>& y) noexcept {
+  x.swap(y);
+}
+}
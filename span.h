@@ -0,0 +1,53 @@
+/* A minimal non-owning view over a contiguous run of elements, for the
+ * containers here that hand out pieces of their storage (the columns of
+ * soa_queue, for one). It is a small subset of C++20's std::span with a
+ * dynamic extent only, so that none of this needs C++20.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+
+namespace dizzy {
+
+template <typename T> class span {
+public:
+  using size_type = std::size_t;
+  using element_type = T;
+  using pointer = T*;
+  using reference = T&;
+  using iterator = T*;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+
+  constexpr span() noexcept = default;
+  constexpr span(pointer first, size_type count) noexcept
+      : data_{ first }, size_{ count } {}
+
+  constexpr pointer data() const noexcept { return data_; }
+  constexpr size_type size() const noexcept { return size_; }
+  constexpr size_type size_bytes() const noexcept { return size_ * sizeof(T); }
+  constexpr bool empty() const noexcept { return size_ == 0; }
+
+  constexpr reference operator[](size_type pos) const { return data_[pos]; }
+  constexpr reference front() const { return data_[0]; }
+  constexpr reference back() const { return data_[size_ - 1]; }
+
+  constexpr span first(size_type count) const { return { data_, count }; }
+  constexpr span last(size_type count) const {
+    return { data_ + size_ - count, count };
+  }
+  constexpr span subspan(size_type offset, size_type count) const {
+    return { data_ + offset, count };
+  }
+
+  constexpr iterator begin() const noexcept { return data_; }
+  constexpr iterator end() const noexcept { return data_ + size_; }
+  reverse_iterator rbegin() const noexcept { return reverse_iterator(end()); }
+  reverse_iterator rend() const noexcept { return reverse_iterator(begin()); }
+
+private:
+  pointer data_ = nullptr;
+  size_type size_ = 0;
+};
+}
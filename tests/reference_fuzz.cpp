@@ -0,0 +1,356 @@
+/* Reference-model fuzz: runs long random sequences of operations against
+ * each queue and against a std::deque holding what the queue should
+ * hold, and stops at the first step where they disagree.
+ *   reference_fuzz [seed [steps]]
+ * 1. The flat_queue-like queues (flat_queue under several policies,
+ *    compact_queue and indirect_queue) share one driver: pushes and
+ *    emplaces, all four pops, writes through front(), back() and
+ *    operator[], reserve, shrink_to_fit, clear, copies, moves, swaps
+ *    and, for flat_queue of trivially copyable elements, prepare and
+ *    commit. flat_deque gets its own driver that works both ends.
+ * 2. The mix drifts between push-heavy and pop-heavy phases, so the
+ *    queues spend time both growing and draining, and go through their
+ *    compactions on either side. Sizes, fronts and backs are compared
+ *    after every step, the whole contents every few steps.
+ * 3. deferred_queue_policy queues get a small maintenance() call every
+ *    few steps, so writes and pushes land while a compaction is half
+ *    done; cow_queue_policy queues keep copies alive across steps, so
+ *    every write happens with the buffer shared; compact_queue runs
+ *    with an 8 bit index, so it keeps hitting its max_size().
+ * 4. std::string elements (long enough to defeat the small string
+ *    optimization) catch lifetime mistakes under AddressSanitizer.
+ * 5. Exits with 0 and prints the seed when every queue made it through,
+ *    with 1 and the failing queue, seed and step otherwise.
+ *
+ * Build from this directory with something like
+ *   g++ -std=c++17 -O1 -g -fsanitize=address,undefined -I.. \
+ *       reference_fuzz.cpp -o reference_fuzz
+ */
+
+#include "compact_queue.h"
+#include "flat_deque.h"
+#include "flat_queue.h"
+#include "indirect_queue.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace {
+
+const char* current_queue = "";
+unsigned long current_seed = 0;
+std::size_t current_step = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::printf("FAIL %s: %s (seed %lu, step %zu)\n", current_queue, what,
+                current_seed, current_step);
+    std::exit(1);
+  }
+}
+
+template <typename T> T make_value(std::uint32_t n);
+
+template <> int make_value<int>(std::uint32_t n) {
+  return static_cast<int>(n);
+}
+
+template <> std::string make_value<std::string>(std::uint32_t n) {
+  return "element number " + std::to_string(n) + " of the fuzz run";
+}
+
+template <typename Queue> std::size_t size_limit(const Queue&) {
+  return std::numeric_limits<std::size_t>::max();
+}
+
+template <typename T, typename Index, typename Growth>
+std::size_t size_limit(const dizzy::compact_queue<T, Index, Growth>&) {
+  return dizzy::compact_queue<T, Index, Growth>::max_size();
+}
+
+template <typename Queue> void tick(Queue&, std::size_t) {}
+
+template <typename T>
+void tick(dizzy::flat_queue<T, dizzy::deferred_queue_policy>& q,
+          std::size_t budget) {
+  q.maintenance(budget);
+}
+
+// Appends count copies of val, through prepare() and commit() where
+// the queue has them.
+template <typename Queue, typename T>
+void bulk_push(Queue& q, const T& val, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    q.push(val);
+  }
+}
+
+template <typename T, typename Policy>
+void bulk_push(dizzy::flat_queue<T, Policy>& q, const T& val,
+               std::size_t count) {
+  if constexpr (std::is_trivially_copyable<T>::value) {
+    dizzy::span<T> slots = q.prepare(count + 2);
+    std::fill(slots.begin(), slots.end(), val);
+    q.commit(count);
+  } else {
+    for (std::size_t i = 0; i < count; ++i) {
+      q.push(val);
+    }
+  }
+}
+
+template <typename Queue, typename T>
+void compare(const Queue& q, const std::deque<T>& ref, bool everything) {
+  check(q.size() == ref.size(), "size");
+  check(q.empty() == ref.empty(), "empty");
+  if (ref.empty()) {
+    return;
+  }
+  check(q.front() == ref.front(), "front");
+  check(q.back() == ref.back(), "back");
+  if (everything) {
+    check(std::equal(q.begin(), q.end(), ref.begin(), ref.end()),
+          "contents");
+    for (std::size_t i = 0; i < ref.size(); i += 1 + ref.size() / 8) {
+      check(q[i] == ref[i], "operator[]");
+    }
+  }
+}
+
+template <typename Queue>
+void fuzz_queue(const char* name, unsigned long seed, std::size_t steps) {
+  using T = typename Queue::value_type;
+  current_queue = name;
+  current_seed = seed;
+  std::mt19937 rng(seed);
+  auto roll = [&rng](std::uint32_t n) {
+    return std::uniform_int_distribution<std::uint32_t>(0, n - 1)(rng);
+  };
+
+  Queue q;
+  std::deque<T> ref;
+  // Copies kept alive for a while, to hold on to a shared buffer.
+  Queue keep;
+  std::deque<T> keep_ref;
+  std::uint32_t push_weight = 50;
+  std::uint32_t next = 0;
+  std::size_t limit = size_limit(q);
+
+  for (current_step = 0; current_step < steps; ++current_step) {
+    if (current_step % 1000 == 0) {
+      const std::uint32_t phases[] = { 30, 50, 50, 70 };
+      push_weight = phases[roll(4)];
+    }
+    std::uint32_t op = roll(100);
+    if (op < push_weight) {
+      T val = make_value<T>(next++);
+      if (ref.size() >= limit) {
+        bool thrown = false;
+        try {
+          q.push(val);
+        } catch (const std::length_error&) {
+          thrown = true;
+        }
+        check(thrown, "push past max_size() did not throw");
+      } else if (op % 3 == 0) {
+        q.push(val);
+        ref.push_back(val);
+      } else if (op % 3 == 1) {
+        T moved = val;
+        q.push(std::move(moved));
+        ref.push_back(val);
+      } else {
+        q.emplace(val);
+        ref.push_back(val);
+      }
+    } else if (op < 85) {
+      if (ref.empty()) {
+        check(!q.try_pop(), "try_pop on an empty queue");
+        T out{};
+        check(!q.pop_into(out), "pop_into on an empty queue");
+      } else if (op % 4 == 0) {
+        q.pop();
+        ref.pop_front();
+      } else if (op % 4 == 1) {
+        check(q.pop_front() == ref.front(), "pop_front");
+        ref.pop_front();
+      } else if (op % 4 == 2) {
+        auto val = q.try_pop();
+        check(val && *val == ref.front(), "try_pop");
+        ref.pop_front();
+      } else {
+        T out{};
+        check(q.pop_into(out) && out == ref.front(), "pop_into");
+        ref.pop_front();
+      }
+    } else if (op < 91) {
+      if (!ref.empty()) {
+        T val = make_value<T>(next++);
+        std::size_t pos = roll(static_cast<std::uint32_t>(ref.size()));
+        if (op == 85) {
+          q.front() = val;
+          ref.front() = val;
+        } else if (op == 86) {
+          q.back() = val;
+          ref.back() = val;
+        } else if (op == 87) {
+          *std::next(q.begin(), static_cast<std::ptrdiff_t>(pos)) = val;
+          ref[pos] = val;
+        } else {
+          q[pos] = val;
+          ref[pos] = val;
+        }
+      }
+    } else if (op < 93) {
+      std::size_t target =
+          roll(static_cast<std::uint32_t>(2 * ref.size() + 64));
+      q.reserve(std::min(target, limit));
+    } else if (op == 93) {
+      if (roll(4) == 0) {
+        q.shrink_to_fit();
+      } else if (roll(8) == 0) {
+        q.clear();
+        ref.clear();
+      }
+    } else if (op == 94) {
+      std::size_t count = roll(16);
+      if (ref.size() + count + 2 <= limit) {
+        T val = make_value<T>(next++);
+        bulk_push(q, val, count);
+        ref.insert(ref.end(), count, val);
+      }
+    } else if (op == 95) {
+      keep = q;
+      keep_ref = ref;
+    } else if (op == 96) {
+      Queue copy(q);
+      compare(copy, ref, true);
+      Queue moved(std::move(copy));
+      compare(moved, ref, true);
+      q = std::move(moved);
+    } else if (op == 97) {
+      q.swap(keep);
+      std::swap(ref, keep_ref);
+    } else {
+      tick(q, 1 + roll(64));
+      tick(keep, 1 + roll(64));
+    }
+    compare(q, ref, current_step % 16 == 0);
+    if (current_step % 64 == 0) {
+      compare(keep, keep_ref, true);
+    }
+  }
+  compare(q, ref, true);
+  compare(keep, keep_ref, true);
+}
+
+void fuzz_deque(const char* name, unsigned long seed, std::size_t steps) {
+  using T = std::string;
+  current_queue = name;
+  current_seed = seed;
+  std::mt19937 rng(seed);
+  auto roll = [&rng](std::uint32_t n) {
+    return std::uniform_int_distribution<std::uint32_t>(0, n - 1)(rng);
+  };
+
+  dizzy::flat_deque<T> q;
+  std::deque<T> ref;
+  std::uint32_t push_weight = 50;
+  std::uint32_t next = 0;
+
+  for (current_step = 0; current_step < steps; ++current_step) {
+    if (current_step % 1000 == 0) {
+      const std::uint32_t phases[] = { 30, 50, 50, 70 };
+      push_weight = phases[roll(4)];
+    }
+    std::uint32_t op = roll(100);
+    if (op < push_weight) {
+      T val = make_value<T>(next++);
+      if (op % 4 == 0) {
+        q.push_back(val);
+        ref.push_back(val);
+      } else if (op % 4 == 1) {
+        q.push_front(val);
+        ref.push_front(val);
+      } else if (op % 4 == 2) {
+        check(q.emplace_back(val) == val, "emplace_back");
+        ref.push_back(val);
+      } else {
+        check(q.emplace_front(val) == val, "emplace_front");
+        ref.push_front(val);
+      }
+    } else if (op < 88) {
+      if (ref.empty()) {
+        continue;
+      } else if (op % 2 == 0) {
+        q.pop_front();
+        ref.pop_front();
+      } else {
+        q.pop_back();
+        ref.pop_back();
+      }
+    } else if (op < 92) {
+      if (!ref.empty()) {
+        T val = make_value<T>(next++);
+        std::size_t pos = roll(static_cast<std::uint32_t>(ref.size()));
+        q.at(pos) = val;
+        ref[pos] = val;
+      }
+    } else if (op < 95) {
+      q.reserve(roll(static_cast<std::uint32_t>(2 * ref.size() + 64)));
+    } else if (op == 95) {
+      q.shrink_to_fit();
+    } else if (op == 96) {
+      if (roll(8) == 0) {
+        q.clear();
+        ref.clear();
+      }
+    } else {
+      dizzy::flat_deque<T> copy(q);
+      compare(copy, ref, true);
+      check(std::equal(copy.rbegin(), copy.rend(), ref.rbegin(), ref.rend()),
+            "reverse contents");
+      q = std::move(copy);
+    }
+    compare(q, ref, current_step % 16 == 0);
+  }
+  compare(q, ref, true);
+}
+}
+
+int main(int argc, char** argv) {
+  unsigned long seed = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                                : std::random_device{}();
+  std::size_t steps = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200000;
+
+  fuzz_queue<dizzy::flat_queue<std::string>>("flat_queue", seed, steps);
+  fuzz_queue<dizzy::flat_queue<int>>("flat_queue<int>", seed, steps);
+  fuzz_queue<dizzy::flat_queue<int, dizzy::adaptive_queue_policy>>(
+      "flat_queue adaptive", seed, steps);
+  fuzz_queue<dizzy::flat_queue<int, dizzy::deferred_queue_policy>>(
+      "flat_queue deferred", seed, steps);
+  fuzz_queue<dizzy::flat_queue<int, dizzy::cow_queue_policy>>(
+      "flat_queue cow", seed, steps);
+  fuzz_queue<dizzy::flat_queue<std::string, dizzy::cached_queue_policy>>(
+      "flat_queue cached", seed, steps);
+  fuzz_queue<dizzy::compact_queue<std::string>>("compact_queue", seed,
+                                                steps);
+  fuzz_queue<dizzy::compact_queue<int, std::uint8_t>>(
+      "compact_queue<int, uint8_t>", seed, steps);
+  fuzz_queue<dizzy::indirect_queue<std::string>>("indirect_queue", seed,
+                                                 steps);
+  fuzz_deque("flat_deque", seed, steps);
+
+  std::printf("ok, seed %lu\n", seed);
+  return 0;
+}
@@ -0,0 +1,445 @@
+/* Regression tests for bugs found in review, one function per bug, each
+ * written to fail on the code before its fix.
+ *   regression_test
+ * 1. deferred_write_survives_compaction: a write through front(),
+ *    operator[] or an iterator while maintenance() is part way through
+ *    copying a deferred_queue_policy queue used to be lost when the
+ *    queue switched to the new buffer.
+ * 2. corrupt_snapshot_count: load() used to pass a damaged element
+ *    count straight to prepare() and ask for terabytes; it now fails
+ *    with a snapshot_error, both from a stream that can seek and from
+ *    one that cannot.
+ * 3. cow_copy_assignment_shares and cow_try_push_never_allocates: copy
+ *    assignment used to deep-copy under cow_queue_policy, and try_push()
+ *    used to copy a shared buffer to make room.
+ * 4. slab_constructor_throw: a throwing constructor used to break the
+ *    indirect_queue slab's free list.
+ * 5. deque_reserve_never_shrinks: flat_deque::reserve() used to be able
+ *    to shrink the buffer.
+ * 6. deferred_recopy_keeps_to_budget: copying the elements written
+ *    during a deferred compaction again used to happen all at once in
+ *    the last maintenance() call, whatever its budget.
+ * 7. frozen_queue_never_grows_below_capacity: a frozen queue used to
+ *    grow when it ran close to its capacity.
+ * 8. batch_guard_compaction_throws: a batch_guard whose compaction threw
+ *    used to throw from its destructor and terminate; finish() now
+ *    throws to the caller and the destructor drops the error.
+ * 9. deque_recenter_move_throws: a move that threw while flat_deque
+ *    recentered in place used to leave a destroyed element in the live
+ *    range.
+ * 10. pool_reuse_after_move: a queue_pool moved from kept the heads of
+ *     its free lists, so using it again read past its empty vectors.
+ * 11. soa_push_throws: a soa_queue push that threw on a later column
+ *     left the earlier columns one value longer than the rest.
+ * 12. cache_huge_sizes: buffer_cache used to shift past 64 bits while
+ *     finding the size class of a request above 2^63.
+ * Exits with 0 and prints ok when all pass.
+ *
+ * Build from this directory with something like
+ *   g++ -std=c++17 -O1 -g -fsanitize=address,undefined -I.. \
+ *       regression_test.cpp -o regression_test
+ */
+
+#include "buffer_cache.h"
+#include "flat_deque.h"
+#include "flat_queue.h"
+#include "indirect_queue.h"
+#include "queue_pool.h"
+#include "snapshot.h"
+#include "soa_queue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+
+namespace {
+
+const char* current_test = "";
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::printf("FAIL %s: %s\n", current_test, what);
+    std::exit(1);
+  }
+}
+
+void deferred_write_survives_compaction() {
+  current_test = "deferred_write_survives_compaction";
+  dizzy::flat_queue<int, dizzy::deferred_queue_policy> q;
+  for (int i = 0; i < 1000; ++i) {
+    q.push(i);
+  }
+  for (int i = 0; i < 600; ++i) {
+    q.pop();
+  }
+  check(!q.maintenance(10), "maintenance finished in one small step");
+  q.front() = -1;
+  q[100] = -2;
+  *(q.end() - 1) = -3;
+  while (!q.maintenance(10)) {
+  }
+  check(q.front() == -1, "write through front() lost");
+  check(q[100] == -2, "write through operator[] lost");
+  check(q.back() == -3, "write through an iterator lost");
+  check(q[1] == 601, "untouched element changed");
+}
+
+void deferred_recopy_keeps_to_budget() {
+  current_test = "deferred_recopy_keeps_to_budget";
+  dizzy::flat_queue<int, dizzy::deferred_queue_policy> q;
+  for (int i = 0; i < 10000; ++i) {
+    q.push(i);
+  }
+  for (int i = 0; i < 6000; ++i) {
+    q.pop();
+  }
+  check(!q.maintenance(q.size() - 1), "copy finished a slot early");
+  for (int& x : q) {
+    x = -x;
+  }
+  check(!q.maintenance(100), "recopied the whole queue in one call");
+  int calls = 1;
+  while (!q.maintenance(100)) {
+    ++calls;
+  }
+  check(calls >= 39, "fewer calls than the budget allows");
+  check(q.front() == -6000 && q.back() == -9999, "writes lost");
+}
+
+// A stream buffer over a string that cannot seek, like a pipe.
+class pipe_buffer : public std::streambuf {
+public:
+  explicit pipe_buffer(std::string bytes) : bytes_{ std::move(bytes) } {}
+
+protected:
+  int_type underflow() override {
+    return pos_ < bytes_.size() ? traits_type::to_int_type(bytes_[pos_])
+                                : traits_type::eof();
+  }
+  int_type uflow() override {
+    return pos_ < bytes_.size() ? traits_type::to_int_type(bytes_[pos_++])
+                                : traits_type::eof();
+  }
+
+private:
+  std::string bytes_;
+  std::size_t pos_ = 0;
+};
+
+template <typename Stream>
+bool load_fails(Stream& in) {
+  try {
+    dizzy::load<std::uint64_t>(in);
+  } catch (const dizzy::snapshot_error&) {
+    return true;
+  }
+  return false;
+}
+
+void corrupt_snapshot_count() {
+  current_test = "corrupt_snapshot_count";
+  dizzy::flat_queue<std::uint64_t> q;
+  for (std::uint64_t i = 0; i < 1000; ++i) {
+    q.push(i * 3);
+  }
+  std::ostringstream out;
+  dizzy::save(q, out);
+  std::string bytes = out.str();
+
+  {
+    std::istringstream in(bytes);
+    check(dizzy::load<std::uint64_t>(in) == q, "intact snapshot");
+  }
+  {
+    pipe_buffer buffer(bytes);
+    std::istream in(&buffer);
+    check(dizzy::load<std::uint64_t>(in) == q, "intact snapshot, no seek");
+  }
+
+  std::uint64_t huge = std::uint64_t{ 1 } << 40;
+  std::memcpy(&bytes[offsetof(dizzy::snapshot_header, count)], &huge,
+              sizeof(huge));
+  {
+    std::istringstream in(bytes);
+    check(load_fails(in), "huge count accepted");
+  }
+  {
+    pipe_buffer buffer(bytes);
+    std::istream in(&buffer);
+    check(load_fails(in), "huge count accepted, no seek");
+  }
+}
+
+void cow_copy_assignment_shares() {
+  current_test = "cow_copy_assignment_shares";
+  dizzy::flat_queue<int, dizzy::cow_queue_policy> a;
+  dizzy::flat_queue<int, dizzy::cow_queue_policy> b;
+  for (int i = 0; i < 10; ++i) {
+    a.push(i);
+  }
+  b = a;
+  const auto& ca = a;
+  const auto& cb = b;
+  check(ca.data() == cb.data(), "copy assignment copied the buffer");
+  b.push(10);
+  check(ca.data() != cb.data(), "push wrote to the shared buffer");
+  check(a.size() == 10 && b.size() == 11, "sizes after the push");
+}
+
+void cow_try_push_never_allocates() {
+  current_test = "cow_try_push_never_allocates";
+  dizzy::flat_queue<int, dizzy::cow_queue_policy> q;
+  q.reserve(16);
+  q.push(1);
+  auto snapshot = q.snapshot();
+  const auto& cq = q;
+  const int* before = cq.data();
+  check(!q.try_push(2), "try_push on a shared buffer succeeded");
+  check(cq.data() == before && q.size() == 1, "try_push copied the buffer");
+  check(snapshot.size() == 1 && snapshot.front() == 1, "snapshot changed");
+}
+
+struct throwing {
+  unsigned char bytes[300];
+  explicit throwing(bool fail) {
+    std::memset(bytes, 0xff, sizeof(bytes));
+    if (fail) {
+      throw std::runtime_error("constructor failed");
+    }
+  }
+};
+
+void slab_constructor_throw() {
+  current_test = "slab_constructor_throw";
+  dizzy::indirect_queue<throwing> q;
+  q.emplace(false);
+  bool thrown = false;
+  try {
+    q.emplace(true);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  check(thrown && q.size() == 1, "failed emplace changed the queue");
+  for (int i = 0; i < 200; ++i) {
+    q.emplace(false);
+  }
+  check(q.size() == 201, "pushes after the failed emplace");
+}
+
+void deque_reserve_never_shrinks() {
+  current_test = "deque_reserve_never_shrinks";
+  dizzy::flat_deque<int> d;
+  d.reserve(1000);
+  std::size_t capacity = d.capacity();
+  for (int i = 0; i < 10; ++i) {
+    d.push_back(i);
+  }
+  for (int i = 0; i < 9; ++i) {
+    d.pop_front();
+  }
+  d.reserve(20);
+  check(d.capacity() >= capacity, "reserve shrank the buffer");
+  check(d.size() == 1 && d.front() == 9, "reserve changed the contents");
+}
+
+void frozen_queue_never_grows_below_capacity() {
+  current_test = "frozen_queue_never_grows_below_capacity";
+  dizzy::flat_queue<int, dizzy::steady_queue_policy> q;
+  q.guard().set_handler(nullptr);
+  q.reserve(1000);
+  std::size_t capacity = q.capacity();
+  q.guard().freeze();
+  for (int i = 0; i < 900; ++i) {
+    q.push(i);
+  }
+  for (int i = 900; i < 100000; ++i) {
+    q.push(i);
+    check(q.front() == i - 900, "front");
+    q.pop();
+  }
+  check(q.capacity() == capacity, "a push below capacity grew the buffer");
+  check(q.guard().violations() == 0, "the guard saw an allocation");
+}
+
+// Moves may throw, so a frozen queue of these compacts by allocating.
+struct throwing_move {
+  int value;
+  explicit throwing_move(int v) : value{ v } {}
+  throwing_move(const throwing_move&) = default;
+  throwing_move(throwing_move&& other) noexcept(false)
+      : value{ other.value } {}
+  throwing_move& operator=(const throwing_move&) = default;
+};
+
+void refuse_allocation(const dizzy::allocation_violation&) {
+  throw std::runtime_error("allocation refused");
+}
+
+void batch_guard_compaction_throws() {
+  current_test = "batch_guard_compaction_throws";
+  using policy = dizzy::steady_queue_policy;
+  dizzy::flat_queue<throwing_move, policy> q;
+  for (int i = 0; i < 100; ++i) {
+    q.emplace(i);
+  }
+  q.guard().set_handler(&refuse_allocation);
+  q.guard().freeze();
+  {
+    dizzy::batch_guard<throwing_move, policy> batch(q);
+    for (int i = 0; i < 80; ++i) {
+      batch.pop();
+    }
+  }
+  check(q.size() == 20 && q.front().value == 80, "pops in the destructor");
+  bool thrown = false;
+  {
+    dizzy::batch_guard<throwing_move, policy> batch(q);
+    batch.pop();
+    try {
+      batch.finish();
+    } catch (const std::runtime_error&) {
+      thrown = true;
+    }
+  }
+  check(thrown, "finish() did not throw");
+  check(q.size() == 19 && q.front().value == 81, "pops with finish()");
+}
+
+// Throws from its move constructor once the countdown reaches zero.
+struct counted_move {
+  static int moves_left;
+  std::string value;
+  explicit counted_move(std::string v) : value{ std::move(v) } {}
+  counted_move(const counted_move&) = default;
+  counted_move(counted_move&& other) noexcept(false) : value{ other.value } {
+    if (moves_left-- == 0) {
+      throw std::runtime_error("move failed");
+    }
+  }
+  counted_move& operator=(const counted_move&) = default;
+};
+
+int counted_move::moves_left = -1;
+
+void deque_recenter_move_throws() {
+  current_test = "deque_recenter_move_throws";
+  dizzy::flat_deque<counted_move> d;
+  for (int i = 0; i < 40; ++i) {
+    d.push_back(counted_move{ "element " + std::to_string(i) +
+                              " long enough to live on the heap" });
+  }
+  for (int i = 0; i < 35; ++i) {
+    d.pop_front();
+  }
+  for (int k = 0; k < 5; ++k) {
+    counted_move::moves_left = k;
+    try {
+      for (int i = 0; i < 100; ++i) {
+        d.push_back(counted_move{ "pushed" });
+      }
+    } catch (const std::runtime_error&) {
+    }
+  }
+  counted_move::moves_left = -1;
+  check(d.front().value.compare(0, 11, "element 35 ") == 0, "front lost");
+  for (const counted_move& x : d) {
+    check(!x.value.empty(), "a gap in the live range");
+  }
+}
+
+void pool_reuse_after_move() {
+  current_test = "pool_reuse_after_move";
+  dizzy::queue_pool<std::string> a;
+  auto id = a.create();
+  for (int i = 0; i < 20; ++i) {
+    a.push(id, "element " + std::to_string(i));
+  }
+  a.destroy(a.create());
+  for (int i = 0; i < 10; ++i) {
+    a.pop(id);
+  }
+  dizzy::queue_pool<std::string> b(std::move(a));
+  check(a.queues() == 0 && a.chunks_in_use() == 0, "moved from not empty");
+  auto reused = a.create();
+  a.push(reused, "first");
+  a.push(reused, "second");
+  check(a.size(reused) == 2 && a.front(reused) == "first", "reuse");
+  dizzy::queue_pool<std::string> c;
+  c.push(c.create(), "replaced");
+  c = std::move(b);
+  check(c.size(id) == 10 && c.front(id) == "element 10", "move assignment");
+  auto fresh = b.create();
+  b.push(fresh, "again");
+  check(b.front(fresh) == "again", "reuse after move assignment");
+}
+
+// Throws when a negative value is copied.
+struct negative_copy_throws {
+  int value;
+  explicit negative_copy_throws(int v) : value{ v } {}
+  negative_copy_throws(const negative_copy_throws& other)
+      : value{ other.value } {
+    if (value < 0) {
+      throw std::runtime_error("copy failed");
+    }
+  }
+};
+
+void soa_push_throws() {
+  current_test = "soa_push_throws";
+  dizzy::soa_queue<int, std::string, negative_copy_throws> q;
+  for (int i = 0; i < 10; ++i) {
+    q.push(i, std::to_string(i), negative_copy_throws{ i });
+  }
+  for (int i = 0; i < 5; ++i) {
+    try {
+      q.push(-1, std::string("lost"), negative_copy_throws{ -1 });
+    } catch (const std::runtime_error&) {
+    }
+  }
+  q.push(10, std::string("10"), negative_copy_throws{ 10 });
+  check(q.size() == 11, "size after the failed pushes");
+  check(q.column<0>()[10] == 10 && q.column<1>()[10] == "10" &&
+            q.column<2>()[10].value == 10,
+        "columns out of step");
+}
+
+void cache_huge_sizes() {
+  current_test = "cache_huge_sizes";
+  using cache = dizzy::buffer_cache;
+  std::size_t largest = cache::class_size(cache::class_count - 1);
+  check(cache::rounded_size(largest) == largest, "largest class");
+  check(cache::rounded_size(largest - 1) == largest, "below largest class");
+  const std::size_t huge[] = { largest + 1, std::size_t{ 1 } << 63,
+                               (std::size_t{ 1 } << 63) + 1,
+                               ~std::size_t{ 0 } };
+  for (std::size_t bytes : huge) {
+    check(cache::rounded_size(bytes) == bytes, "size past the classes");
+  }
+}
+}
+
+int main() {
+  deferred_write_survives_compaction();
+  corrupt_snapshot_count();
+  deferred_recopy_keeps_to_budget();
+  cow_copy_assignment_shares();
+  cow_try_push_never_allocates();
+  slab_constructor_throw();
+  deque_reserve_never_shrinks();
+  frozen_queue_never_grows_below_capacity();
+  batch_guard_compaction_throws();
+  deque_recenter_move_throws();
+  pool_reuse_after_move();
+  soa_push_throws();
+  cache_huge_sizes();
+  std::printf("ok\n");
+  return 0;
+}
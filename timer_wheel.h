@@ -0,0 +1,296 @@
+/* A hashed, hierarchical timing wheel whose slots are flat_queues.
+ * 1. Time is an unsigned 64 bit tick count chosen by the caller. The
+ *    wheel has 64 slots per level and enough levels to cover every
+ *    tick, so there is no overflow list. A timer lives on the level of
+ *    the highest 6 bit digit in which its deadline differs from the
+ *    current tick, in the slot named by that digit.
+ * 2. schedule(deadline, value) returns a timer_handle. cancel(handle)
+ *    is O(1): it bumps a per-handle generation number and the stale
+ *    entry is dropped when its slot is next drained, so nothing is
+ *    searched for. Handles are recycled, the generation keeps an old
+ *    handle from cancelling a newer timer.
+ * 3. advance(now, callback) moves the wheel to now, calling
+ *    callback(value) for every timer whose deadline is <= now. Each
+ *    expired slot is drained in one pass over its data() span and then
+ *    cleared, and the coarser levels are cascaded down as their slots
+ *    come due. Empty stretches of time are skipped using a per-level
+ *    occupancy bitmap, so advancing a long way costs nothing extra.
+ * 4. The callback may schedule and cancel timers (anything due at or
+ *    before the current tick fires no later than the next advance()),
+ *    but it must not call advance() itself. It is handed an lvalue reference
+ *    it may move from.
+ */
+
+#pragma once
+
+#include "bits.h"
+#include "flat_queue.h"
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace dizzy {
+
+struct timer_handle {
+  std::uint32_t index;
+  std::uint32_t generation;
+};
+
+template <typename T> class timer_wheel {
+public:
+  using size_type = std::size_t;
+  using tick_type = std::uint64_t;
+  using value_type = T;
+
+  timer_wheel() = default;
+  explicit timer_wheel(tick_type start);
+
+  bool empty() const;
+  size_type size() const;
+  tick_type now() const;
+
+  timer_handle schedule(tick_type deadline, const value_type& val);
+  timer_handle schedule(tick_type deadline, value_type&& val);
+  template <class... Args>
+  timer_handle emplace(tick_type deadline, Args&&... args);
+  bool cancel(timer_handle handle);
+  bool pending(timer_handle handle) const;
+
+  template <typename Callback> void advance(tick_type now, Callback callback);
+
+  void clear();
+
+private:
+  static constexpr unsigned slot_bits = 6;
+  static constexpr unsigned num_slots = 1u << slot_bits;
+  static constexpr unsigned num_levels = (64 + slot_bits - 1) / slot_bits;
+
+  struct entry {
+    tick_type deadline;
+    std::uint32_t index;
+    std::uint32_t generation;
+    value_type value;
+  };
+
+  using slot = flat_queue<entry>;
+
+  std::array<std::array<slot, num_slots>, num_levels> levels_;
+  std::array<std::uint64_t, num_levels> occupied_{};
+  slot due_;
+  slot scratch_;
+  std::vector<std::uint32_t> generations_;
+  std::vector<std::uint32_t> free_handles_;
+  size_type size_ = 0;
+  tick_type current_ = 0;
+
+  static unsigned digit(tick_type t, unsigned level);
+  static tick_type low_mask(unsigned level);
+
+  timer_handle acquire_handle();
+  void release_handle(std::uint32_t index);
+  bool alive(const entry& e) const;
+  void place(entry&& e);
+  bool next_tick(tick_type& t) const;
+  void cascade(unsigned level, unsigned index);
+  template <typename Callback> void fire(slot& source, Callback& callback);
+};
+
+template <typename T>
+timer_wheel<T>::timer_wheel(tick_type start)
+    : current_{ start } {}
+
+template <typename T> bool timer_wheel<T>::empty() const {
+  return size_ == 0;
+}
+
+template <typename T>
+typename timer_wheel<T>::size_type timer_wheel<T>::size() const {
+  return size_;
+}
+
+template <typename T>
+typename timer_wheel<T>::tick_type timer_wheel<T>::now() const {
+  return current_;
+}
+
+template <typename T>
+unsigned timer_wheel<T>::digit(tick_type t, unsigned level) {
+  return static_cast<unsigned>(t >> (level * slot_bits)) & (num_slots - 1);
+}
+
+template <typename T>
+typename timer_wheel<T>::tick_type timer_wheel<T>::low_mask(unsigned level) {
+  return (tick_type{ 1 } << (level * slot_bits)) - 1;
+}
+
+template <typename T> timer_handle timer_wheel<T>::acquire_handle() {
+  if (free_handles_.empty()) {
+    generations_.push_back(0);
+    return { static_cast<std::uint32_t>(generations_.size() - 1), 0 };
+  }
+  std::uint32_t index = free_handles_.back();
+  free_handles_.pop_back();
+  return { index, generations_[index] };
+}
+
+template <typename T> void timer_wheel<T>::release_handle(std::uint32_t index) {
+  ++generations_[index];
+  free_handles_.push_back(index);
+  --size_;
+}
+
+template <typename T> bool timer_wheel<T>::alive(const entry& e) const {
+  return generations_[e.index] == e.generation;
+}
+
+template <typename T> void timer_wheel<T>::place(entry&& e) {
+  if (e.deadline <= current_) {
+    due_.push(std::move(e));
+    return;
+  }
+  unsigned level = static_cast<unsigned>(
+      (detail::bit_width(e.deadline ^ current_) - 1) / slot_bits);
+  unsigned index = digit(e.deadline, level);
+  levels_[level][index].push(std::move(e));
+  occupied_[level] |= std::uint64_t{ 1 } << index;
+}
+
+template <typename T>
+timer_handle timer_wheel<T>::schedule(tick_type deadline,
+                                      const value_type& val) {
+  return emplace(deadline, val);
+}
+
+template <typename T>
+timer_handle timer_wheel<T>::schedule(tick_type deadline, value_type&& val) {
+  return emplace(deadline, std::move(val));
+}
+
+template <typename T>
+template <class... Args>
+timer_handle timer_wheel<T>::emplace(tick_type deadline, Args&&... args) {
+  timer_handle handle = acquire_handle();
+  place(entry{ deadline, handle.index, handle.generation,
+               value_type(std::forward<Args>(args)...) });
+  ++size_;
+  return handle;
+}
+
+template <typename T> bool timer_wheel<T>::pending(timer_handle handle) const {
+  return handle.index < generations_.size() &&
+         generations_[handle.index] == handle.generation;
+}
+
+template <typename T> bool timer_wheel<T>::cancel(timer_handle handle) {
+  if (!pending(handle)) {
+    return false;
+  }
+  release_handle(handle.index);
+  return true;
+}
+
+// Finds the first tick after current_ at which some slot comes due.
+template <typename T> bool timer_wheel<T>::next_tick(tick_type& t) const {
+  bool found = false;
+  for (unsigned level = 0; level < num_levels; ++level) {
+    unsigned here = digit(current_, level);
+    std::uint64_t later =
+        here + 1 == num_slots ? 0 : occupied_[level] & (~std::uint64_t{ 0 }
+                                                        << (here + 1));
+    if (later == 0) {
+      continue;
+    }
+    unsigned index =
+        static_cast<unsigned>(detail::bit_width(later & (~later + 1))) - 1;
+    unsigned shift = (level + 1) * slot_bits;
+    tick_type high = shift >= 64 ? 0 : (current_ >> shift) << shift;
+    tick_type candidate = high | (tick_type{ index } << (level * slot_bits));
+    if (!found || candidate < t) {
+      t = candidate;
+      found = true;
+    }
+  }
+  return found;
+}
+
+template <typename T>
+void timer_wheel<T>::cascade(unsigned level, unsigned index) {
+  using std::swap;
+  swap(levels_[level][index], scratch_);
+  occupied_[level] &= ~(std::uint64_t{ 1 } << index);
+  entry* first = scratch_.data();
+  entry* last = first + scratch_.size();
+  for (entry* it = first; it != last; ++it) {
+    if (alive(*it)) {
+      place(std::move(*it));
+    }
+  }
+  scratch_.clear();
+}
+
+template <typename T>
+template <typename Callback>
+void timer_wheel<T>::fire(slot& source, Callback& callback) {
+  using std::swap;
+  swap(source, scratch_);
+  entry* first = scratch_.data();
+  entry* last = first + scratch_.size();
+  for (entry* it = first; it != last; ++it) {
+    if (alive(*it)) {
+      release_handle(it->index);
+      callback(it->value);
+    }
+  }
+  scratch_.clear();
+}
+
+template <typename T>
+template <typename Callback>
+void timer_wheel<T>::advance(tick_type now, Callback callback) {
+  if (!due_.empty()) {
+    fire(due_, callback);
+  }
+  tick_type t = 0;
+  while (current_ < now && next_tick(t) && t <= now) {
+    current_ = t;
+    for (unsigned level = num_levels - 1; level > 0; --level) {
+      unsigned index = digit(t, level);
+      if ((t & low_mask(level)) == 0 &&
+          (occupied_[level] & (std::uint64_t{ 1 } << index))) {
+        cascade(level, index);
+      }
+    }
+    unsigned index = digit(t, 0);
+    if (occupied_[0] & (std::uint64_t{ 1 } << index)) {
+      occupied_[0] &= ~(std::uint64_t{ 1 } << index);
+      fire(levels_[0][index], callback);
+    }
+    if (!due_.empty()) {
+      fire(due_, callback);
+    }
+  }
+  if (current_ < now) {
+    current_ = now;
+  }
+}
+
+template <typename T> void timer_wheel<T>::clear() {
+  for (auto& level : levels_) {
+    for (auto& s : level) {
+      s.clear();
+    }
+  }
+  occupied_.fill(0);
+  due_.clear();
+  for (std::uint32_t index = 0; index < generations_.size(); ++index) {
+    ++generations_[index];
+  }
+  free_handles_.clear();
+  for (std::uint32_t index = 0; index < generations_.size(); ++index) {
+    free_handles_.push_back(index);
+  }
+  size_ = 0;
+}
+}
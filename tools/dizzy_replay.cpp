@@ -0,0 +1,438 @@
+/* dizzy-replay: replays a flat_queue trace (see trace.h) against each of
+ * the queues in this project and reports how they fare on it.
+ *   dizzy-replay [--queue NAME]... [--repeat N] trace-file
+ * 1. The trace is read into memory first, then replayed as fast as
+ *    possible (the timestamps are only used to report the original
+ *    duration), N times per queue, keeping the fastest run.
+ * 2. Elements are stand-in payloads with the traced element size,
+ *    rounded up to a power of two between 4 and 1024 bytes.
+ * 3. For each queue it prints the throughput in operations per second,
+ *    the peak heap in use and the number of allocations, both counted
+ *    by the replacement operator new below, and for flat_queue the
+ *    compactions by reason as counted by queue_stats.
+ * 4. Queues, selected with --queue (all of them by default):
+ *    flat_queue, flat_queue_latency (adds p50/p99 push and pop
+ *    latencies), flat_queue_cached (buffers recycled through the
+ *    thread's buffer_cache, adds its hit rate so far),
+ *    flat_queue_adaptive (adds the growth parameters adaptive_growth
+ *    settled on), flat_queue_deferred (compactions left to a
+ *    maintenance() call after every operation), compact_queue,
+ *    indirect_queue, flat_deque, std_deque and std_list. Adding another
+ *    is a matter of a line in the candidates table at the bottom.
+ *
+ * Build from this directory with something like
+ *   g++ -std=c++17 -O2 -I.. dizzy_replay.cpp -o dizzy-replay
+ */
+
+#include "compact_queue.h"
+#include "flat_deque.h"
+#include "flat_queue.h"
+#include "indirect_queue.h"
+#include "latency.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::size_t live_bytes = 0;
+std::size_t peak_bytes = 0;
+std::size_t allocation_count = 0;
+
+// Every block carries its size in front of it so that the unsized
+// operator delete can keep live_bytes right.
+constexpr std::size_t block_header = alignof(std::max_align_t);
+
+void* counted_alloc(std::size_t size) {
+  void* block = std::malloc(size + block_header);
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  *static_cast<std::size_t*>(block) = size;
+  live_bytes += size;
+  ++allocation_count;
+  if (live_bytes > peak_bytes) {
+    peak_bytes = live_bytes;
+  }
+  return static_cast<char*>(block) + block_header;
+}
+
+void counted_free(void* p) {
+  if (!p) {
+    return;
+  }
+  void* block = static_cast<char*>(p) - block_header;
+  live_bytes -= *static_cast<std::size_t*>(block);
+  std::free(block);
+}
+
+// The aligned forms (compact_queue uses them) keep the size in the
+// word just before the block they hand out.
+std::size_t aligned_header(std::size_t alignment) {
+  return alignment > block_header ? alignment : block_header;
+}
+
+void* counted_aligned_alloc(std::size_t size, std::align_val_t alignment) {
+  std::size_t align = static_cast<std::size_t>(alignment);
+  std::size_t header = aligned_header(align);
+  std::size_t total = (header + size + align - 1) / align * align;
+  void* block = std::aligned_alloc(align, total);
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  char* p = static_cast<char*>(block) + header;
+  reinterpret_cast<std::size_t*>(p)[-1] = size;
+  live_bytes += size;
+  ++allocation_count;
+  if (live_bytes > peak_bytes) {
+    peak_bytes = live_bytes;
+  }
+  return p;
+}
+
+void counted_aligned_free(void* p, std::align_val_t alignment) {
+  if (!p) {
+    return;
+  }
+  live_bytes -= static_cast<std::size_t*>(p)[-1];
+  std::free(static_cast<char*>(p) -
+            aligned_header(static_cast<std::size_t>(alignment)));
+}
+}
+
+void* operator new(std::size_t size) { return counted_alloc(size); }
+void* operator new[](std::size_t size) { return counted_alloc(size); }
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t) noexcept { counted_free(p); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return counted_aligned_alloc(size, alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return counted_aligned_alloc(size, alignment);
+}
+void operator delete(void* p, std::align_val_t alignment) noexcept {
+  counted_aligned_free(p, alignment);
+}
+void operator delete[](void* p, std::align_val_t alignment) noexcept {
+  counted_aligned_free(p, alignment);
+}
+void operator delete(void* p, std::size_t,
+                     std::align_val_t alignment) noexcept {
+  counted_aligned_free(p, alignment);
+}
+void operator delete[](void* p, std::size_t,
+                       std::align_val_t alignment) noexcept {
+  counted_aligned_free(p, alignment);
+}
+
+namespace {
+
+template <std::size_t N> struct payload {
+  unsigned char bytes[N];
+};
+
+struct adaptive_stats_policy : dizzy::adaptive_queue_policy {
+  using stats_type = dizzy::queue_stats;
+};
+
+struct deferred_stats_policy : dizzy::deferred_queue_policy {
+  using stats_type = dizzy::queue_stats;
+};
+
+// Roughly what a maintenance_scheduler pass would get between two
+// operations of a busy queue.
+constexpr std::size_t maintenance_budget = 64;
+
+struct replay_result {
+  double seconds = 0.0;
+  std::size_t peak_bytes = 0;
+  std::size_t allocations = 0;
+  std::string extra;
+};
+
+template <typename Queue> void replay_reserve(Queue& q, std::size_t n) {
+  q.reserve(n);
+}
+
+template <typename T> void replay_reserve(std::deque<T>&, std::size_t) {}
+template <typename T> void replay_reserve(std::list<T>&, std::size_t) {}
+
+template <typename Queue> void replay_push(Queue& q) {
+  q.push(typename Queue::value_type{});
+}
+
+template <typename T> void replay_push(std::deque<T>& q) { q.push_back(T{}); }
+template <typename T> void replay_push(std::list<T>& q) { q.push_back(T{}); }
+template <typename T> void replay_push(dizzy::flat_deque<T>& q) {
+  q.push_back(T{});
+}
+
+template <typename Queue> void replay_pop(Queue& q) { q.pop(); }
+template <typename T> void replay_pop(std::deque<T>& q) { q.pop_front(); }
+template <typename T> void replay_pop(std::list<T>& q) { q.pop_front(); }
+template <typename T> void replay_pop(dizzy::flat_deque<T>& q) {
+  q.pop_front();
+}
+
+template <typename Queue> void replay_tick(Queue&) {}
+template <typename T>
+void replay_tick(dizzy::flat_queue<T, deferred_stats_policy>& q) {
+  q.maintenance(maintenance_budget);
+}
+
+std::string compaction_counts(const dizzy::queue_stats& stats) {
+  std::ostringstream extra;
+  extra << "compactions growth=" << stats.growth_compactions
+        << " pop=" << stats.pop_compactions
+        << " requested=" << stats.requested_compactions
+        << " bytes_moved=" << stats.bytes_moved;
+  return extra.str();
+}
+
+template <typename Queue> void report(const Queue&, replay_result&) {}
+
+template <typename T>
+void report(const dizzy::flat_queue<T, dizzy::stats_queue_policy>& q,
+            replay_result& result) {
+  result.extra = compaction_counts(q.stats());
+}
+
+template <typename T>
+void report(dizzy::flat_queue<T, adaptive_stats_policy>& q,
+            replay_result& result) {
+  dizzy::growth_parameters chosen = q.growth().parameters();
+  std::ostringstream extra;
+  extra.precision(2);
+  extra << std::fixed << "factor=" << chosen.capacity_factor
+        << " trigger=" << chosen.compaction_trigger << ' '
+        << compaction_counts(q.stats());
+  result.extra = extra.str();
+}
+
+template <typename T>
+void report(const dizzy::flat_queue<T, deferred_stats_policy>& q,
+            replay_result& result) {
+  result.extra = compaction_counts(q.stats());
+}
+
+template <typename T>
+void report(const dizzy::flat_queue<T, dizzy::latency_queue_policy>&,
+            replay_result& result) {
+  auto& latency = dizzy::queue_latency::global();
+  const double scale = dizzy::default_latency_clock::ns_per_tick();
+  std::ostringstream extra;
+  extra.precision(1);
+  extra << std::fixed
+        << "push p50=" << latency.push.percentile(50.0) * scale
+        << "ns p99=" << latency.push.percentile(99.0) * scale
+        << "ns pop p50=" << latency.pop.percentile(50.0) * scale
+        << "ns p99=" << latency.pop.percentile(99.0) * scale << "ns";
+  result.extra = extra.str();
+}
+
+template <typename T>
+void report(const dizzy::flat_queue<T, dizzy::cached_queue_policy>&,
+            replay_result& result) {
+  dizzy::buffer_cache_stats stats = dizzy::buffer_cache::local().stats();
+  std::ostringstream extra;
+  extra.precision(3);
+  extra << "cache hits=" << stats.hits << " misses=" << stats.misses
+        << " hit_rate=" << stats.hit_rate();
+  result.extra = extra.str();
+}
+
+template <typename Queue>
+replay_result replay(const std::vector<dizzy::trace_event>& events) {
+  dizzy::queue_latency::global().reset();
+  replay_result result;
+  std::size_t base_bytes = live_bytes;
+  peak_bytes = live_bytes;
+  std::size_t base_allocations = allocation_count;
+  {
+    Queue q;
+    std::size_t size = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const dizzy::trace_event& event : events) {
+      switch (event.op) {
+      case dizzy::trace_op::push:
+        replay_push(q);
+        ++size;
+        break;
+      case dizzy::trace_op::pop:
+        // Only a damaged trace pops an empty queue, skip rather than
+        // crash on one.
+        if (size != 0) {
+          replay_pop(q);
+          --size;
+        }
+        break;
+      case dizzy::trace_op::reserve:
+        replay_reserve(q, static_cast<std::size_t>(event.arg));
+        break;
+      case dizzy::trace_op::clear:
+        q.clear();
+        size = 0;
+        break;
+      }
+      replay_tick(q);
+    }
+    result.seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    report(q, result);
+  }
+  result.peak_bytes = peak_bytes - base_bytes;
+  result.allocations = allocation_count - base_allocations;
+  return result;
+}
+
+template <template <typename> class Queue>
+replay_result replay_sized(const std::vector<dizzy::trace_event>& events,
+                           std::size_t element_size) {
+  if (element_size <= 4) {
+    return replay<Queue<payload<4>>>(events);
+  } else if (element_size <= 8) {
+    return replay<Queue<payload<8>>>(events);
+  } else if (element_size <= 16) {
+    return replay<Queue<payload<16>>>(events);
+  } else if (element_size <= 32) {
+    return replay<Queue<payload<32>>>(events);
+  } else if (element_size <= 64) {
+    return replay<Queue<payload<64>>>(events);
+  } else if (element_size <= 128) {
+    return replay<Queue<payload<128>>>(events);
+  } else if (element_size <= 256) {
+    return replay<Queue<payload<256>>>(events);
+  } else if (element_size <= 512) {
+    return replay<Queue<payload<512>>>(events);
+  }
+  return replay<Queue<payload<1024>>>(events);
+}
+
+template <typename T>
+using flat_stats_queue = dizzy::flat_queue<T, dizzy::stats_queue_policy>;
+template <typename T>
+using flat_latency_queue = dizzy::flat_queue<T, dizzy::latency_queue_policy>;
+template <typename T>
+using flat_cached_queue = dizzy::flat_queue<T, dizzy::cached_queue_policy>;
+template <typename T>
+using flat_adaptive_queue = dizzy::flat_queue<T, adaptive_stats_policy>;
+template <typename T>
+using flat_deferred_queue = dizzy::flat_queue<T, deferred_stats_policy>;
+template <typename T> using compact_queue = dizzy::compact_queue<T>;
+template <typename T> using indirect_queue = dizzy::indirect_queue<T>;
+template <typename T> using std_deque = std::deque<T>;
+template <typename T> using std_list = std::list<T>;
+
+struct candidate {
+  const char* name;
+  replay_result (*run)(const std::vector<dizzy::trace_event>&, std::size_t);
+};
+
+const candidate candidates[] = {
+  { "flat_queue", replay_sized<flat_stats_queue> },
+  { "flat_queue_latency", replay_sized<flat_latency_queue> },
+  { "flat_queue_cached", replay_sized<flat_cached_queue> },
+  { "flat_queue_adaptive", replay_sized<flat_adaptive_queue> },
+  { "flat_queue_deferred", replay_sized<flat_deferred_queue> },
+  { "compact_queue", replay_sized<compact_queue> },
+  { "indirect_queue", replay_sized<indirect_queue> },
+  { "flat_deque", replay_sized<dizzy::flat_deque> },
+  { "std_deque", replay_sized<std_deque> },
+  { "std_list", replay_sized<std_list> },
+};
+
+int usage() {
+  std::cerr << "usage: dizzy-replay [--queue NAME]... [--repeat N] "
+               "trace-file\nqueues:";
+  for (const candidate& c : candidates) {
+    std::cerr << ' ' << c.name;
+  }
+  std::cerr << '\n';
+  return 2;
+}
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> selected;
+  int repeat = 3;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+      selected.push_back(argv[++i]);
+    } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = std::atoi(argv[++i]);
+    } else if (argv[i][0] == '-' || path) {
+      return usage();
+    } else {
+      path = argv[i];
+    }
+  }
+  if (!path || repeat < 1) {
+    return usage();
+  }
+
+  std::vector<dizzy::trace_event> events;
+  std::size_t element_size = 0;
+  std::uint64_t start_ns = 0;
+  try {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      std::cerr << "dizzy-replay: cannot open " << path << '\n';
+      return 1;
+    }
+    dizzy::trace_reader reader(in);
+    element_size = reader.element_size();
+    start_ns = reader.start_ns();
+    dizzy::trace_event event;
+    while (reader.next(event)) {
+      events.push_back(event);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "dizzy-replay: " << path << ": " << e.what() << '\n';
+    return 1;
+  }
+
+  double traced =
+      events.empty() ? 0.0 : (events.back().time_ns - start_ns) / 1e9;
+  std::printf("%zu operations, %zu byte elements, %.3fs as traced\n",
+              events.size(), element_size, traced);
+  for (const candidate& c : candidates) {
+    if (!selected.empty() &&
+        std::find(selected.begin(), selected.end(), c.name) ==
+            selected.end()) {
+      continue;
+    }
+    replay_result best = c.run(events, element_size);
+    for (int i = 1; i < repeat; ++i) {
+      replay_result result = c.run(events, element_size);
+      if (result.seconds < best.seconds) {
+        best = result;
+      }
+    }
+    double rate = best.seconds > 0 ? events.size() / best.seconds : 0.0;
+    std::printf("%-20s %10.2f Mops/s  peak %10zu bytes  %8zu allocations",
+                c.name, rate / 1e6, best.peak_bytes, best.allocations);
+    if (!best.extra.empty()) {
+      std::printf("  %s", best.extra.c_str());
+    }
+    std::printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,242 @@
+/* Operation traces for flat_queue, switched on through its Policy (see
+ * trace_queue_policy in flat_queue.h), so that tuning can be done on the
+ * traffic a queue really sees rather than on synthetic workloads.
+ * 1. trace_recorder is the hook a policy plugs in as its trace_type. It
+ *    records nothing until it is pointed at a trace_writer with
+ *    tracer().set_sink(&writer), and set_sink(nullptr) stops it again,
+ *    so recording can be turned on and off in a running process. no_trace
+ *    is the default and compiles to nothing.
+ * 2. trace_writer buffers records and writes them to an ostream in
+ *    64KB chunks (and on flush() or destruction). Like the queue itself
+ *    it is not thread safe; give each queue its own writer.
+ * 3. The format is a trace_header (magic, version, element size and the
+ *    start time) followed by one record per push, pop, reserve or clear:
+ *    an op byte, the nanoseconds since the previous record as a varint
+ *    and, for reserve only, the requested size as a varint. A busy queue
+ *    costs 2 to 3 bytes per operation.
+ * 4. trace_reader reads a trace back one trace_event at a time, with
+ *    absolute timestamps. tools/dizzy_replay.cpp uses it to replay a
+ *    trace against the queues in this project. A bad header or a
+ *    truncated record throws trace_error.
+ */
+
+#pragma once
+
+#include "latency.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace dizzy {
+
+class trace_error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+enum class trace_op : std::uint8_t { push, pop, reserve, clear };
+
+struct trace_header {
+  static constexpr char magic_bytes[8] = { 'd', 'i', 'z', 'z',
+                                            'y', 't', 'r', 0 };
+  static constexpr std::uint32_t current_version = 1;
+
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t element_size;
+  std::uint64_t start_ns;
+};
+
+struct trace_event {
+  trace_op op;
+  std::uint64_t time_ns;
+  std::uint64_t arg;
+};
+
+class trace_writer {
+public:
+  static constexpr std::size_t flush_threshold = 64 * 1024;
+
+  trace_writer(std::ostream& out, std::size_t element_size);
+  trace_writer(const trace_writer&) = delete;
+  ~trace_writer();
+
+  trace_writer& operator=(const trace_writer&) = delete;
+
+  void record(trace_op op, std::uint64_t arg = 0);
+  void flush();
+
+private:
+  std::ostream* out_;
+  std::vector<unsigned char> buffer_;
+  std::uint64_t last_ns_;
+
+  void put_varint(std::uint64_t value);
+};
+
+class trace_reader {
+public:
+  explicit trace_reader(std::istream& in);
+
+  std::size_t element_size() const;
+  std::uint64_t start_ns() const;
+
+  bool next(trace_event& event);
+
+private:
+  std::istream* in_;
+  trace_header header_;
+  std::uint64_t last_ns_;
+
+  std::uint64_t get_varint();
+};
+
+struct no_trace {
+  void on_push() {}
+  void on_pop() {}
+  void on_reserve(std::size_t) {}
+  void on_clear() {}
+};
+
+class trace_recorder {
+public:
+  void on_push();
+  void on_pop();
+  void on_reserve(std::size_t new_size);
+  void on_clear();
+
+  trace_writer* sink() const;
+  void set_sink(trace_writer* sink);
+
+private:
+  trace_writer* sink_ = nullptr;
+};
+
+inline trace_writer::trace_writer(std::ostream& out, std::size_t element_size)
+    : out_{ &out }, last_ns_{ monotonic_clock::now() } {
+  trace_header header{};
+  std::memcpy(header.magic, trace_header::magic_bytes, sizeof(header.magic));
+  header.version = trace_header::current_version;
+  header.element_size = static_cast<std::uint32_t>(element_size);
+  header.start_ns = last_ns_;
+  out_->write(reinterpret_cast<const char*>(&header), sizeof(header));
+  buffer_.reserve(flush_threshold + 32);
+}
+
+inline trace_writer::~trace_writer() { flush(); }
+
+inline void trace_writer::record(trace_op op, std::uint64_t arg) {
+  std::uint64_t now = monotonic_clock::now();
+  buffer_.push_back(static_cast<unsigned char>(op));
+  put_varint(now - last_ns_);
+  if (op == trace_op::reserve) {
+    put_varint(arg);
+  }
+  last_ns_ = now;
+  if (buffer_.size() >= flush_threshold) {
+    flush();
+  }
+}
+
+inline void trace_writer::flush() {
+  out_->write(reinterpret_cast<const char*>(buffer_.data()),
+              static_cast<std::streamsize>(buffer_.size()));
+  out_->flush();
+  buffer_.clear();
+}
+
+inline void trace_writer::put_varint(std::uint64_t value) {
+  while (value >= 0x80) {
+    buffer_.push_back(static_cast<unsigned char>(value | 0x80));
+    value >>= 7;
+  }
+  buffer_.push_back(static_cast<unsigned char>(value));
+}
+
+inline trace_reader::trace_reader(std::istream& in) : in_{ &in } {
+  if (!in_->read(reinterpret_cast<char*>(&header_), sizeof(header_))) {
+    throw trace_error("flat_queue trace is truncated");
+  }
+  if (std::memcmp(header_.magic, trace_header::magic_bytes,
+                  sizeof(header_.magic)) != 0) {
+    throw trace_error("not a flat_queue trace");
+  }
+  if (header_.version != trace_header::current_version) {
+    throw trace_error("unsupported flat_queue trace version");
+  }
+  last_ns_ = header_.start_ns;
+}
+
+inline std::size_t trace_reader::element_size() const {
+  return header_.element_size;
+}
+
+inline std::uint64_t trace_reader::start_ns() const {
+  return header_.start_ns;
+}
+
+// Reads the next record into event, returning false at the end of the
+// trace.
+inline bool trace_reader::next(trace_event& event) {
+  int op = in_->get();
+  if (op == std::istream::traits_type::eof()) {
+    return false;
+  }
+  if (op > static_cast<int>(trace_op::clear)) {
+    throw trace_error("bad flat_queue trace record");
+  }
+  event.op = static_cast<trace_op>(op);
+  last_ns_ += get_varint();
+  event.time_ns = last_ns_;
+  event.arg = event.op == trace_op::reserve ? get_varint() : 0;
+  return true;
+}
+
+inline std::uint64_t trace_reader::get_varint() {
+  std::uint64_t value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int byte = in_->get();
+    if (byte == std::istream::traits_type::eof()) {
+      throw trace_error("flat_queue trace is truncated");
+    }
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  throw trace_error("bad flat_queue trace record");
+}
+
+inline void trace_recorder::on_push() {
+  if (sink_) {
+    sink_->record(trace_op::push);
+  }
+}
+
+inline void trace_recorder::on_pop() {
+  if (sink_) {
+    sink_->record(trace_op::pop);
+  }
+}
+
+inline void trace_recorder::on_reserve(std::size_t new_size) {
+  if (sink_) {
+    sink_->record(trace_op::reserve, new_size);
+  }
+}
+
+inline void trace_recorder::on_clear() {
+  if (sink_) {
+    sink_->record(trace_op::clear);
+  }
+}
+
+inline trace_writer* trace_recorder::sink() const { return sink_; }
+
+inline void trace_recorder::set_sink(trace_writer* sink) { sink_ = sink; }
+}